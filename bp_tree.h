@@ -6,11 +6,18 @@
 
 #ifndef PCH
 	#include <algorithm>
+	#include <cstring>
 	#include <hash_map>
 	#include <map>
+	#include <vector>
 	#include <iostream>
 	#include <cassert>
+	#include <condition_variable>
 	#include "lru_cache.h"
+	#include "bp_tree_sync.h"
+	#include "bp_tree_stats.h"
+	#include "bp_tree_node_pool.h"
+	#include "bp_tree_wal.h"
 #endif
 
 #if !defined(BP_TREE_ASSERTIONS) && defined(_DEBUG)
@@ -23,8 +30,272 @@
 	#define BP_TREE_ASSERT(x)
 #endif
 
+// SIMD key search; define BP_TREE_NO_SIMD to always use the scalar binary search
+#ifndef BP_TREE_NO_SIMD
+	#if defined(__AVX2__)
+		#define BP_TREE_AVX2
+		#define BP_TREE_SSE2
+	#elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define BP_TREE_SSE2
+	#endif
+	#if defined(__SSE4_2__) || defined(BP_TREE_AVX2)
+		#define BP_TREE_SSE42
+	#endif
+#endif
+
+#ifdef BP_TREE_SSE2
+	#ifndef PCH
+		#include <type_traits>
+		#ifdef BP_TREE_SSE42
+			#include <nmmintrin.h>
+		#endif
+		#ifdef BP_TREE_AVX2
+			#include <immintrin.h>
+		#endif
+		#include <emmintrin.h>
+		#ifdef _MSC_VER
+			#include <intrin.h>
+		#endif
+	#endif
+
+	#ifdef _MSC_VER
+		#define BP_TREE_POPCOUNT(x) __popcnt( x)
+	#else
+		#define BP_TREE_POPCOUNT(x) __builtin_popcount( x)
+	#endif
+#endif
+
 namespace stdext
 {
+	/// Key search inside a node: returns the index of the first key not less than (lower)
+	/// or greater than (upper) the given key. Generic keys use a binary search.
+	template <typename _Key, size_t size = sizeof( _Key), bool simd = false>
+	struct bp_tree_key_search
+	{
+		static size_t lower( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			return std::lower_bound( keys, keys + count, key) - keys;
+		}
+
+		static size_t upper( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			return std::upper_bound( keys, keys + count, key) - keys;
+		}
+	};
+
+#ifdef BP_TREE_SSE2
+	/// SIMD key search for arithmetic keys. The keys of a node are sorted, so the lower bound
+	/// is the number of keys less than the searched one; all the keys are compared without
+	/// branches and the compare masks are counted.
+	template <typename _Key, typename _Vec>
+	struct bp_tree_simd_scan
+	{
+		template <typename _Less>
+		static size_t count( const _Key* const keys, const size_t count, const _Vec value, const _Key& key, _Less less)
+		{
+			const size_t lanes = sizeof( _Vec) / sizeof( _Key);
+			size_t i = 0, n = 0;
+			for( ; i + lanes <= count; i += lanes)
+			{
+				n += less( keys + i, value);
+			}
+			for( ; i < count; ++i)
+			{
+				n += less( keys[ i], key);
+			}
+			return n;
+		}
+	};
+
+	template <typename _Key>
+	struct bp_tree_simd_int32
+	{
+		// unsigned keys are compared as signed after flipping the sign bit
+		static __m128i bias()	{ return _mm_set1_epi32( std::is_signed<_Key>::value ? 0 : int( 0x80000000)); }
+
+		struct less_lower
+		{
+			__m128i b;
+			size_t operator () ( const _Key* const p, const __m128i key) const
+			{
+				const __m128i k = _mm_xor_si128( _mm_loadu_si128( (const __m128i*) p), b);
+				return BP_TREE_POPCOUNT( _mm_movemask_ps( _mm_castsi128_ps( _mm_cmplt_epi32( k, key))));
+			}
+			size_t operator () ( const _Key a, const _Key& key) const { return a < key; }
+		};
+
+		struct less_upper
+		{
+			__m128i b;
+			size_t operator () ( const _Key* const p, const __m128i key) const
+			{
+				const __m128i k = _mm_xor_si128( _mm_loadu_si128( (const __m128i*) p), b);
+				return 4 - BP_TREE_POPCOUNT( _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( k, key))));
+			}
+			size_t operator () ( const _Key a, const _Key& key) const { return !( key < a); }
+		};
+
+		static size_t lower( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			less_lower less = { bias() };
+			return bp_tree_simd_scan<_Key, __m128i>::count( keys, count, _mm_xor_si128( _mm_set1_epi32( int( key)), less.b), key, less);
+		}
+
+		static size_t upper( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			less_upper less = { bias() };
+			return bp_tree_simd_scan<_Key, __m128i>::count( keys, count, _mm_xor_si128( _mm_set1_epi32( int( key)), less.b), key, less);
+		}
+	};
+
+#ifdef BP_TREE_SSE42
+	template <typename _Key>
+	struct bp_tree_simd_int64
+	{
+	#ifdef BP_TREE_AVX2
+		typedef __m256i vector_type;
+		static vector_type bias()								{ return _mm256_set1_epi64x( std::is_signed<_Key>::value ? 0 : (long long) 0x8000000000000000ULL); }
+		static vector_type splat( const _Key& key)				{ return _mm256_xor_si256( _mm256_set1_epi64x( (long long) key), bias()); }
+		static vector_type load( const _Key* const p)			{ return _mm256_xor_si256( _mm256_loadu_si256( (const __m256i*) p), bias()); }
+		static size_t gt( const vector_type a, const vector_type b)	{ return BP_TREE_POPCOUNT( _mm256_movemask_pd( _mm256_castsi256_pd( _mm256_cmpgt_epi64( a, b)))); }
+	#else
+		typedef __m128i vector_type;
+		static vector_type bias()								{ return _mm_set1_epi64x( std::is_signed<_Key>::value ? 0 : (long long) 0x8000000000000000ULL); }
+		static vector_type splat( const _Key& key)				{ return _mm_xor_si128( _mm_set1_epi64x( (long long) key), bias()); }
+		static vector_type load( const _Key* const p)			{ return _mm_xor_si128( _mm_loadu_si128( (const __m128i*) p), bias()); }
+		static size_t gt( const vector_type a, const vector_type b)	{ return BP_TREE_POPCOUNT( _mm_movemask_pd( _mm_castsi128_pd( _mm_cmpgt_epi64( a, b)))); }
+	#endif
+		enum E { lanes = sizeof( vector_type) / sizeof( _Key) };
+
+		struct less_lower
+		{
+			size_t operator () ( const _Key* const p, const vector_type key) const	{ return gt( key, load( p)); }
+			size_t operator () ( const _Key a, const _Key& key) const				{ return a < key; }
+		};
+
+		struct less_upper
+		{
+			size_t operator () ( const _Key* const p, const vector_type key) const	{ return lanes - gt( load( p), key); }
+			size_t operator () ( const _Key a, const _Key& key) const				{ return !( key < a); }
+		};
+
+		static size_t lower( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			return bp_tree_simd_scan<_Key, vector_type>::count( keys, count, splat( key), key, less_lower());
+		}
+
+		static size_t upper( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			return bp_tree_simd_scan<_Key, vector_type>::count( keys, count, splat( key), key, less_upper());
+		}
+	};
+#endif
+
+	template <typename _Key>
+	struct bp_tree_simd_float
+	{
+		typedef typename std::conditional<sizeof( _Key) == 4, __m128, __m128d>::type vector_type;
+
+		static __m128 splat( const float key)					{ return _mm_set1_ps( key); }
+		static __m128d splat( const double key)					{ return _mm_set1_pd( key); }
+		static __m128 load( const float* const p)				{ return _mm_loadu_ps( p); }
+		static __m128d load( const double* const p)				{ return _mm_loadu_pd( p); }
+		static size_t lt( const __m128 a, const __m128 b)		{ return BP_TREE_POPCOUNT( _mm_movemask_ps( _mm_cmplt_ps( a, b))); }
+		static size_t lt( const __m128d a, const __m128d b)		{ return BP_TREE_POPCOUNT( _mm_movemask_pd( _mm_cmplt_pd( a, b))); }
+		static size_t le( const __m128 a, const __m128 b)		{ return BP_TREE_POPCOUNT( _mm_movemask_ps( _mm_cmple_ps( a, b))); }
+		static size_t le( const __m128d a, const __m128d b)		{ return BP_TREE_POPCOUNT( _mm_movemask_pd( _mm_cmple_pd( a, b))); }
+
+		struct less_lower
+		{
+			size_t operator () ( const _Key* const p, const vector_type key) const	{ return lt( load( p), key); }
+			size_t operator () ( const _Key a, const _Key& key) const				{ return a < key; }
+		};
+
+		struct less_upper
+		{
+			size_t operator () ( const _Key* const p, const vector_type key) const	{ return le( load( p), key); }
+			size_t operator () ( const _Key a, const _Key& key) const				{ return !( key < a); }
+		};
+
+		static size_t lower( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			return bp_tree_simd_scan<_Key, vector_type>::count( keys, count, splat( key), key, less_lower());
+		}
+
+		static size_t upper( const _Key* const keys, const size_t count, const _Key& key)
+		{
+			return bp_tree_simd_scan<_Key, vector_type>::count( keys, count, splat( key), key, less_upper());
+		}
+	};
+
+	template <typename _Key> struct bp_tree_key_search<_Key, 4, true>: std::conditional<std::is_floating_point<_Key>::value, bp_tree_simd_float<_Key>, bp_tree_simd_int32<_Key> >::type {};
+#ifdef BP_TREE_SSE42
+	template <typename _Key> struct bp_tree_key_search<_Key, 8, true>: std::conditional<std::is_floating_point<_Key>::value, bp_tree_simd_float<_Key>, bp_tree_simd_int64<_Key> >::type {};
+#else
+	template <typename _Key> struct bp_tree_key_search<_Key, 8, true>: std::conditional<std::is_floating_point<_Key>::value, bp_tree_simd_float<_Key>, bp_tree_key_search<_Key, 8, false> >::type {};
+#endif
+
+	/// Key search picked at compile time: SIMD for arithmetic keys, binary search otherwise
+	template <typename _Key>
+	struct bp_tree_node_search: bp_tree_key_search<_Key, sizeof( _Key), std::is_arithmetic<_Key>::value && ( sizeof( _Key) == 4 || sizeof( _Key) == 8)> {};
+#else
+	template <typename _Key>
+	struct bp_tree_node_search: bp_tree_key_search<_Key> {};
+#endif
+
+	/// CRC32C (Castagnoli) of the node pages, computed by the SSE4.2 crc32 instruction when
+	/// available and from a table otherwise
+	struct bp_tree_crc32c
+	{
+		static unsigned update( unsigned crc, const void* const data, size_t bytes)
+		{
+			const unsigned char* p = (const unsigned char*) data;
+		#ifdef BP_TREE_SSE42
+			#if defined(_M_X64) || defined(__x86_64__)
+			for( ; bytes >= 8; bytes -= 8, p += 8)
+			{
+				unsigned long long word;
+				memcpy( &word, p, 8);
+				crc = unsigned( _mm_crc32_u64( crc, word));
+			}
+			#endif
+			for( ; bytes; --bytes)
+			{
+				crc = _mm_crc32_u8( crc, *p++);
+			}
+		#else
+			static const table t;
+			for( ; bytes; --bytes)
+			{
+				crc = t.values[ ( crc ^ *p++) & 0xff] ^ ( crc >> 8);
+			}
+		#endif
+			return crc;
+		}
+
+		static unsigned begin()						{ return ~0u; }
+		static unsigned end( const unsigned crc)	{ return ~crc; }
+
+	private:
+		struct table
+		{
+			unsigned values[ 256];
+
+			table()
+			{
+				for( unsigned i = 0; i < 256; ++i)
+				{
+					unsigned crc = i;
+					for( int bit = 0; bit < 8; ++bit)
+					{
+						crc = crc & 1 ? ( crc >> 1) ^ 0x82f63b78u : crc >> 1;
+					}
+					values[ i] = crc;
+				}
+			}
+		};
+	};
+
 	template <typename _Key, typename _Val, typename _Bitmap>
 	class bp_tree_default_stream
 	{
@@ -41,6 +312,8 @@ namespace stdext
 		}
 
 		bool compact_;
+		bool packed_;
+		bool bit_packed_;
 
 	public:
 		typedef _Key	key_type;
@@ -51,10 +324,12 @@ namespace stdext
 		enum E
 		{
 			key_storage_size	= sizeof( _Key),
-			value_storage_size	= sizeof( _Val)
+			value_storage_size	= sizeof( _Val),
+			prefetches			= 0,	//< prefetch is a no-op, the tree does not look for what to hint
+			durable				= 0		//< sync only flushes the iostream, bp_tree::open refuses a write-ahead log
 		};
 
-		bp_tree_default_stream( std::iostream& s): io( s), compact_( false)
+		bp_tree_default_stream( std::iostream& s): io( s), compact_( false), packed_( false), bit_packed_( false)
 		{
 			s.seekg( 0);
 		}
@@ -69,6 +344,44 @@ namespace stdext
 			compact_ = value;
 		}
 
+		bool is_packed() const
+		{
+			return packed_;
+		}
+
+		/// Packed key blocks, compact files only
+		void set_packed( const bool value)
+		{
+			packed_ = value;
+		}
+
+		bool is_bit_packed() const
+		{
+			return bit_packed_;
+		}
+
+		/// Bit packed keys and values, compact files only; takes over from set_packed
+		void set_bit_packed( const bool value)
+		{
+			bit_packed_ = value;
+		}
+
+		/// Bytes taken by a key block of a compact file
+		size_t packed_keys_size( const key_type* const keys, const size_t used) const
+		{
+			if ( bit_packed_)
+			{
+				return bp_tree_for_codec<key_type>::size( keys, used);
+			}
+			return packed_ ? bp_tree_key_codec<key_type>::size( keys, used) : sizeof( key_type) * used;
+		}
+
+		/// Bytes taken by a value block of a compact file
+		size_t packed_data_size( const value_type* const data, const size_t used) const
+		{
+			return bit_packed_ ? bp_tree_for_codec<value_type>::size( data, used) : sizeof( value_type) * used;
+		}
+
 		void read( void* data, const size_t bytes)
 		{
 			io.read( (char*) data, bytes);
@@ -81,19 +394,47 @@ namespace stdext
 
 		void read_keys( key_type* const keys, const size_t used, const size_t count, const bitmap_type bmp)
 		{
-			read( keys, sizeof( key_type) * used);
-			if ( !compact_)
+			if ( bit_packed_)
+			{
+				if ( !bp_tree_for_codec<key_type>::read( *this, keys, used))
+				{
+					io.setstate( std::ios_base::failbit);
+				}
+			}
+			else if ( packed_)
+			{
+				if ( !bp_tree_key_codec<key_type>::read( *this, keys, used))
+				{
+					io.setstate( std::ios_base::failbit);
+				}
+			}
+			else
 			{
-				skip_keys( count - used);
+				read( keys, sizeof( key_type) * used);
+				if ( !compact_)
+				{
+					skip_keys( count - used);
+				}
 			}
 		}
 
 		void write_keys( const key_type* const keys, const size_t used, const size_t count, const bitmap_type bmp)
 		{
-			write( keys, sizeof( key_type) * used);
-			if ( !compact_)
+			if ( bit_packed_)
+			{
+				bp_tree_for_codec<key_type>::write( *this, keys, used);
+			}
+			else if ( packed_)
 			{
-				skip_keys( count - used);
+				bp_tree_key_codec<key_type>::write( *this, keys, used);
+			}
+			else
+			{
+				write( keys, sizeof( key_type) * used);
+				if ( !compact_)
+				{
+					skip_keys( count - used);
+				}
 			}
 		}
 
@@ -113,19 +454,36 @@ namespace stdext
 
 		void read_data( value_type* const data, const size_t used, const size_t count, const bitmap_type bmp)
 		{
-			read( data, sizeof( value_type) * used);
-			if ( !compact_)
+			if ( bit_packed_)
+			{
+				if ( !bp_tree_for_codec<value_type>::read( *this, data, used))
+				{
+					io.setstate( std::ios_base::failbit);
+				}
+			}
+			else
 			{
-				skip_data( count - used);
+				read( data, sizeof( value_type) * used);
+				if ( !compact_)
+				{
+					skip_data( count - used);
+				}
 			}
 		}
 
 		void write_data( const value_type* const data, const size_t used, const size_t count, const bitmap_type bmp)
 		{
-			write( data, sizeof( value_type) * used);
-			if ( !compact_)
+			if ( bit_packed_)
+			{
+				bp_tree_for_codec<value_type>::write( *this, data, used);
+			}
+			else
 			{
-				skip_data( count - used);
+				write( data, sizeof( value_type) * used);
+				if ( !compact_)
+				{
+					skip_data( count - used);
+				}
 			}
 		}
 
@@ -148,6 +506,26 @@ namespace stdext
 		{
 			return !io.fail() && !io.bad();
 		}
+
+		/// Bytes of the file
+		size_t size() const
+		{
+			const std::streampos pos = io.tellg();
+			io.seekg( 0, std::ios_base::end);
+			const size_t size = size_t( io.tellg());
+			io.seekg( pos);
+			return size;
+		}
+
+		/// Flushes the stream buffer; the OS may still hold the data
+		bool sync()
+		{
+			return !io.flush().fail();
+		}
+
+		/// Read-ahead hint for [offset, offset + bytes); an iostream has no way to read
+		/// asynchronously, so it is ignored
+		void prefetch( const offset_type offset, const size_t bytes) const {}
 	};
 
 	
@@ -157,23 +535,84 @@ namespace stdext
 		{
 			slot_count		= 63,
 			signature_size	= 2,
-			leaf_marker_size= 2
+			leaf_marker_size= 2,
+			checksum_size	= 4,	// CRC32C stored after every node, 0 disables
+			read_ahead		= 8,	// leaves hinted to the stream ahead of an iterator, 0 disables; only for streams that prefetch
+			node_pool		= 1,	// nodes come from slabs sized from the cache, 0 allocates each one
+			page_size		= 0,	// 4096, 8192, 16384 or 65536 derive slot_count from the page, see bp_tree_page_layout
+			huge_pages		= 0		// backs the node slabs with huge pages where the system allows
 		};
 
 		typedef unsigned char		slotn_t;		// slot number type
 		typedef unsigned long long	bitmap_type;
+		typedef bp_tree_no_sync		sync_type;		// bp_tree_read_sync for concurrent readers
+		typedef bp_tree_no_stats	stats_type;		// bp_tree_stats to collect the counters of statistics()
 
-		static const char* const signature()	{ return "B+"; }
+		static const char* const signature()	{ return "BT"; }	// "B+" before the header had a format version
 		static const char* const leaf_marker()	{ return "<>"; }
 	};
 
+	/// Node geometry of a tree whose traits set a page size: the most slots whose leaves and
+	/// inner nodes fit the page, but no more than _MaxSlots (the bits of the change bitmaps).
+	/// When the cap leaves most of the page unused, the page is halved as long as the nodes of
+	/// the half keep 3/4 of the slots, so nodes take a power of 2 fraction of a page (stride),
+	/// are aligned to it and never straddle two pages.
+	template <size_t _Page, size_t _LeafFixed, size_t _LeafSlot, size_t _InnerFixed, size_t _InnerSlot, size_t _MaxSlots>
+	struct bp_tree_page_layout
+	{
+		template <size_t _Bytes>
+		struct _Fit
+		{
+			enum
+			{
+				leaf	= _Bytes > _LeafFixed ? ( _Bytes - _LeafFixed) / _LeafSlot : 0,
+				inner	= _Bytes > _InnerFixed ? ( _Bytes - _InnerFixed) / _InnerSlot : 0,
+				slots	= leaf < inner ? leaf : inner
+			};
+		};
+
+		template <size_t _Bytes, bool _Halve = ( _Fit<_Bytes>::slots > _MaxSlots && _Fit<_Bytes / 2>::slots >= _MaxSlots * 3 / 4)>
+		struct _Stride
+		{
+			enum
+			{
+				stride		= _Bytes,
+				slot_count	= _Fit<_Bytes>::slots < _MaxSlots ? _Fit<_Bytes>::slots : _MaxSlots
+			};
+		};
+
+		template <size_t _Bytes>
+		struct _Stride<_Bytes, true>: _Stride<_Bytes / 2> {};
+
+		enum
+		{
+			page_size	= _Page,
+			stride		= _Stride<_Page>::stride,
+			slot_count	= _Stride<_Page>::slot_count
+		};
+
+		static_assert( _Page == 0 || slot_count >= 3, "page_size too small for the key and value types");
+
+		/// The page size in the high nibble of the header flags, log2( page) - 7, 0 without pages
+		static char flag()
+		{
+			char code = 0;
+			for( size_t bytes = _Page; bytes > 128; bytes >>= 1)
+			{
+				++code;
+			}
+			return char( code << 4);
+		}
+	};
+
 	/// B+ Tree
 	template <typename	_Key,									// key type
 			typename	_Val,									// value type
 			typename	_Traits		= bp_tree_default_traits,	// default traits
 			typename	_Stream		= bp_tree_default_stream<_Key,_Val, typename bp_tree_default_traits::bitmap_type>,	// io stream type
 			typename	_KeyComp	= void,						// key comparator predicate type - not used yet
-			typename	_Alloc		= std::allocator< _Val>		// allocator
+			typename	_Alloc		= std::allocator< _Val>,	// allocator
+			template <typename, typename> class _CachePolicy = lru_cache_lru_policy // node cache eviction policy, e.g. lru_cache_2q_policy
 	>
 	class bp_tree
 	{
@@ -183,15 +622,46 @@ namespace stdext
 		typedef _Stream		stream_type;
 		typedef _KeyComp	key_compare;
 		typedef typename _Stream::offset_type	offset_type;
+		typedef bp_tree_wal<_Key, _Val>			wal_type;
+
+		enum
+		{
+			format_version	= 2		//< stored after the signature, bumped when the file layout changes
+		};
+
+		/// Why open returned false
+		enum open_error_type
+		{
+			no_error,
+			bad_signature,	//< not a tree file, or one of other traits
+			bad_version,	//< written by another format_version, or before the header had one
+			bad_layout,		//< the node checksums or the page size differ from the traits
+			bad_data,		//< the header or the root nodes could not be read or failed their checksum
+			bad_log			//< a write-ahead log given over a stream whose sync does not reach the disk
+		};
 
 	protected:
 		struct _Node;
 		struct _Inner;
 		struct _Leaf;
+		struct _Flusher;
+		struct _Shadow;
 
 		typedef typename _Traits				traits;
 		typedef typename _Traits::slotn_t		slotn_t;
 		typedef typename _Traits::bitmap_type	bitmap_type;
+		typedef typename _Traits::sync_type		_Sync;
+		typedef typename _Sync::latch_type		_Latch;
+		typedef typename _Sync::epoch_type		_Epoch;
+		typedef typename _Sync::mutex_type		_Mutex;
+		typedef typename _Traits::stats_type	_Stats;
+		typedef bp_tree_page_layout<_Traits::page_size,
+			_Traits::leaf_marker_size + sizeof( slotn_t) + 2 * sizeof( offset_type) + _Traits::checksum_size,
+			_Stream::key_storage_size + _Stream::value_storage_size,
+			sizeof( slotn_t) + sizeof( offset_type) + _Traits::checksum_size,
+			_Stream::key_storage_size + sizeof( offset_type),
+			( sizeof( bitmap_type) * 8 - 1 < 255 ? sizeof( bitmap_type) * 8 - 1 : 255)>	_Layout;
+		typedef std::lock_guard<_Mutex>			_Lock;
 		typedef pair<_Leaf*, slotn_t>			_IterDef;
 
 		template <typename Node>
@@ -211,7 +681,7 @@ namespace stdext
 		{
 			enum E
 			{
-				slot_count		= _Traits::slot_count,
+				slot_count		= _Traits::page_size ? _Layout::slot_count : _Traits::slot_count,
 				slot_mid		= ( slot_count + 1) / 2,
 				extra			= slot_count % 2,
 				min_slots		= slot_count / 2,
@@ -221,6 +691,7 @@ namespace stdext
 			size_t				level;				//< Level in the b-tree, if level == 0 -> leaf node
 			slotn_t				used_slots;			//< Number of key slotuse use, so number of valid children or data pointers
 			mutable bitmap_type	key_changes_bmp;
+			mutable _Latch		latch;				//< Guards the links to other nodes when readers are concurrent
 			key_type			keys[ slot_count];
 			offset_type			offset;
 			_Inner*				parent;
@@ -252,31 +723,60 @@ namespace stdext
 			slotn_t find_upper( const key_type& key) const
 			{
 				if ( !used_slots) return 0;
-				const key_type* const p = std::upper_bound( keys, keys + used_slots, key);
-				return p - keys;
+				return slotn_t( bp_tree_node_search<key_type>::upper( keys, used_slots, key));
 			}
 
 			slotn_t find_lower( const key_type& key) const
 			{
 				if ( !used_slots) return 0;
-				const key_type* const p = std::lower_bound( keys, keys + used_slots, key);
-				return p - keys;
+				return slotn_t( bp_tree_node_search<key_type>::lower( keys, used_slots, key));
 			}
 
-			void is_key_changed( const slotn_t index) const
+			bool is_key_changed( const slotn_t index) const
 			{
-				return key_changes_bmp & ( Bitmap( 1) << index);
+				return ( key_changes_bmp & ( bitmap_type( 1) << index)) != 0;
 			}
 
 			void mark_key_changed( const slotn_t index)
 			{
-				key_changes_bmp |= Bitmap( 1) << index;
+				key_changes_bmp |= bitmap_type( 1) << index;
+			}
+
+			// checksum of the slot count and the keys
+			unsigned checksum_( unsigned crc) const
+			{
+				crc = bp_tree_crc32c::update( crc, &used_slots, sizeof( used_slots));
+				return bp_tree_crc32c::update( crc, keys, sizeof( key_type) * used_slots);
 			}
 
 		protected:
+			static void save_checksum( stream_type& out, const unsigned crc)
+			{
+				if ( traits::checksum_size)
+				{
+					out.write( &crc, traits::checksum_size);
+				}
+			}
+
+			// reads the stored checksum, true if it matches crc
+			static bool load_checksum( stream_type& input, const unsigned crc)
+			{
+				unsigned stored = 0;
+				if ( traits::checksum_size)
+				{
+					input.read( &stored, traits::checksum_size);
+				}
+				return !traits::checksum_size || ( input.ok() && stored == crc);
+			}
+
 			bool raw_load_from( stream_type& input)
 			{
 				input.read( &used_slots, sizeof( used_slots));
+				if ( used_slots > slot_count)
+				{
+					used_slots = 0; // corrupt
+					return false;
+				}
 				input.read_keys( keys, used_slots, slot_count, key_changes_bmp);
 				return input.ok();
 			}
@@ -288,81 +788,65 @@ namespace stdext
 				return out.ok();
 			}
 
-			template <const size_t additional_data, typename _Val>
-			static _Val& split_( slotn_t& key_pos, slotn_t& dest_used_slots, slotn_t& src_used_slots,
-						key_type* const dest_keys, _Val* const dest_values,
-						key_type* const src_keys,  _Val* const src_values,
-						const key_type& key)
+			/// Splits this full node into itself and dest while inserting key at key_pos.
+			/// values holds one value per key (children + 1 for inner nodes) and is moved along
+			/// with the keys; returns true if the key went to dest, key_pos being its new position.
+			template <typename _V>
+			bool split_( _Node& dest, _V* const values, _V* const dest_values, slotn_t& key_pos, const key_type& key)
 			{
-				_Val* result;
-				if ( key_pos < slot_mid)
+				enum { lower = ( slot_count + 1) / 2 };
+				const bool upper = key_pos >= lower;
+				if ( upper)
 				{
-					std::move( src_keys + slot_mid - extra + additional_data, src_keys + slot_count, dest_keys);
-					std::rotate( src_keys + key_pos, src_keys + slot_mid - 1, src_keys + slot_mid);
-
-					src_keys[ key_pos] = key;
-					result = src_values + key_pos;
-
-					std::move( src_values + slot_mid - extra + additional_data, src_values + slot_count + additional_data, dest_values);
-					std::rotate( src_values + key_pos, src_values + slot_mid - 1 + additional_data, src_values + slot_mid + additional_data);
+					const slotn_t pos = key_pos - lower;
+					std::move( keys   + lower, keys   + key_pos, dest.keys);
+					std::move( values + lower, values + key_pos, dest_values);
+					std::move( keys   + key_pos, keys   + slot_count, dest.keys   + pos + 1);
+					std::move( values + key_pos, values + slot_count, dest_values + pos + 1);
+					dest.keys[ pos] = key;
+					key_pos = pos;
 				}
 				else
 				{
-					const size_t new_key_pos = key_pos - slot_mid - !extra;
-					if ( new_key_pos)
-					{
-						std::move( src_keys   + slot_mid + !extra + additional_data, src_keys   + key_pos, dest_keys);
-						std::move( src_values + slot_mid + !extra + additional_data, src_values + key_pos + additional_data, dest_values);
-					}
-
-					dest_keys[ new_key_pos - additional_data] = key;
-					result = dest_values + new_key_pos;
-
-					std::move( src_keys   + key_pos, src_keys   + slot_count, dest_keys   + new_key_pos + 1);
-					std::move( src_values + key_pos, src_values + slot_count + additional_data, dest_values + new_key_pos + 1);
-
-					key_pos = new_key_pos;
+					std::move( keys   + lower - 1, keys   + slot_count, dest.keys);
+					std::move( values + lower - 1, values + slot_count, dest_values);
+					std::move_backward( keys   + key_pos, keys   + lower - 1, keys   + lower);
+					std::move_backward( values + key_pos, values + lower - 1, values + lower);
+					keys[ key_pos] = key;
 				}
 
-				dest_used_slots = slot_mid - additional_data;
-				src_used_slots = slot_count - slot_mid + extra;
-				return *result;
+				used_slots = lower;
+				dest.used_slots = slot_count + 1 - lower;
+				key_changes_bmp = dest.key_changes_bmp = bitmap_type( ~0);
+				return upper;
 			}
 
-			template <const size_t additional_data, typename _Val>
-			void insert_( const key_type& key, const slotn_t pos, _Val* const values)
+			template <typename _V>
+			void insert_( const key_type& key, const slotn_t pos, _V* const values)
 			{
-				if ( pos < used_slots)
-				{
-					key_type* const keys_ptr = keys + used_slots;
-					_Val* const values_ptr = values + used_slots + additional_data;
-
-					std::rotate( keys + pos, keys_ptr, keys_ptr + 1);
-					std::rotate( values + pos, values_ptr, values_ptr + 1);
-				}
-				++used_slots;
-				BP_TREE_ASSERT( used_slots <= traits::slot_count);
-				BP_TREE_ASSERT( pos < used_slots);
+				BP_TREE_ASSERT( used_slots < slot_count && pos <= used_slots);
+				std::move_backward( keys   + pos, keys   + used_slots, keys   + used_slots + 1);
+				std::move_backward( values + pos, values + used_slots, values + used_slots + 1);
 				keys[ pos] = key;
+				++used_slots;
+				key_changes_bmp |= bitmap_type( ~0) << pos;
 			}
 
-			template <typename _Val>
-			void erase_( const key_type& key, _Val* const values)
+			template <typename _V>
+			void erase_( const slotn_t pos, _V* const values)
 			{
-				return erase( key, find_lower( key), values);
+				erase_( pos, pos + 1, values);
 			}
 
-			template <const size_t additional_data, typename _Val>
-			void erase_( const key_type& key, const slotn_t pos, _Val* const values)
+			// removes the keys and values of [ first, last)
+			template <typename _V>
+			void erase_( const slotn_t first, const slotn_t last, _V* const values)
 			{
-				if ( pos < used_slots)
-				{
-					key_type* const dest_keys = keys + pos;
-					_Val* const dest_values = values + pos;
-					std::move( dest_keys + 1, dest_keys + count, dest_keys);
-					std::move( dest_values + 1, dest_values + count + additional_data, dest_values);
-					--used_slots;
-				}
+				BP_TREE_ASSERT( first < last && last <= used_slots);
+				std::move( keys   + last, keys   + used_slots, keys   + first);
+				std::move( values + last, values + used_slots, values + first);
+				used_slots -= last - first;
+				key_changes_bmp |= bitmap_type( ~0) << first;
 			}
 
 			template <typename T>
@@ -410,15 +894,21 @@ namespace stdext
 
 			bool is_changed() const { return key_changes_bmp != 0; }
 
-			enum E { storage_size = _Node::storage_size + ( slot_count + 1) * sizeof( offset_type) };
+			enum E
+			{
+				storage_size	= _Node::storage_size + ( slot_count + 1) * sizeof( offset_type) + traits::checksum_size,
+				stride_size		= traits::page_size ? _Layout::stride : storage_size	//< file space of a node
+			};
 
 			bitmap_type is_ptr_at( const slotn_t index) const { return children_ptr_bmp & ( bitmap_type( 1) << index); }
 
 			void link( const slotn_t index, _Node* const node)
 			{
 				node->parent = this;
+				latch.lock();
 				children_ptr_bmp |= bitmap_type( 1) << index;
 				children[ index].ptr = node;
+				latch.unlock();
 			}
 
 			//void unlink( const slotn_t index, const offset_type offset)
@@ -436,8 +926,10 @@ namespace stdext
 					if ( child->ptr == node)
 					{
 						BP_TREE_ASSERT( children_ptr_bmp & mask);
+						latch.lock();
 						children_ptr_bmp &= ~mask;
 						child->offset = node->offset;
+						latch.unlock();
 						break;
 					}
 				}
@@ -457,19 +949,36 @@ namespace stdext
 			bool raw_load_from( stream_type& input)
 			{
 				//input.read( &level, sizeof( level));
-				_Node::raw_load_from( input);
+				if ( !_Node::raw_load_from( input))
+				{
+					return false;
+				}
 				input.read_offsets( (offset_type*) children, used_slots + 1, slot_count + 1);
 				if ( input.ok())
 				{
 					key_changes_bmp = 0;
 					children_ptr_bmp = 0;
 				}
-				return input.ok();
+				return load_checksum( input, checksum());
+			}
+
+			unsigned checksum() const
+			{
+				unsigned crc = _Node::checksum_( bp_tree_crc32c::begin());
+				bitmap_type flag = 1;
+				for( slotn_t i = 0; i < used_slots + 1; ++i, flag <<= 1)
+				{
+					const offset_type offset = child_offset( flag, i);
+					crc = bp_tree_crc32c::update( crc, &offset, sizeof( offset_type));
+				}
+				return bp_tree_crc32c::end( crc);
 			}
 
-			size_t actual_storage_size() const 
-			{ 
-				return storage_size - ( slot_count - used_slots) * ( stream_type::key_storage_size + sizeof( offset_type));
+			/// Size in the compact file out, with keys (the separators written instead of the node's)
+			/// packed by the stream
+			size_t actual_storage_size( const stream_type& out, const key_type* const keys) const
+			{
+				return sizeof( slotn_t) + out.packed_keys_size( keys, used_slots) + ( used_slots + 1) * sizeof( offset_type) + traits::checksum_size;
 			}
 
 			offset_type child_offset( const bitmap_type flag, const slotn_t index) const
@@ -506,6 +1015,7 @@ namespace stdext
 					}
 
 					out.skip( sizeof( offset_type) * ( slot_count - used_slots));
+					save_checksum( out, checksum());
 
 					if ( out.ok())
 					{
@@ -518,39 +1028,61 @@ namespace stdext
 
 			void insert( const key_type& key, _Node* const node)
 			{
-				const slotn_t pos = find_lower( key);
-				insert_<1>( key, pos, children + 1);
-				children_ptr_bmp = bit_insert( children_ptr_bmp, pos);
+				const slotn_t pos = find_upper( key);
+				insert_( key, pos, children + 1);
+				children_ptr_bmp = bit_insert( children_ptr_bmp, pos + 1);
 				link( pos + 1, node);
 			}
 
+			// removes the key at pos and the child at its right
+			void erase( const slotn_t pos)
+			{
+				erase_( pos, children + 1);
+				children_ptr_bmp = bit_erase( children_ptr_bmp, pos + 1);
+			}
+
 			static bitmap_type bit_insert( bitmap_type bits, const slotn_t key_pos)
 			{
 				const bitmap_type mask = bitmap_type( ~0) << key_pos;
 				return ( ( bits & mask) << 1) | ( bitmap_type( 1) << key_pos) | ( bits & ~mask);
 			}
 
-			void split( key_type& key_for_parent, _Inner& new_inner, const key_type& key, _Node* const new_child)
+			static bitmap_type bit_erase( bitmap_type bits, const slotn_t index)
 			{
-				slotn_t orig_key_pos;
-				slotn_t key_pos = orig_key_pos = find_lower( key);
-				BP_TREE_ASSERT( key_pos <= slot_count);
-				split_<1, _NodeRef>( key_pos, new_inner.used_slots, used_slots, new_inner.keys, new_inner.children, keys, children, key);
-
-				BP_TREE_ASSERT( used_slots < slot_count);
-				BP_TREE_ASSERT( new_inner.used_slots < slot_count);
+				const bitmap_type mask = ( bitmap_type( 1) << index) - 1;
+				return ( bits & mask) | ( ( bits >> 1) & ~mask);
+			}
 
-				bitmap_type bits = children_ptr_bmp;
-				if ( key_pos != orig_key_pos)
+			void split( key_type& key_for_parent, _Inner& new_inner, const key_type& key, _Node* const new_child)
+			{
+				const bitmap_type bits = children_ptr_bmp;
+				const slotn_t key_pos = find_upper( key);
+				slotn_t pos = key_pos;
+				_Inner& node = split_( new_inner, children + 1, new_inner.children + 1, pos, key) ? new_inner : *this;
+				node.children[ pos + 1].ptr = new_child;
+				new_child->parent = &node;
+
+				// the last key of the lower half goes up, its child becomes the first of the upper half
+				key_for_parent = keys[ --used_slots];
+				new_inner.children[ 0] = children[ used_slots + 1];
+
+				children_ptr_bmp = new_inner.children_ptr_bmp = 0;
+				for( size_t i = 0; i < slot_count + 2; ++i)
 				{
-					bits >>= slot_mid + extra;
+					const bool is_ptr = i <= key_pos ? ( ( bits >> i) & 1) != 0 : i == key_pos + 1 || ( ( bits >> ( i - 1)) & 1) != 0;
+					if ( is_ptr)
+					{
+						if ( i <= used_slots)
+						{
+							children_ptr_bmp |= bitmap_type( 1) << i;
+						}
+						else
+						{
+							new_inner.children_ptr_bmp |= bitmap_type( 1) << ( i - used_slots - 1);
+						}
+					}
 				}
-
-				new_inner.children_ptr_bmp = bit_insert( bits, key_pos);
-				new_inner.children[ key_pos].ptr = new_child;
 				new_inner.set_as_parent();
-
-				key_for_parent = keys[ slot_mid];
 			}
 
 			void set_as_parent()
@@ -586,7 +1118,8 @@ namespace stdext
 				sibling_prev = 1,
 				sibling_mask_next = 1,
 				sibling_mask_prev = 2,
-				storage_size = traits::leaf_marker_size + _Node::storage_size + 2 * sizeof( offset_type) + slot_count * stream_type::value_storage_size
+				storage_size = traits::leaf_marker_size + _Node::storage_size + 2 * sizeof( offset_type) + slot_count * stream_type::value_storage_size + traits::checksum_size,
+				stride_size	= traits::page_size ? _Layout::stride : storage_size	//< file space of a node
 			};
 
 			_Leaf( const offset_type offset = 0, _Inner* const parent = 0):
@@ -631,13 +1164,12 @@ namespace stdext
 				{
 					input.read_offsets( (offset_type*) siblings, 2);
 					input.read_data( data, used_slots, slot_count, data_changes_bmp);
-					BP_TREE_ASSERT( used_slots);
 					if ( input.ok())
 					{
 						siblings_ptr_bmp = 0;
 						clear_change_flags();
 					}
-					return input.ok();
+					return load_checksum( input, checksum()) && used_slots;
 				}
 				return false;
 			}
@@ -649,6 +1181,7 @@ namespace stdext
 				save_sibling( out, sibling_next);
 				save_sibling( out, sibling_prev);
 				out.write_data( data, used_slots, slot_count, data_changes_bmp);
+				save_checksum( out, checksum());
 				if ( out.ok())
 				{
 					clear_change_flags();
@@ -656,50 +1189,80 @@ namespace stdext
 				return out.ok();
 			}
 
-			size_t actual_storage_size() const 
-			{ 
-				return storage_size - ( slot_count - used_slots) * ( stream_type::key_storage_size + stream_type::value_storage_size);
+			unsigned checksum() const
+			{
+				unsigned crc = _Node::checksum_( bp_tree_crc32c::begin());
+				for( int i = 0; i < 2; ++i)
+				{
+					const offset_type offset = sibling_offset( i);
+					crc = bp_tree_crc32c::update( crc, &offset, sizeof( offset_type));
+				}
+				return bp_tree_crc32c::end( bp_tree_crc32c::update( crc, data, sizeof( value_type) * used_slots));
+			}
+
+			offset_type sibling_offset( const int index) const
+			{
+				return ( siblings_ptr_bmp & ( bitmap_type( 1) << index)) ? siblings[ index].ptr->offset : siblings[ index].offset;
+			}
+
+			/// Size in the compact file out, keys and values packed by the stream
+			size_t actual_storage_size( const stream_type& out) const
+			{
+				return traits::leaf_marker_size + sizeof( slotn_t) + out.packed_keys_size( keys, used_slots)
+					+ 2 * sizeof( offset_type) + out.packed_data_size( data, used_slots) + traits::checksum_size;
 			}
 
 			value_type& insert( const key_type& key)
 			{
-				return insert<0>( key, data);
+				return insert( key, find_lower( key));
 			}
 
 			value_type& insert( const key_type& key, const slotn_t pos)
 			{
-				insert_<0>( key, pos, data);
+				insert_( key, pos, data);
+				data_changes_bmp |= bitmap_type( ~0) << pos;
 				return data[ pos];
 			}
 
-			void erase( const key_type& key)
+			void erase( const slotn_t pos)
 			{
-				erase<0>( key);
+				erase_( pos, data);
+				data_changes_bmp |= bitmap_type( ~0) << pos;
 			}
 
-			value_type& split( _IterDef& def, key_type& key_for_parent, _Leaf& new_leaf, const key_type& key)
+			void erase( const slotn_t first, const slotn_t last)
 			{
-				const slotn_t orig_key_pos = find_lower( key);
-				slotn_t key_pos = orig_key_pos;
-				value_type& res = split_<0, value_type>( key_pos, new_leaf.used_slots, used_slots, new_leaf.keys, new_leaf.data, keys, data, key);
-				def.first  = key_pos == orig_key_pos ? this : &new_leaf;
-				def.second = key_pos;
+				erase_( first, last, data);
+				data_changes_bmp |= bitmap_type( ~0) << first;
+			}
+
+			value_type& split( _IterDef& def, key_type& key_for_parent, _Leaf& new_leaf, const key_type& key)
+			{
+				slotn_t key_pos = find_lower( key);
+				_Leaf& node = split_( new_leaf, data, new_leaf.data, key_pos, key) ? new_leaf : *this;
+				data_changes_bmp = new_leaf.data_changes_bmp = bitmap_type( ~0);
+				def.first  = &node;
+				def.second = key_pos;
 				key_for_parent = new_leaf.keys[ 0];
-				return res;
+				return node.data[ key_pos];
 			}
 
 			size_t is_sibling_ptr_at( const slotn_t index) const { return siblings_ptr_bmp & ( bitmap_type( 1) << index); }
 
 			void link_sibling( _Leaf* const node, const int index)
 			{
+				latch.lock();
 				siblings_ptr_bmp |= bitmap_type( 1) << index;
 				siblings[ index].ptr = node;
+				latch.unlock();
 			}
 
 			void unlink_sibling( const slotn_t index, const offset_type offset)
 			{
+				latch.lock();
 				siblings_ptr_bmp &= ~( bitmap_type( 1) << index);
 				siblings[ index].offset = offset;
+				latch.unlock();
 			}
 
 			void clear()
@@ -713,7 +1276,7 @@ namespace stdext
 				const bitmap_type mask = bitmap_type( 1) << index; 
 				if ( siblings_changes_bmp & mask)
 				{
-					const offset_type offset = ( siblings_ptr_bmp & mask) ? siblings[ index].ptr->offset : siblings[ index].offset;
+					const offset_type offset = sibling_offset( index);
 					out.write( &offset, sizeof( offset_type));
 				}
 				else
@@ -737,32 +1300,103 @@ namespace stdext
 			b->link_sibling( a, 1);
 		}
 
+		// Locks the stream against the background writer, if there is one
+		class _FlushLock
+		{
+			std::mutex* const mutex;
+
+			_FlushLock( const _FlushLock&);
+			_FlushLock& operator = ( const _FlushLock&);
+
+		public:
+			_FlushLock( _Flusher* const flusher): mutex( flusher ? &flusher->io : 0)
+			{
+				if ( mutex)
+				{
+					mutex->lock();
+				}
+			}
+
+			~_FlushLock()
+			{
+				if ( mutex)
+				{
+					mutex->unlock();
+				}
+			}
+		};
+
 		struct _NodeManager
 		{
 			typedef typename _Alloc::rebind<_Inner>::other	_InnerAllocator;
 			typedef typename _Alloc::rebind<_Leaf>::other	_LeafAllocator;
 
+			typedef std::vector<_Node*> _Nodes;
+
 			_Stream*		stream;
+			_Stats*			stats;
+			_Flusher*		flusher;
 			_Inner			inner_node;
 			_Leaf			leaf_node;
 			_InnerAllocator	inner_allocator;
 			_LeafAllocator	leaf_allocator;
-
-			_NodeManager(): stream( 0) {}
+			bp_tree_node_pool<_Inner>	inner_pool;
+			bp_tree_node_pool<_Leaf>	leaf_pool;
+			_Epoch			epoch;
+			_Nodes			retired[ 2];	// evicted nodes, by the parity of the epoch they were evicted in
+			_Nodes			pinned;			// evicted nodes still pointed by iterators
+			std::mutex		snap_mutex;		// guards shadows and their images
+			std::vector<_Shadow*>	shadows;	// of the snapshots taken of the tree
+			wal_type*		wal;			// write-ahead log the pages are kept in, also while it is replayed
+			offset_type		log_base;		// end of the file when the log started
+			std::map<offset_type, size_t>	logged;	// bytes of the pages in the log, by offset
+			std::map<offset_type, _Node*>	held;	// copies of the nodes whose page images wait for a sync, by offset
+			size_t			held_upto;		// records of the log synced before the held nodes are written
+			std::vector<char>	page;
+
+			enum { hold_limit = 64 };		//< held nodes written with one sync
+
+			_NodeManager(): stream( 0), stats( 0), flusher( 0), wal( 0), log_base( 0), held_upto( 0) {}
 			_NodeManager( const _InnerAllocator& inner_alloc, const _LeafAllocator& leaf_alloc):
+				stream( 0),
+				stats( 0),
+				flusher( 0),
+				wal( 0),
+				log_base( 0),
+				held_upto( 0),
 				inner_allocator( inner_alloc),
 				leaf_allocator( leaf_alloc)
 			{}
 
 			~_NodeManager()
 			{
+				drop_held();
+				release_retired();
 				inner_node.parent = 0;
 				leaf_node.parent = 0;
 			}
 
+			// Preallocates the nodes of a cache of cache_size nodes, plus the ones kept outside it
+			// (root, head, tail and those of the current path). A cached level 1 node has up to
+			// slot_count + 1 leaves, so most of the cache holds leaves; the inner slab takes a
+			// quarter of it. Nodes past the slabs come from the allocators.
+			void reserve( const size_t cache_size)
+			{
+				if ( traits::node_pool)
+				{
+					const size_t extra = 64;
+					leaf_pool.reserve( cache_size + extra, traits::huge_pages != 0);
+					inner_pool.reserve( cache_size / 4 + extra, traits::huge_pages != 0);
+				}
+			}
+
 			_Leaf* allocate_leaf( const offset_type offset = 0, _Inner* const parent = 0)
 			{
-				_Leaf* p = static_cast<_Leaf*>( leaf_allocator.allocate( sizeof( _Leaf)));
+				_Leaf* p = leaf_pool.allocate();
+				if ( !p)
+				{
+					p = leaf_allocator.allocate( 1);
+				}
 				if ( p)
 				{
 					leaf_node.offset = offset;
@@ -774,7 +1408,11 @@ namespace stdext
 
 			_Inner* allocate_inner( const offset_type offset, _Inner* const parent = 0, const slotn_t level = 0)
 			{				
-				_Inner* p = static_cast<_Inner*>( inner_allocator.allocate( sizeof( _Inner)));
+				_Inner* p = inner_pool.allocate();
+				if ( !p)
+				{
+					p = inner_allocator.allocate( 1);
+				}
 				if ( p)
 				{
 					inner_node.offset = offset;
@@ -788,990 +1426,3755 @@ namespace stdext
 			// called on cache's eviction
 			void operator () ( _Node* const node)
 			{
-				if ( node->is_leaf())
+				if ( stream)
 				{
-					if ( stream)
+					_FlushLock lock( flusher);
+					if ( flusher)
 					{
-						static_cast<_Leaf*>( node)->save_to( *stream);
+						flusher->write_pending( node->offset);
 					}
-					leaf_allocator.destroy( static_cast<_Leaf*>( node));
-					leaf_allocator.deallocate( static_cast<_Leaf*>( node), sizeof( _Leaf));
-				}
-				else
-				{
-					if ( stream)
+
+					const bool dirty = _Stats::enabled && is_changed( node);
+					const bool written = save( node);
+
+					if ( _Stats::enabled && stats)
 					{
-						static_cast<_Inner*>( node)->save_to( *stream);
+						stats->evict( dirty);
+						if ( dirty && written)
+						{
+							stats->written( stream->position() - node->offset);
+						}
 					}
-					inner_allocator.destroy( static_cast<_Inner*>( node));
-					inner_allocator.deallocate( static_cast<_Inner*>( node), sizeof( _Inner));
 				}
-			}
-		};
-
 
-		template <typename Container>
-		void compact_analyse_descend( Container& map, _Inner* const node)
-		{
-			map[ node->offset] = node->actual_storage_size();
-			if ( node->level != 1)
-			{
-				for( slotn_t i = 0; i < node->used_slots + 1; ++i)
+				if ( _Sync::concurrent_reads)
 				{
-					compact_analyse_descend( map, (_Inner*) get_child( node, i));
+					retire( node);
 				}
-			}
-			else
-			{
-				for( slotn_t i = 0; i <  node->used_slots + 1; ++i)
+				else
 				{
-					const _Leaf* const leaf = (_Leaf*) get_child( node, i);
-					map[ leaf->offset] = leaf->actual_storage_size();
+					release( node);
 				}
 			}
-		};
 
-		template <typename Container>
-		void compact_write_descend( _Inner* node, stream_type& out, Container& map, _Inner& inner, _Leaf& leaf)
-		{
-			std::copy( node->keys, node->keys + node->used_slots, inner.keys);
-			inner.used_slots = node->used_slots;
-			inner.key_changes_bmp = bitmap_type( ~0);
-			bitmap_type flag = 1;
-			for( slotn_t i = 0; i < node->used_slots + 1; ++i, flag <<= 1)
+			static bool is_changed( const _Node* const node)
 			{
-				inner.children[ i].offset = map[ node->child_offset( flag, i)].new_offset;
-				BP_TREE_ASSERT( inner.children[ i].offset);
+				return node->is_leaf() ? static_cast<const _Leaf*>( node)->is_changed() : static_cast<const _Inner*>( node)->is_changed();
 			}
-			out.seek( map[ node->offset].new_offset);
-			inner.raw_save_to( out);
 
-			if ( node->level != 1)
+			// Writes a changed node, its image on file first kept for the snapshots still seeing it
+			// and in the write-ahead log. A node whose image is not synced yet is held, as a copy,
+			// until hold_limit of them wait: then one sync of the log lets them all be written.
+			// Returns false if the node was held.
+			bool save( const _Node* const node)
 			{
-				for( slotn_t i = 0; i < node->used_slots + 1; ++i)
+				if ( !is_changed( node))
 				{
-					compact_write_descend( (_Inner*) get_child( node, i), out, map, inner, leaf);
+					return true;
 				}
-			}
-			else
-			{
-				_Leaf* leafSrc;
-				for( slotn_t i = 0; i < node->used_slots + 1; ++i)
-				{
-					leafSrc = (_Leaf*) get_child( node, i);
 
-					leaf.used_slots = leafSrc->used_slots;
-					leaf.offset = map[ leafSrc->offset].new_offset;
-
-					std::copy( leafSrc->keys, leafSrc->keys + leafSrc->used_slots, leaf.keys);
-					std::copy( leafSrc->data, leafSrc->data + leafSrc->used_slots, leaf.data);
-
-					_LeafRef& nextRef = leafSrc->siblings[ _Leaf::sibling_next];
-					_LeafRef& prevRef = leafSrc->siblings[ _Leaf::sibling_prev];
-					
-					leaf.siblings[ _Leaf::sibling_next].offset = nextRef ? map[ leafSrc->is_sibling_ptr_at( _Leaf::sibling_next) ? nextRef.ptr->offset : nextRef.offset].new_offset : 0;
-					leaf.siblings[ _Leaf::sibling_prev].offset = prevRef ? map[ leafSrc->is_sibling_ptr_at( _Leaf::sibling_prev) ? prevRef.ptr->offset : prevRef.offset].new_offset : 0;
+				write_held( node->offset); // an older copy of it goes first
+				const size_t upto = log_page( node->offset, node->is_leaf() ? size_t( _Leaf::storage_size) : size_t( _Inner::storage_size), false);
+				if ( !upto)
+				{
+					write( node);
+					return true;
+				}
 
-					out.seek( map[ leafSrc->offset].new_offset);
-					leaf.key_changes_bmp = bitmap_type( ~0);
-					leaf.siblings_changes_bmp = bitmap_type( ~0);
-					leaf.raw_save_to( out);
+				held[ node->offset] = copy( node);
+				if ( node->is_leaf())
+				{
+					const _Leaf* const leaf = static_cast<const _Leaf*>( node);
+					leaf->key_changes_bmp = leaf->data_changes_bmp = leaf->siblings_changes_bmp = 0;
+				}
+				else
+				{
+					static_cast<const _Inner*>( node)->key_changes_bmp = 0;
+				}
+				held_upto = std::max( held_upto, upto);
+				if ( held.size() >= hold_limit)
+				{
+					write_held();
 				}
+				return false;
 			}
-		};
-
-		stream_type& get_stream() const
-		{ 
-			BP_TREE_ASSERT( nodeman_.stream);
-			return *nodeman_.stream; 
-		}
 
-		_IterDef find_( const key_type& key) const
-		{
-			_Node* node = root_;
-			slotn_t pos;
-			if ( root_)
+			void write( const _Node* const node)
 			{
-				while( !node->is_leaf())
+				preserve( node);
+				if ( node->is_leaf())
 				{
-					node = get_child_by_key( static_cast<_Inner*>( node), key);
+					static_cast<const _Leaf*>( node)->save_to( *stream);
 				}
-				_Leaf* const lf = (_Leaf*) node;
-				pos = node->find_lower( key);
-				if ( pos == node->used_slots)
+				else
 				{
-					pos = 0;
-					node = 0;
+					static_cast<const _Inner*>( node)->save_to( *stream);
 				}
 			}
-			else
-			{
-				pos = 0;
-			}
-
-			return _IterDef( static_cast<_Leaf*>( node), pos);
-		}
 
-		void link_possible_siblings( _Leaf* const node) const
-		{
+			// syncs the log as far as the images of the held nodes, unless a group commit did, and
+			// writes the nodes
+			void write_held()
 			{
-				const offset_type off = node->siblings[ _Leaf::sibling_next].offset;
-				if ( off == tail_->offset)
+				if ( held.empty())
 				{
-					link_siblings( node, tail_);
+					return;
 				}
-				else
+				wal->commit( held_upto);
+				for( typename std::map<offset_type, _Node*>::const_iterator i = held.begin(); i != held.end(); ++i)
 				{
-					_Cache::iterator sibling = cache_.find( off, false);
-					if ( sibling != cache_.end())
+					write( i->second);
+					if ( _Stats::enabled && stats)
 					{
-						link_siblings( node, static_cast<_Leaf*>( *sibling));
+						stats->written( stream->position() - i->first);
 					}
+					release( i->second);
 				}
+				held.clear();
 			}
 
-			const offset_type off = node->siblings[ _Leaf::sibling_prev].offset;
-			if ( off == head_->offset)
-			{
-				link_siblings( head_, node);
-			}
-			else
+			// before the slot at offset is read or written, its held node goes to the file
+			void write_held( const offset_type offset)
 			{
-				_Cache::iterator sibling = cache_.find( off, false);
-				if ( sibling != cache_.end())
+				if ( held.find( offset) != held.end())
 				{
-					link_siblings( static_cast<_Leaf*>( *sibling), node);
+					write_held();
 				}
 			}
-		}
 
-		_Node* get_child( _Inner* const node, const slotn_t pos) const
-		{
-			_Node* child;
-			if ( node != root_)
+			void drop_held()
 			{
-				cache_.touch( node->offset);
+				for( typename std::map<offset_type, _Node*>::const_iterator i = held.begin(); i != held.end(); ++i)
+				{
+					release( i->second);
+				}
+				held.clear();
 			}
 
-			if ( node->is_ptr_at( pos))
+			// a copy of node with its links turned into offsets, to be written after node changed
+			// again or left the cache
+			_Node* copy( const _Node* const node)
 			{
-				child = node->children[ pos].ptr;
-				if ( child->offset != head_->offset && child->offset != tail_->offset)
+				if ( node->is_leaf())
 				{
-					cache_.touch( child->offset);
+					const _Leaf* const leaf = static_cast<const _Leaf*>( node);
+					_Leaf* const copy = allocate_leaf( leaf->offset);
+					*copy = *leaf;
+					copy->parent = 0;
+					for( slotn_t j = 0; j < 2; ++j)
+					{
+						copy->siblings[ j].offset = leaf->sibling_offset( j);
+					}
+					copy->siblings_ptr_bmp = 0;
+					return copy;
+				}
+
+				const _Inner* const inner = static_cast<const _Inner*>( node);
+				_Inner* const copy = allocate_inner( inner->offset, 0, slotn_t( inner->level));
+				*copy = *inner;
+				copy->parent = 0;
+				bitmap_type flag = 1;
+				for( slotn_t j = 0; j < inner->used_slots + 1; ++j, flag <<= 1)
+				{
+					copy->children[ j].offset = inner->child_offset( flag, j);
 				}
+				copy->children_ptr_bmp = 0;
+				return copy;
 			}
-			else
+
+			// Called before bytes of the file that were in use when the write-ahead log started are
+			// first overwritten: their content goes to the log, to be synced before the write. The
+			// pages already logged are kept, the first of each byte is the one recovery restores.
+			// With sync the log is synced here; otherwise returns the records to sync before the
+			// write, 0 if nothing was logged.
+			size_t log_page( const offset_type offset, size_t bytes, const bool sync = true)
 			{
-				const offset_type offset = node->children[ pos].offset;
-				BP_TREE_ASSERT( offset && offset < eof_);
-				if ( node->level != 1)
+				if ( !wal || offset >= log_base)
 				{
-					_Inner* const item = nodeman_.allocate_inner( offset, node, node->level - 1);
-					item->load_from( get_stream());
-					cache_new_node( child = item);
+					return 0;
 				}
-				else if ( offset == head_->offset)
+				size_t& logged_bytes = logged[ offset];
+				if ( logged_bytes >= bytes)
 				{
-					child = head_;
+					return 0;
 				}
-				else if ( offset == tail_->offset)
+				logged_bytes = bytes;
+
+				// the file may end inside the last slot, past its last write
+				const size_t size = stream->size();
+				bytes = offset < size ? std::min( bytes, size - offset) : 0;
+				if ( !bytes)
 				{
-					child = tail_;
+					return 0;
 				}
-				else
+				page.resize( bytes);
+				stream->seek( offset);
+				stream->read( &page[ 0], bytes);
+				const size_t upto = wal->log_page( offset, &page[ 0], unsigned( bytes));
+				if ( sync)
 				{
-					_Leaf* const item = nodeman_.allocate_leaf( offset, node);
-					item->load_from( get_stream());
-					link_possible_siblings( item);
-					cache_new_node( child = item);
+					wal->commit();
+					return 0;
 				}
-
-				node->link( pos, child);
-			}
-
-			return child;
-		}
-
-		_Node* get_child_by_key( _Inner* const node, const key_type& key) const
-		{
-			const slotn_t pos = node->find_lower( key);
-			return get_child( node, slotn_t( pos + ( node->keys[ pos] == key)));
-		}
-
-		_Leaf* get_sibling( _Leaf* const node, const slotn_t index)
-		{
-			cache_.touch( node->offset);
-			if ( !node->siblings[ index])
-			{
-				return 0;
-			}
-
-			if ( node->is_sibling_ptr_at( index))
-			{
-				_Leaf* const leaf = static_cast<_Leaf*>( node->siblings[ index].ptr);
-				cache_.touch( leaf->offset);
-				return leaf;
-			}
-
-			const offset_type offset = node->siblings[ index].offset;
-			BP_TREE_ASSERT( offset && offset < eof_);
-
-			bool cache_now = true;
-			_Leaf* item;
-			if ( offset == head_->offset)
-			{
-				cache_now = false;
-				item = static_cast<_Leaf*>( head_);
-				item->link_sibling( node, !index);
-			}
-			else if ( offset == tail_->offset)
-			{
-				cache_now = false;
-				item = static_cast<_Leaf*>( tail_);
-				item->link_sibling( node, !index);
-			}
-			else
-			{
-				item = nodeman_.allocate_leaf( offset);
-				item->load_from( get_stream());
-				link_possible_siblings( item);
+				return upto;
 			}
 
-			node->link_sibling( item, index);
-			if ( cache_now)
+			// Called before the slot of node is written: the snapshots taken while the slot held
+			// a node, and not holding its image yet, get a copy of it
+			void preserve( const _Node* const node)
 			{
-				std::pair<_Cache::iterator, bool> res = cache_.get( offset);
-				*res.first = item;
+				std::lock_guard<std::mutex> lock( snap_mutex);
+				_Node* image = 0;
+				bool loaded = false;
+				for( typename std::vector<_Shadow*>::iterator i = shadows.begin(); i != shadows.end(); ++i)
+				{
+					_Shadow& shadow = **i;
+					if ( !shadow.expired && node->offset < shadow.eof && shadow.images.find( node->offset) == shadow.images.end())
+					{
+						if ( shadow.limit && shadow.images.size() >= shadow.limit)
+						{
+							shadow.expired = true;
+							shadow.drop();
+							continue;
+						}
+						image = loaded ? copy_image( image) : load_image( node);
+						loaded = true;
+						shadow.images[ node->offset] = image;
+					}
+				}
 			}
 
-			return item;
-		}
-
-		void insert_descend( _IterDef& def, key_type& splitkey, _Node*& splitnode, _Node* const node_item, const key_type& key)
-		{
-			const slotn_t slot = node_item->find_lower( key);
-			if ( !node_item->is_leaf()) // Inner -----------------------------------------------
+			// reads the node in the slot of node from the file, 0 if the slot was free
+			_Node* load_image( const _Node* const node)
 			{
-				_Inner* const node = static_cast<_Inner*>( node_item);
-				key_type new_key;
-				_Node* new_child = 0;
-				insert_descend( def, new_key, new_child, get_child( node, slot), key);
-				if ( new_child)
+				if ( node->is_leaf())
 				{
-					if ( node->is_full())
+					_Leaf* const image = allocate_leaf( node->offset);
+					if ( image->load_from( *stream))
 					{
-						_Inner* const new_node = nodeman_.allocate_inner( eof_, node->parent, node->level);
-						eof_ += _Inner::storage_size;
-						static_cast<_Inner*>( node)->split( splitkey, *new_node, new_key, new_child);
-						BP_TREE_ASSERT( splitkey > 0);
-						cache_new_node( splitnode = new_node);
+						return image;
 					}
-					else
+					release( image);
+				}
+				else
+				{
+					_Inner* const image = allocate_inner( node->offset, 0, slotn_t( node->level));
+					if ( image->load_from( *stream))
 					{
-						node->insert( new_key, new_child);
-						//splitnode = 0;
+						return image;
 					}
+					release( image);
 				}
+				return 0;
 			}
-			else // Leaf -----------------------------------------------------------------------
+
+			_Node* copy_image( const _Node* const image)
 			{
-				_Leaf* const node = static_cast<_Leaf*>( node_item);
-				if ( node->is_full())
+				if ( !image)
 				{
-					_Leaf* const new_node = nodeman_.allocate_leaf( eof_);
-					eof_ += _Leaf::storage_size;
-
-					_Leaf* const next_node = get_sibling( node, _Leaf::sibling_next);
-					node->split( def, splitkey, *new_node, key);
-					BP_TREE_ASSERT( splitkey > 0);
-					if ( next_node)
-					{
-						link_siblings( new_node, next_node);
-						next_node->siblings_changes_bmp |= _Leaf::sibling_mask_prev;
-					}
+					return 0;
+				}
+				if ( image->is_leaf())
+				{
+					_Leaf* const copy = allocate_leaf( image->offset);
+					*copy = *static_cast<const _Leaf*>( image);
+					return copy;
+				}
+				_Inner* const copy = allocate_inner( image->offset, 0, slotn_t( image->level));
+				*copy = *static_cast<const _Inner*>( image);
+				return copy;
+			}
 
-					link_siblings( node, new_node);
-					node->siblings_changes_bmp |= _Leaf::sibling_mask_next;
+			// Unlinks an evicted node from the tree, concurrent readers may still be using it;
+			// the node is released once the epoch moved past all of them and no iterator pins it.
+			void retire( _Node* const node)
+			{
+				if ( node->parent)
+				{
+					node->parent->unlink( node);
+					node->parent = 0;
+				}
 
-					splitnode = new_node;
-					if ( tail_ == node)
+				if ( node->is_leaf())
+				{
+					_Leaf* const leaf = static_cast<_Leaf*>( node);
+					for( slotn_t i = 0; i < 2; ++i)
 					{
-						tail_ = new_node;
-						if ( node != head_)
+						if ( leaf->is_sibling_ptr_at( i))
 						{
-							cache_new_node( node);
+							_Leaf* const sibling = leaf->siblings[ i].ptr;
+							sibling->unlink_sibling( !i, leaf->offset);
+							leaf->unlink_sibling( i, sibling->offset);
 						}
 					}
 				}
 				else
 				{
-					//splitnode = 0;
-					node->insert( key, slot);
-					def.first = node;
-					def.second = slot;
+					_Inner* const inner = static_cast<_Inner*>( node);
+					inner->latch.lock();
+					for( slotn_t i = 0; i < inner->used_slots + 1; ++i)
+					{
+						if ( inner->is_ptr_at( i))
+						{
+							_Node* const child = inner->children[ i].ptr;
+							child->parent = 0;
+							inner->children[ i].offset = child->offset;
+						}
+					}
+					inner->children_ptr_bmp = 0;
+					inner->latch.unlock();
 				}
-			}
-		}
-
-		class base_iterator
-		{
-			friend bp_tree;
 
-		protected:
-			bp_tree*	tree;
-			_Leaf*		node;
-			slotn_t		index;
-
-			base_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): tree( tree), node( node), index( index) {}
-			base_iterator( const base_iterator& item): tree( item.tree), node( item.node), index( item.index) {}
+				node->latch.retire();
+				retired[ epoch.current() & 1].push_back( node);
+				reclaim();
+			}
 
-			void to_next()
+			void reclaim()
 			{
-				if ( node)
+				if ( epoch.try_advance())
 				{
-					if ( index + 1 == node->used_slots)
+					_Nodes& nodes = retired[ epoch.current() & 1];
+					for( typename _Nodes::iterator i = nodes.begin(); i != nodes.end(); ++i)
 					{
-						index = 0;
-						node = tree->get_sibling( node, _Leaf::sibling_next);
+						if ( (*i)->latch.is_pinned())
+						{
+							pinned.push_back( *i);
+						}
+						else
+						{
+							release( *i);
+						}
+					}
+					nodes.clear();
+				}
+
+				for( size_t i = 0; i < pinned.size(); )
+				{
+					if ( pinned[ i]->latch.is_pinned())
+					{
+						++i;
 					}
 					else
 					{
-						++index;
+						release( pinned[ i]);
+						pinned[ i] = pinned.back();
+						pinned.pop_back();
 					}
 				}
 			}
 
-			void to_prev()
+			// no reader may be left
+			void release_retired()
 			{
-				if ( node)
+				for( int n = 0; n < 2; ++n)
 				{
-					if ( !index)
-					{
-						node = tree->get_sibling( node, _Leaf::sibling_prev);
+					release_all( retired[ n]);
+				}
+				release_all( pinned);
+			}
+
+			void release_all( _Nodes& nodes)
+			{
+				for( typename _Nodes::iterator i = nodes.begin(); i != nodes.end(); ++i)
+				{
+					release( *i);
+				}
+				nodes.clear();
+			}
+
+			// destroys a node without saving it
+			void release( _Node* const node)
+			{
+				if ( node->is_leaf())
+				{
+					_Leaf* const leaf = static_cast<_Leaf*>( node);
+					leaf_allocator.destroy( leaf);
+					if ( leaf_pool.owns( leaf))
+					{
+						leaf_pool.deallocate( leaf);
+					}
+					else
+					{
+						leaf_allocator.deallocate( leaf, 1);
+					}
+				}
+				else
+				{
+					_Inner* const inner = static_cast<_Inner*>( node);
+					inner_allocator.destroy( inner);
+					if ( inner_pool.owns( inner))
+					{
+						inner_pool.deallocate( inner);
+					}
+					else
+					{
+						inner_allocator.deallocate( inner, 1);
+					}
+				}
+			}
+		};
+
+		// Background writer of start_flusher. The tree hands it copies of the dirty nodes it
+		// cleaned (their links turned into offsets) and it writes them in offset order. A node
+		// saved, loaded or freed by the tree while its copy is pending has the copy written (or
+		// dropped, if freed) first, under the same lock, so the file never goes back in time.
+		struct _Flusher
+		{
+			typedef std::map<offset_type, _Node*> _Pending;
+
+			_NodeManager&			nodeman;
+			std::mutex				io;			//< serializes the stream between the tree and the writer
+			std::condition_variable	wake;
+			_Pending				pending;	//< copies not written yet, by offset
+			bool					stop;
+			std::thread				writer;
+
+			_Flusher( _NodeManager& nodeman): nodeman( nodeman), stop( false), writer( &_Flusher::run, this) {}
+
+			~_Flusher()
+			{
+				{
+					std::lock_guard<std::mutex> lock( io);
+					stop = true;
+				}
+				wake.notify_one();
+				writer.join();
+				write_all();
+			}
+
+			bool is_pending( const offset_type offset) const
+			{
+				return pending.find( offset) != pending.end();
+			}
+
+			// io is locked by the caller for the next three
+			void add( _Node* const copy)
+			{
+				pending[ copy->offset] = copy;
+				wake.notify_one();
+			}
+
+			void write_pending( const offset_type offset)
+			{
+				const typename _Pending::iterator i = pending.find( offset);
+				if ( i != pending.end())
+				{
+					_Node* const node = i->second;
+					pending.erase( i);
+					if ( nodeman.stream)
+					{
+						nodeman.save( node);
+					}
+					nodeman.release( node);
+				}
+			}
+
+			void write_all()
+			{
+				while( !pending.empty())
+				{
+					write_pending( pending.begin()->first);
+				}
+			}
+
+			void drop_pending( const offset_type offset)
+			{
+				const typename _Pending::iterator i = pending.find( offset);
+				if ( i != pending.end())
+				{
+					nodeman.release( i->second);
+					pending.erase( i);
+				}
+			}
+
+			void drop_all()
+			{
+				for( typename _Pending::iterator i = pending.begin(); i != pending.end(); ++i)
+				{
+					nodeman.release( i->second);
+				}
+				pending.clear();
+			}
+
+			// one node per lock, so the tree waits for one write at most
+			void run()
+			{
+				std::unique_lock<std::mutex> lock( io);
+				for( ;;)
+				{
+					while( !stop && pending.empty())
+					{
+						wake.wait( lock);
+					}
+					if ( stop)
+					{
+						return;
+					}
+					write_pending( pending.begin()->first);
+					lock.unlock();
+					std::this_thread::yield();
+					lock.lock();
+				}
+			}
+		};
+
+		// What a snapshot sees of the file besides it: the images of the nodes the tree overwrote
+		// since, by offset (0 for the slots free when it was taken). A snapshot reads a node from
+		// the file, then looks its image up; the tree keeps an image before its first write to
+		// a slot, so an image missing after the read means the read did not race a write.
+		// Past limit images the shadow expires: they are dropped and no more are kept.
+		struct _Shadow
+		{
+			typedef std::map<offset_type, _Node*> _Images;
+
+			_NodeManager&	source;		//< of the tree the snapshot was taken of
+			offset_type		eof;		//< the slots past it were not in use when taken
+			size_t			limit;		//< images kept at most, 0 for no bound
+			bool			expired;
+			_Images			images;
+
+			_Shadow( _NodeManager& source, const offset_type eof, const size_t limit):
+				source( source),
+				eof( eof),
+				limit( limit),
+				expired( false)
+			{
+				std::lock_guard<std::mutex> lock( source.snap_mutex);
+				source.shadows.push_back( this);
+			}
+
+			~_Shadow()
+			{
+				std::lock_guard<std::mutex> lock( source.snap_mutex);
+				source.shadows.erase( std::find( source.shadows.begin(), source.shadows.end(), this));
+				drop();
+			}
+
+			// source.snap_mutex is locked by the caller
+			void drop()
+			{
+				for( typename _Images::iterator i = images.begin(); i != images.end(); ++i)
+				{
+					if ( i->second)
+					{
+						source.release( i->second);
+					}
+				}
+				images.clear();
+			}
+
+			bool is_expired() const
+			{
+				std::lock_guard<std::mutex> lock( source.snap_mutex);
+				return expired;
+			}
+
+			// replaces the node just read from the file with its image, if the tree overwrote it
+			bool restore( _Node* const node) const
+			{
+				std::lock_guard<std::mutex> lock( source.snap_mutex);
+				const typename _Images::const_iterator i = images.find( node->offset);
+				if ( i == images.end() || !i->second)
+				{
+					return false;
+				}
+
+				_Inner* const parent = node->parent;
+				if ( node->is_leaf())
+				{
+					*static_cast<_Leaf*>( node) = *static_cast<const _Leaf*>( i->second);
+				}
+				else
+				{
+					*static_cast<_Inner*>( node) = *static_cast<const _Inner*>( i->second);
+				}
+				node->parent = parent;
+				return true;
+			}
+		};
+
+
+		typedef bp_tree_key_codec<key_type> _KeyCodec;
+
+		// Separators of node for a compact file, each cut to the shortest key that still parts
+		// the last key of its left subtree from the first of its right one. Visits the children
+		// through visit( child, first, last), which returns the first and last keys of the child's
+		// subtree; first and last receive those of node's subtree.
+		template <typename _Visit>
+		void compact_separators( _Inner* const node, key_type* const separators, key_type& first, key_type& last, _Visit visit)
+		{
+			lock_( node);
+			for( slotn_t i = 0; i < node->used_slots + 1; ++i)
+			{
+				key_type child_first, child_last;
+				visit( get_child( node, i), child_first, child_last);
+				if ( i)
+				{
+					separators[ i - 1] = _KeyCodec::separator( last, child_first, node->keys[ i - 1]);
+				}
+				else
+				{
+					first = child_first;
+				}
+				last = child_last;
+			}
+			unlock_( node);
+		}
+
+		// Layout of a compact file: the root, the other inner nodes level by level from the top,
+		// then the leaves, each level in key order. A node goes where the previous one of its
+		// level ended, so once the sizes of the levels are summed its offset follows from the
+		// sizes of the nodes placed before it. The leaves take one extent, for sequential scans.
+		struct _CompactLayout
+		{
+			std::vector<offset_type>	next;		//< where the next node of each level goes, leaves first
+			offset_type					prev_leaf;	//< the last leaf placed
+			offset_type					written;	//< the last node placed
+			size_t						leaf_size;	//< of the last leaf placed
+
+			_CompactLayout( const size_t levels = 0): next( levels, 0), prev_leaf( 0), written( 0), leaf_size( 0) {}
+
+			offset_type place( const size_t level, const size_t size)
+			{
+				written = next[ level];
+				next[ level] += size;
+				if ( !level)
+				{
+					prev_leaf = written;
+					leaf_size = size;
+				}
+				return written;
+			}
+		};
+
+		// keeps the offset of each child placed by visit in children, in order
+		template <typename _Visit>
+		struct _CompactChild
+		{
+			const _Visit&	visit;
+			_NodeRef*		children;
+			slotn_t*		count;
+
+			void operator () ( _Node* const node, key_type& first, key_type& last) const
+			{
+				visit( node, first, last);
+				children[ ( *count)++].offset = visit.layout.written;
+			}
+		};
+
+		// places the nodes of the tree in layout and, with write, writes them to out
+		struct _CompactStream
+		{
+			bp_tree&		tree;
+			stream_type&	out;
+			_CompactLayout&	layout;
+			_Leaf&			leaf;
+			bool			write;
+
+			void operator () ( _Node* const node, key_type& first, key_type& last) const
+			{
+				if ( node->is_leaf())
+				{
+					_Leaf* const leafSrc = static_cast<_Leaf*>( node);
+					first = leafSrc->keys[ 0];
+					last = leafSrc->keys[ leafSrc->used_slots - 1];
+
+					const size_t size = leafSrc->actual_storage_size( out);
+					const offset_type prev = layout.prev_leaf;
+					const offset_type offset = layout.place( 0, size);
+					if ( write)
+					{
+						leaf.used_slots = leafSrc->used_slots;
+						leaf.offset = offset;
+						std::copy( leafSrc->keys, leafSrc->keys + leafSrc->used_slots, leaf.keys);
+						std::copy( leafSrc->data, leafSrc->data + leafSrc->used_slots, leaf.data);
+						leaf.siblings[ _Leaf::sibling_prev].offset = prev;
+						leaf.siblings[ _Leaf::sibling_next].offset = leafSrc->siblings[ _Leaf::sibling_next] ? offset + size : 0;
+
+						out.seek( offset);
+						leaf.key_changes_bmp = bitmap_type( ~0);
+						leaf.siblings_changes_bmp = bitmap_type( ~0);
+						leaf.raw_save_to( out);
+					}
+				}
+				else
+				{
+					_Inner* const src = static_cast<_Inner*>( node);
+					_Inner inner;
+					slotn_t count = 0;
+					key_type separators[ _Node::slot_count];
+					const _CompactChild<_CompactStream> visit = { *this, inner.children, &count };
+					tree.compact_separators( src, separators, first, last, visit);
+
+					const offset_type offset = layout.place( src->level, src->actual_storage_size( out, separators));
+					if ( write)
+					{
+						std::copy( separators, separators + src->used_slots, inner.keys);
+						inner.used_slots = src->used_slots;
+						inner.key_changes_bmp = bitmap_type( ~0);
+						out.seek( offset);
+						inner.raw_save_to( out);
+					}
+				}
+			}
+		};
+
+		// An inner node of a compact file as the sizing pass of the parallel compact_to leaves it:
+		// the separators to write and the children's offsets in the tree's file
+		struct _CompactInner
+		{
+			offset_type	children[ _Node::slot_count + 1];
+			key_type	separators[ _Node::slot_count];
+			slotn_t		used_slots;
+		};
+
+		// A subtree under the root for the parallel compact_to. The sizing pass reads its nodes
+		// from the file into scratch nodes and places them in a layout of its own to size its
+		// levels, keeping the size of every node and the inner nodes; the writing pass then
+		// reads only the leaves again and writes the subtree in its share of each level of the
+		// tree's layout.
+		struct _CompactTask
+		{
+			offset_type					offset;		//< of the subtree's root
+			size_t						level;
+			_CompactLayout				layout;
+			key_type					first;
+			key_type					last;
+			std::vector<size_t>			sizes;		//< of the nodes, parents first
+			std::vector<_CompactInner>	inners;		//< parents first
+			size_t						next_size;
+			size_t						next_inner;
+			bool						ok;
+
+			// places the node at offset, children first, keeps its size (and the node if inner)
+			// and gives the first and last keys of its subtree
+			bool size( stream_type& in, stream_type& out, const offset_type offset, const size_t level, key_type& first, key_type& last)
+			{
+				if ( !level)
+				{
+					_Leaf leaf( offset);
+					if ( !leaf.load_from( in))
+					{
+						return false;
+					}
+					first = leaf.keys[ 0];
+					last = leaf.keys[ leaf.used_slots - 1];
+					sizes.push_back( leaf.actual_storage_size( out));
+					layout.place( 0, sizes.back());
+					return true;
+				}
+
+				_Inner inner( offset, 0, slotn_t( level));
+				if ( !inner.load_from( in))
+				{
+					return false;
+				}
+				const size_t at = sizes.size();
+				const size_t index = inners.size();
+				sizes.push_back( 0);
+				inners.push_back( _CompactInner());
+				key_type separators[ _Node::slot_count];
+				for( slotn_t i = 0; i < inner.used_slots + 1; ++i)
+				{
+					key_type child_first, child_last;
+					if ( !size( in, out, inner.children[ i].offset, level - 1, child_first, child_last))
+					{
+						return false;
+					}
+					if ( i)
+					{
+						separators[ i - 1] = _KeyCodec::separator( last, child_first, inner.keys[ i - 1]);
+					}
+					else
+					{
+						first = child_first;
+					}
+					last = child_last;
+				}
+
+				_CompactInner& kept = inners[ index];
+				for( slotn_t i = 0; i < inner.used_slots + 1; ++i)
+				{
+					kept.children[ i] = inner.children[ i].offset;
+				}
+				std::copy( separators, separators + inner.used_slots, kept.separators);
+				kept.used_slots = inner.used_slots;
+				sizes[ at] = inner.actual_storage_size( out, separators);
+				layout.place( level, sizes[ at]);
+				return true;
+			}
+
+			// writes the node at offset of the tree's file where layout places it, children first,
+			// in the order size kept them
+			bool write( stream_type& in, stream_type& out, const offset_type offset, const size_t level)
+			{
+				const size_t size = sizes[ next_size++];
+				if ( !level)
+				{
+					_Leaf leaf( offset);
+					if ( !leaf.load_from( in))
+					{
+						return false;
+					}
+					const offset_type prev = layout.prev_leaf;
+					leaf.offset = layout.place( 0, size);
+					leaf.siblings[ _Leaf::sibling_prev].offset = prev;
+					leaf.siblings[ _Leaf::sibling_next].offset = leaf.siblings[ _Leaf::sibling_next].offset ? leaf.offset + size : 0;
+					leaf.key_changes_bmp = leaf.siblings_changes_bmp = leaf.data_changes_bmp = bitmap_type( ~0);
+					out.seek( leaf.offset);
+					return leaf.raw_save_to( out);
+				}
+
+				const _CompactInner& kept = inners[ next_inner++];
+				_Inner inner;
+				for( slotn_t i = 0; i < kept.used_slots + 1; ++i)
+				{
+					if ( !write( in, out, kept.children[ i], level - 1))
+					{
+						return false;
+					}
+					inner.children[ i].offset = layout.written;
+				}
+				std::copy( kept.separators, kept.separators + kept.used_slots, inner.keys);
+				inner.used_slots = kept.used_slots;
+				inner.offset = layout.place( level, size);
+				inner.key_changes_bmp = bitmap_type( ~0);
+				out.seek( inner.offset);
+				return inner.raw_save_to( out);
+			}
+		};
+
+		// takes the next subtree of the parallel compact_to until none is left
+		struct _CompactWorker
+		{
+			stream_type*				in;
+			stream_type*				out;
+			std::vector<_CompactTask>*	tasks;
+			std::atomic<size_t>*		next;
+			bool						write;
+
+			void operator () ()
+			{
+				for( size_t i; ( i = ( *next)++) < tasks->size(); )
+				{
+					_CompactTask& task = ( *tasks)[ i];
+					task.ok = write ? task.write( *in, *out, task.offset, task.level) : task.size( *in, *out, task.offset, task.level, task.first, task.last);
+				}
+			}
+		};
+
+		// header of a compact file, the leaves taking [ head, leaves_end)
+		void save_compact_header( stream_type& out, const bool bit_pack, const offset_type root, const offset_type head, const offset_type tail, const offset_type leaves_end) const
+		{
+			out.seek( 0);
+			out.write( traits::signature(), traits::signature_size);
+			const unsigned char version = format_version;
+			out.write( &version, 1);
+			out.write( &item_count_, sizeof( item_count_));
+			const char flags = 1 | 2 | ( bit_pack ? 4 : 0) | ( traits::checksum_size ? 8 : 0) | _Layout::flag(); // compact, packed keys, bit packed, checksums, page size
+			out.write( &flags, 1);
+			out.write( &root_->level, sizeof( slotn_t));
+			out.write( &root, sizeof( offset_type));
+			out.write( &head, sizeof( offset_type));
+			out.write( &tail, sizeof( offset_type));
+			const offset_type extent[ 3] = { head, leaves_end, 0 }; // in place of free leaf, free inner, end
+			out.write( extent, sizeof( extent));
+		}
+
+		// runs the workers over the tasks, the first on the calling thread
+		static void run_compact( std::vector<_CompactWorker>& workers, const bool write)
+		{
+			std::atomic<size_t> next( 0);
+			std::vector<std::thread> threads;
+			for( size_t i = 0; i < workers.size(); ++i)
+			{
+				workers[ i].next = &next;
+				workers[ i].write = write;
+				if ( i)
+				{
+					threads.push_back( std::thread( std::ref( workers[ i])));
+				}
+			}
+			workers[ 0]();
+			for( size_t i = 0; i < threads.size(); ++i)
+			{
+				threads[ i].join();
+			}
+		}
+
+		stream_type& get_stream() const
+		{ 
+			BP_TREE_ASSERT( nodeman_.stream);
+			return *nodeman_.stream; 
+		}
+
+		_Leaf* find_leaf_( const key_type& key) const
+		{
+			_Node* node = root_;
+			if ( node)
+			{
+				while( !node->is_leaf())
+				{
+					node = read_child( static_cast<_Inner*>( node), node->find_upper( key));
+				}
+			}
+			return static_cast<_Leaf*>( node);
+		}
+
+		_IterDef find_( const key_type& key) const
+		{
+			_Leaf* const leaf = find_leaf_( key);
+			if ( leaf)
+			{
+				const slotn_t pos = leaf->find_lower( key);
+				if ( pos < leaf->used_slots && leaf->keys[ pos] == key)
+				{
+					return _IterDef( leaf, pos);
+				}
+			}
+			return _IterDef( 0, 0);
+		}
+
+		// first item not less than key
+		_IterDef lower_bound_( const key_type& key) const
+		{
+			_Leaf* leaf = find_leaf_( key);
+			slotn_t pos = 0;
+			if ( leaf)
+			{
+				pos = leaf->find_lower( key);
+				if ( pos == leaf->used_slots)
+				{
+					leaf = read_sibling( leaf, _Leaf::sibling_next);
+					pos = 0;
+				}
+			}
+			return _IterDef( leaf, pos);
+		}
+
+		// first item greater than key
+		_IterDef upper_bound_( const key_type& key) const
+		{
+			_Leaf* leaf = find_leaf_( key);
+			slotn_t pos = 0;
+			if ( leaf)
+			{
+				pos = leaf->find_upper( key);
+				if ( pos == leaf->used_slots)
+				{
+					leaf = read_sibling( leaf, _Leaf::sibling_next);
+					pos = 0;
+				}
+			}
+			return _IterDef( leaf, pos);
+		}
+
+		void link_possible_siblings( _Leaf* const node) const
+		{
+			{
+				const offset_type off = node->siblings[ _Leaf::sibling_next].offset;
+				if ( off == tail_->offset)
+				{
+					link_siblings( node, tail_);
+				}
+				else
+				{
+					_Cache::iterator sibling = cache_.find( off, false);
+					if ( sibling != cache_.end())
+					{
+						link_siblings( node, static_cast<_Leaf*>( *sibling));
+					}
+				}
+			}
+
+			const offset_type off = node->siblings[ _Leaf::sibling_prev].offset;
+			if ( off == head_->offset)
+			{
+				link_siblings( head_, node);
+			}
+			else
+			{
+				_Cache::iterator sibling = cache_.find( off, false);
+				if ( sibling != cache_.end())
+				{
+					link_siblings( static_cast<_Leaf*>( *sibling), node);
+				}
+			}
+		}
+
+		_Node* get_child( _Inner* const node, const slotn_t pos) const
+		{
+			_Node* child;
+			if ( node != root_)
+			{
+				cache_.touch( node->offset);
+			}
+
+			if ( node->is_ptr_at( pos))
+			{
+				child = node->children[ pos].ptr;
+				if ( child->offset != head_->offset && child->offset != tail_->offset)
+				{
+					cache_.touch( child->offset);
+				}
+				stats_.hit( child->level);
+			}
+			else
+			{
+				const offset_type offset = node->children[ pos].offset;
+				BP_TREE_ASSERT( offset && offset < eof_);
+				if ( node->level == 1 && offset == head_->offset)
+				{
+					child = head_;
+					stats_.hit( 0);
+				}
+				else if ( node->level == 1 && offset == tail_->offset)
+				{
+					child = tail_;
+					stats_.hit( 0);
+				}
+				else
+				{
+					// the child may have outlived its parent in the cache
+					_GetResult cached = cache_.get( offset);
+					if ( cached.second)
+					{
+						child = *cached.first;
+						cache_.touch( cached.first);
+						stats_.hit( child->level);
+					}
+					else if ( node->level != 1)
+					{
+						_Inner* const item = nodeman_.allocate_inner( offset, 0, node->level - 1);
+						load_node( item);
+						*cached.first = child = item;
+					}
+					else
+					{
+						_Leaf* const item = nodeman_.allocate_leaf( offset);
+						load_node( item);
+						link_possible_siblings( item);
+						*cached.first = child = item;
+					}
+				}
+
+				// a concurrent reader's node may have been evicted meanwhile
+				if ( !node->latch.is_retired())
+				{
+					node->link( pos, child);
+				}
+			}
+
+			return child;
+		}
+
+		// get_child for the read only operations; with concurrent readers a linked child is
+		// taken under the node's latch only, the mutex is locked just to load a missing one
+		_Node* read_child( _Inner* const node, const slotn_t pos) const
+		{
+			if ( _Sync::concurrent_reads)
+			{
+				for( ;;)
+				{
+					const size_t version = node->latch.read_lock();
+					_Node* const child = node->is_ptr_at( pos) ? node->children[ pos].ptr : 0;
+					if ( node->latch.validate( version))
+					{
+						if ( child)
+						{
+							stats_.hit( node->level - 1);
+							return child;
+						}
+						break;
+					}
+				}
+
+				_Lock lock( mutex_);
+				return get_child( node, pos);
+			}
+			return get_child( node, pos);
+		}
+
+		_Node* get_child_by_key( _Inner* const node, const key_type& key) const
+		{
+			return get_child( node, node->find_upper( key));
+		}
+
+		_Leaf* get_sibling( _Leaf* const node, const slotn_t index) const
+		{
+			cache_.touch( node->offset);
+			if ( !node->siblings[ index])
+			{
+				return 0;
+			}
+
+			if ( node->is_sibling_ptr_at( index))
+			{
+				_Leaf* const leaf = static_cast<_Leaf*>( node->siblings[ index].ptr);
+				cache_.touch( leaf->offset);
+				stats_.hit( 0);
+				return leaf;
+			}
+
+			const offset_type offset = node->siblings[ index].offset;
+			BP_TREE_ASSERT( offset && offset < eof_);
+
+			_Leaf* item;
+			if ( offset == head_->offset)
+			{
+				item = head_;
+				stats_.hit( 0);
+			}
+			else if ( offset == tail_->offset)
+			{
+				item = tail_;
+				stats_.hit( 0);
+			}
+			else
+			{
+				_GetResult cached = cache_.get( offset);
+				if ( cached.second)
+				{
+					item = static_cast<_Leaf*>( *cached.first);
+					cache_.touch( cached.first);
+					stats_.hit( 0);
+				}
+				else
+				{
+					item = nodeman_.allocate_leaf( offset);
+					load_node( item);
+					link_possible_siblings( item);
+					*cached.first = item;
+				}
+			}
+
+			// an iterator may still be on an evicted leaf
+			if ( !node->latch.is_retired())
+			{
+				item->link_sibling( node, !index);
+				node->link_sibling( item, index);
+			}
+
+			return item;
+		}
+
+		// Hints the stream to fetch the leaves that follow leaf in the given direction, skipping
+		// the first skip ones (already hinted). The offsets come from the level 1 parent of leaf,
+		// found by a descent through the (usually cached) inner nodes, so the hints stop at the
+		// parent's last child; linked children are resident and not hinted.
+		// Returns the number of leaves covered.
+		size_t read_ahead( const _Leaf* const leaf, const slotn_t direction, const size_t skip) const
+		{
+			if ( leaf->offset >= leaf_begin_ && leaf->offset < leaf_end_)
+			{
+				// the leaves of a compact file follow each other in key order and none is longer
+				// than a stride: one sequential hint covers the next read_ahead ones
+				const offset_type bytes = offset_type( traits::read_ahead) * _Leaf::stride_size;
+				offset_type first, last;
+				if ( direction == _Leaf::sibling_next)
+				{
+					first = leaf->offset;
+					last = std::min( leaf_end_, first + bytes);
+				}
+				else
+				{
+					last = leaf->offset;
+					first = last - leaf_begin_ > bytes ? last - bytes : leaf_begin_;
+				}
+				get_stream().prefetch( first, last - first);
+				return traits::read_ahead - skip;
+			}
+
+			_Node* node = root_;
+			if ( !node || node->is_leaf() || !leaf->used_slots)
+			{
+				return 0;
+			}
+
+			const key_type key = leaf->keys[ 0];
+			while( node->level > 1)
+			{
+				node = read_child( static_cast<_Inner*>( node), node->find_upper( key));
+			}
+
+			_Inner* const parent = static_cast<_Inner*>( node);
+			offset_type offsets[ traits::read_ahead ? traits::read_ahead : 1];
+			size_t count;
+			for( ;;)
+			{
+				const size_t version = parent->latch.read_lock();
+				const int pos = parent->find_upper( key);
+				const int step = direction == _Leaf::sibling_next ? 1 : -1;
+				count = 0;
+				for( int i = pos + step * int( skip + 1); count + skip < traits::read_ahead && i >= 0 && i <= parent->used_slots; i += step)
+				{
+					offsets[ count++] = parent->is_ptr_at( slotn_t( i)) ? 0 : parent->children[ i].offset;
+				}
+				if ( parent->latch.validate( version))
+				{
+					break;
+				}
+			}
+
+			stream_type& io = get_stream();
+			for( size_t i = 0; i < count; ++i)
+			{
+				if ( offsets[ i] && offsets[ i] < eof_)
+				{
+					io.prefetch( offsets[ i], _Leaf::stride_size);
+				}
+			}
+			return count;
+		}
+
+		// get_sibling for the read only operations, see read_child
+		_Leaf* read_sibling( _Leaf* const node, const slotn_t index) const
+		{
+			if ( _Sync::concurrent_reads)
+			{
+				for( ;;)
+				{
+					const size_t version = node->latch.read_lock();
+					const _LeafRef sibling = node->siblings[ index];
+					const bool linked = node->is_sibling_ptr_at( index) != 0;
+					if ( node->latch.validate( version))
+					{
+						if ( !sibling || linked)
+						{
+							if ( sibling)
+							{
+								stats_.hit( 0);
+							}
+							return sibling ? sibling.ptr : 0;
+						}
+						break;
+					}
+				}
+
+				_Lock lock( mutex_);
+				return get_sibling( node, index);
+			}
+			return get_sibling( node, index);
+		}
+
+		void insert_descend( _IterDef& def, key_type& splitkey, _Node*& splitnode, _Node* const node_item, const key_type& key)
+		{
+			if ( !node_item->is_leaf()) // Inner -----------------------------------------------
+			{
+				_Inner* const node = static_cast<_Inner*>( node_item);
+				key_type new_key;
+				_Node* new_child = 0;
+				insert_descend( def, new_key, new_child, get_child( node, node->find_upper( key)), key);
+				if ( new_child)
+				{
+					if ( node->is_full())
+					{
+						_Inner* const new_node = nodeman_.allocate_inner( allocate_inner_offset(), node->parent, node->level);
+						static_cast<_Inner*>( node)->split( splitkey, *new_node, new_key, new_child);
+						cache_new_node( splitnode = new_node);
+						stats_.split( node->level);
+					}
+					else
+					{
+						node->insert( new_key, new_child);
+						//splitnode = 0;
+					}
+				}
+			}
+			else // Leaf -----------------------------------------------------------------------
+			{
+				_Leaf* const node = static_cast<_Leaf*>( node_item);
+				if ( node->is_full())
+				{
+					splitnode = split_leaf( def, splitkey, node, key);
+				}
+				else
+				{
+					//splitnode = 0;
+					const slotn_t slot = node->find_lower( key);
+					node->insert( key, slot);
+					def.first = node;
+					def.second = slot;
+				}
+			}
+		}
+
+		// Splits the full leaf node, inserting key, and links the new right half after it;
+		// def is set to the slot of key.
+		_Leaf* split_leaf( _IterDef& def, key_type& splitkey, _Leaf* const node, const key_type& key)
+		{
+			_Leaf* const new_node = nodeman_.allocate_leaf( allocate_leaf_offset());
+
+			_Leaf* const next_node = get_sibling( node, _Leaf::sibling_next);
+			node->split( def, splitkey, *new_node, key);
+			stats_.split( 0);
+			if ( next_node)
+			{
+				link_siblings( new_node, next_node);
+				next_node->siblings_changes_bmp |= _Leaf::sibling_mask_prev;
+			}
+
+			link_siblings( node, new_node);
+			node->siblings_changes_bmp |= _Leaf::sibling_mask_next;
+
+			if ( tail_ == node)
+			{
+				tail_ = new_node;
+				change_flags_ |= tail_mask;
+				if ( node != head_)
+				{
+					cache_new_node( node);
+				}
+			}
+			else
+			{
+				cache_new_node( new_node);
+			}
+			return new_node;
+		}
+
+		// puts a new root over the old one and splitnode, split off it at splitkey
+		void grow_root( const key_type& splitkey, _Node* const splitnode)
+		{
+			_Inner* const new_root = nodeman_.allocate_inner( allocate_inner_offset(), 0, root_->level + 1);
+
+			new_root->keys[ 0] = splitkey;
+			new_root->link( 0, root_);
+			new_root->link( 1, splitnode);
+			new_root->used_slots = 1;
+
+			cache_node( root_);
+			cache_node( splitnode);
+
+			change_flags_ |= root_mask;
+			root_ = new_root;
+		}
+
+		// returns true if the node is left underfull
+		bool erase_descend( bool& found, _Node* const node_item, const key_type& key)
+		{
+			if ( node_item->is_leaf())
+			{
+				_Leaf* const node = static_cast<_Leaf*>( node_item);
+				const slotn_t pos = node->find_lower( key);
+				found = pos < node->used_slots && node->keys[ pos] == key;
+				if ( found)
+				{
+					node->erase( pos);
+				}
+			}
+			else
+			{
+				_Inner* const node = static_cast<_Inner*>( node_item);
+				const slotn_t pos = node->find_upper( key);
+				if ( erase_descend( found, get_child( node, pos), key))
+				{
+					rebalance( node, pos);
+				}
+			}
+			return found && node_item->used_slots < _Node::min_slots;
+		}
+
+		// Erases the keys of [ from, b) in the leaf holding from, adding them to count. If they
+		// run to the end of the leaf and the next leaf starts below b, from becomes its first key
+		// and more is set. Returns true if the node is left underfull.
+		bool erase_range_descend( size_t& count, bool& more, key_type& from, _Node* const node_item, const key_type& b)
+		{
+			size_t erased = 0;
+			if ( node_item->is_leaf())
+			{
+				_Leaf* const node = static_cast<_Leaf*>( node_item);
+				const slotn_t first = node->find_lower( from);
+				const slotn_t last = node->find_lower( b);
+				if ( last == node->used_slots)
+				{
+					_Leaf* const next = get_sibling( node, _Leaf::sibling_next);
+					more = next && next->used_slots && next->keys[ 0] < b;
+					if ( more)
+					{
+						from = next->keys[ 0];
+					}
+				}
+				if ( first < last)
+				{
+					if ( wal_)
+					{
+						for( slotn_t i = first; i < last; ++i)
+						{
+							wal_->log_erase( node->keys[ i]);
+						}
+					}
+					node->erase( first, last);
+					erased = last - first;
+					count += erased;
+				}
+			}
+			else
+			{
+				_Inner* const node = static_cast<_Inner*>( node_item);
+				const slotn_t pos = node->find_upper( from);
+				const size_t before = count;
+				if ( erase_range_descend( count, more, from, get_child( node, pos), b))
+				{
+					rebalance( node, pos);
+				}
+				erased = count - before;
+			}
+			return erased && node_item->used_slots < _Node::min_slots;
+		}
+
+		// merges the underfull child at pos with a neighbour, or moves items over from it
+		void rebalance( _Inner* const parent, const slotn_t pos)
+		{
+			BP_TREE_ASSERT( parent->used_slots);
+			const slotn_t sep = pos ? pos - 1 : 0;
+			_Node* const a = get_child( parent, sep);
+			_Node* const b = get_child( parent, sep + 1);
+			if ( a->is_leaf())
+			{
+				rebalance_leaves( parent, sep, static_cast<_Leaf*>( a), static_cast<_Leaf*>( b));
+			}
+			else
+			{
+				rebalance_inners( parent, sep, static_cast<_Inner*>( a), static_cast<_Inner*>( b));
+			}
+		}
+
+		void rebalance_leaves( _Inner* const parent, const slotn_t sep, _Leaf* const left, _Leaf* const right)
+		{
+			const slotn_t total = left->used_slots + right->used_slots;
+			if ( total <= _Node::slot_count)
+			{
+				std::move( right->keys, right->keys + right->used_slots, left->keys + left->used_slots);
+				std::move( right->data, right->data + right->used_slots, left->data + left->used_slots);
+				left->key_changes_bmp |= bitmap_type( ~0) << left->used_slots;
+				left->data_changes_bmp |= bitmap_type( ~0) << left->used_slots;
+				left->used_slots = total;
+
+				_Leaf* const next = get_sibling( right, _Leaf::sibling_next);
+				if ( next)
+				{
+					link_siblings( left, next);
+					next->siblings_changes_bmp |= _Leaf::sibling_mask_prev;
+				}
+				else
+				{
+					left->unlink_sibling( _Leaf::sibling_next, 0);
+				}
+				left->siblings_changes_bmp |= _Leaf::sibling_mask_next;
+
+				if ( right == tail_)
+				{
+					tail_ = left;
+					change_flags_ |= tail_mask;
+					if ( left != head_)
+					{
+						cache_.detach( left->offset);
+					}
+				}
+
+				parent->erase( sep);
+				free_node( right);
+			}
+			else
+			{
+				const slotn_t lower = ( total + 1) / 2;
+				if ( left->used_slots > lower)
+				{
+					const slotn_t n = left->used_slots - lower;
+					std::move_backward( right->keys, right->keys + right->used_slots, right->keys + right->used_slots + n);
+					std::move_backward( right->data, right->data + right->used_slots, right->data + right->used_slots + n);
+					std::move( left->keys + lower, left->keys + left->used_slots, right->keys);
+					std::move( left->data + lower, left->data + left->used_slots, right->data);
+				}
+				else
+				{
+					const slotn_t n = lower - left->used_slots;
+					std::move( right->keys, right->keys + n, left->keys + left->used_slots);
+					std::move( right->data, right->data + n, left->data + left->used_slots);
+					std::move( right->keys + n, right->keys + right->used_slots, right->keys);
+					std::move( right->data + n, right->data + right->used_slots, right->data);
+				}
+				left->used_slots = lower;
+				right->used_slots = total - lower;
+				left->key_changes_bmp = left->data_changes_bmp = bitmap_type( ~0);
+				right->key_changes_bmp = right->data_changes_bmp = bitmap_type( ~0);
+
+				parent->keys[ sep] = right->keys[ 0];
+				parent->mark_key_changed( sep);
+			}
+		}
+
+		void rebalance_inners( _Inner* const parent, const slotn_t sep, _Inner* const left, _Inner* const right)
+		{
+			// all the keys, the separator included, and all the children of both nodes
+			key_type	keys[ 2 * _Node::slot_count + 1];
+			_NodeRef	children[ 2 * _Node::slot_count + 2];
+			bool		is_ptr[ 2 * _Node::slot_count + 2];
+
+			const size_t key_count = left->used_slots + right->used_slots + 1;
+			std::copy( left->keys, left->keys + left->used_slots, keys);
+			keys[ left->used_slots] = parent->keys[ sep];
+			std::copy( right->keys, right->keys + right->used_slots, keys + left->used_slots + 1);
+			std::copy( left->children, left->children + left->used_slots + 1, children);
+			std::copy( right->children, right->children + right->used_slots + 1, children + left->used_slots + 1);
+			for( size_t i = 0; i <= key_count; ++i)
+			{
+				is_ptr[ i] = i <= left->used_slots ? left->is_ptr_at( slotn_t( i)) != 0 : right->is_ptr_at( slotn_t( i - left->used_slots - 1)) != 0;
+			}
+
+			const bool merge = key_count <= _Node::slot_count;
+			const size_t lower = merge ? key_count : key_count / 2;
+
+			left->used_slots = slotn_t( lower);
+			std::copy( keys, keys + lower, left->keys);
+			std::copy( children, children + lower + 1, left->children);
+			left->children_ptr_bmp = 0;
+			for( size_t i = 0; i <= lower; ++i)
+			{
+				left->children_ptr_bmp |= bitmap_type( is_ptr[ i]) << i;
+			}
+			left->key_changes_bmp = bitmap_type( ~0);
+			left->set_as_parent();
+
+			if ( merge)
+			{
+				parent->erase( sep);
+				free_node( right);
+			}
+			else
+			{
+				right->used_slots = slotn_t( key_count - lower - 1);
+				std::copy( keys + lower + 1, keys + key_count, right->keys);
+				std::copy( children + lower + 1, children + key_count + 1, right->children);
+				right->children_ptr_bmp = 0;
+				for( size_t i = lower + 1; i <= key_count; ++i)
+				{
+					right->children_ptr_bmp |= bitmap_type( is_ptr[ i]) << ( i - lower - 1);
+				}
+				right->key_changes_bmp = bitmap_type( ~0);
+				right->set_as_parent();
+
+				parent->keys[ sep] = keys[ lower];
+				parent->mark_key_changed( sep);
+			}
+		}
+
+		// an inner root left with a single child is replaced by it, an empty leaf root is dropped
+		void collapse_root()
+		{
+			while( !root_->is_leaf() && !root_->used_slots)
+			{
+				_Inner* const old_root = static_cast<_Inner*>( root_);
+				_Node* const child = get_child( old_root, 0);
+				if ( !child->is_leaf())
+				{
+					cache_.detach( child->offset);
+				}
+				child->parent = 0;
+				root_ = child;
+				change_flags_ |= root_mask;
+				free_node( old_root);
+			}
+
+			if ( !root_->used_slots)
+			{
+				BP_TREE_ASSERT( root_ == head_ && root_ == tail_);
+				_Node* const old_root = root_;
+				root_ = head_ = tail_ = 0;
+				change_flags_ |= root_mask | head_mask | tail_mask;
+				free_node( old_root);
+			}
+		}
+
+		// Keeps the nodes reached by a read only operation alive while it runs
+		class _ReadScope
+		{
+			_Epoch&			epoch;
+			const size_t	current;
+
+		public:
+			_ReadScope( const bp_tree* const tree): epoch( tree->nodeman_.epoch), current( epoch.enter()) {}
+			~_ReadScope() { epoch.leave( current); }
+		};
+
+		class base_iterator
+		{
+			friend bp_tree;
+
+		protected:
+			bp_tree*	tree;
+			_Leaf*		node;
+			slotn_t		index;
+			size_t		ahead;	//< leaves hinted to the stream beyond node
+
+			// the leaf is pinned, so it outlives its eviction while the iterator is on it
+			base_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): tree( tree), node( node), index( index), ahead( 0) { pin(); }
+			base_iterator( const base_iterator& item): tree( item.tree), node( item.node), index( item.index), ahead( item.ahead) { pin(); }
+			~base_iterator() { unpin(); }
+
+			base_iterator& operator = ( const base_iterator& item)
+			{
+				item.pin();
+				unpin();
+				tree = item.tree;
+				node = item.node;
+				index = item.index;
+				ahead = item.ahead;
+				return *this;
+			}
+
+			void pin() const	{ if ( node) node->latch.pin(); }
+			void unpin() const	{ if ( node) node->latch.unpin(); }
+
+			void move_to( _Leaf* const leaf)
+			{
+				if ( leaf)
+				{
+					leaf->latch.pin();
+				}
+				unpin();
+				node = leaf;
+			}
+
+			// keeps the next leaves of a scan in flight, so a cold leaf is not a blocking read
+			void read_ahead( const slotn_t direction)
+			{
+				if ( ahead)
+				{
+					--ahead;
+				}
+				if ( traits::read_ahead && stream_type::prefetches && node && ahead <= traits::read_ahead / 2)
+				{
+					ahead += tree->read_ahead( node, direction, ahead);
+				}
+			}
+
+			void to_next()
+			{
+				if ( node)
+				{
+					if ( index + 1 == node->used_slots)
+					{
+						_ReadScope scope( tree);
+						index = 0;
+						move_to( tree->read_sibling( node, _Leaf::sibling_next));
+						read_ahead( _Leaf::sibling_next);
+					}
+					else
+					{
+						++index;
+					}
+				}
+			}
+
+			void to_prev()
+			{
+				if ( node)
+				{
+					if ( !index)
+					{
+						_ReadScope scope( tree);
+						move_to( tree->read_sibling( node, _Leaf::sibling_prev));
 						index = node ? node->used_slots - 1 : 0;
+						read_ahead( _Leaf::sibling_prev);
+					}
+					else
+					{
+						--index;
+					}
+				}
+			}
+
+
+		public:
+			base_iterator(): tree( 0), node( 0), index( 0), ahead( 0) {}
+
+			const key_type& key() const { return node->keys[ index]; }
+			const value_type& value() const { return node->data[ index]; }
+
+			const value_type& operator * () const { return node->data[ index]; }
+			const value_type* operator -> () const { return &node->data[ index]; }
+
+			bool operator == ( const base_iterator& x) const
+			{
+				return node == x.node && index == x.index;
+			}
+
+			bool operator != ( const base_iterator& x) const
+			{
+				return node != x.node || index != x.index;
+			}
+
+			operator bool () const { return node != 0; }
+		};
+
+		bool is_locked_( _Node* const node) const
+		{
+			return cache_.is_locked( cache_.find( node->offset, false));
+		}
+
+		void lock_( _Node* const node) const
+		{
+			cache_.lock( cache_.find( node->offset, false));
+		}
+
+		void unlock_( _Node* const node) const
+		{
+			cache_.unlock( cache_.find( node->offset, false));
+		}
+
+		static std::ostream& pad( std::ostream& out, const int padding)
+		{
+			for( int i = 0; i < padding; ++i)
+			{
+				out << ' ';
+			}
+			return out;
+		}
+
+		static void print_keys( std::ostream& out, const _Node* const node, const int padding)
+		{
+			pad( out, padding) << "Keys ";
+			for( slotn_t i = 0; i < node->used_slots; ++i)
+			{
+				out << node->keys[ i] << '\t';
+			}
+			out << '\n';
+		}
+
+		void print_( std::ostream& out, _Node* const item, int padding)
+		{
+			BP_TREE_ASSERT( item->used_slots && item->used_slots <= _Node::slot_count);
+			pad( out, padding) << "Offset " << item->offset << '\n';
+			if ( !item->is_leaf())
+			{
+				_Inner* const node = static_cast<_Inner*>( item);
+				pad( out, padding) << "Level " << node->level << '\n';
+				print_keys( out, node, padding);
+				padding += 4;
+				lock_( node);
+				for( slotn_t i = 0; i < node->used_slots + 1; ++i)
+				{
+					print_( out, get_child( node, i), padding);
+					BP_TREE_ASSERT( node->used_slots <= _Node::slot_count);
+					out << '\n';
+				}
+				unlock_( node);
+			}
+			else
+			{
+				_Leaf* const node = static_cast<_Leaf*>( item);
+				print_keys( out, node, padding);
+				out << '\n';
+			}
+		}
+
+	public:
+		typedef typename _NodeManager::_InnerAllocator	inner_allocator_type;
+		typedef typename _NodeManager::_LeafAllocator	leaf_allocator_type;
+
+	protected:
+		typedef lru_cache<offset_type, _Node*, typename bp_tree::_NodeManager, lru_cache_dummy_statistics,
+							hash_compare<offset_type>, hm_accessor, _CachePolicy> _Cache;
+		typedef std::pair<typename _Cache::iterator, bool> _GetResult;
+
+		void cache_node( _Node* const node) const
+		{
+			if ( node != head_ && node != tail_)
+			{
+				cache_new_node( node);
+			}
+		}
+
+		void cache_new_node( _Node* const node) const
+		{
+			_GetResult pos = cache_.get( node->offset);
+			if ( !pos.second)
+			{
+				*pos.first = node;
+			}
+		}
+
+		enum E 
+		{ 
+			count_mask	= 1,
+			root_mask	= 2,
+			head_mask	= 4,
+			tail_mask	= 8,
+			free_mask	= 16,
+
+			version_offset		= traits::signature_size,
+			count_offset		= version_offset + 1,
+			flag_offset			= count_offset + sizeof( size_t),
+			root_level_offset	= flag_offset + 1,
+			root_offset			= root_level_offset + sizeof( slotn_t),
+			head_offset			= root_offset + sizeof( offset_type),
+			tail_offset			= head_offset + sizeof( offset_type),
+			free_leaf_offset	= tail_offset + sizeof( offset_type),
+			free_inner_offset	= free_leaf_offset + sizeof( offset_type),
+			end_offset			= free_inner_offset + sizeof( offset_type),
+			items_offset		= end_offset + sizeof( offset_type),
+			nodes_offset		= traits::page_size ? ( items_offset + _Layout::stride - 1) / _Layout::stride * _Layout::stride : items_offset	//< first node, aligned to the stride
+		};
+
+		// Freed node slots are chained through their first bytes; the heads of the leaf and
+		// inner chains are kept in the header and reused before the file is extended.
+		// Only the link of a freed slot is written, so the end of the used space is kept in
+		// the header too: the file itself may end before the last (freed) slot.
+		offset_type allocate_offset( offset_type& free_head, const size_t storage_size)
+		{
+			offset_type offset = free_head;
+			if ( offset)
+			{
+				_FlushLock lock( nodeman_.flusher);
+				stream_type& io = get_stream();
+				io.seek( offset);
+				io.read( &free_head, sizeof( offset_type));
+				change_flags_ |= free_mask;
+			}
+			else
+			{
+				offset = eof_;
+				eof_ += storage_size;
+			}
+			return offset;
+		}
+
+		offset_type allocate_leaf_offset()
+		{
+			return allocate_offset( free_leaf_, _Leaf::stride_size);
+		}
+
+		offset_type allocate_inner_offset()
+		{
+			return allocate_offset( free_inner_, _Inner::stride_size);
+		}
+
+		// drops a node from the cache, without saving it, and puts its slot on the free list
+		void free_node( _Node* const node)
+		{
+			offset_type& free_head = node->is_leaf() ? free_leaf_ : free_inner_;
+			if ( node != head_ && node != tail_ && node != root_)
+			{
+				cache_.detach( node->offset);
+			}
+
+			{
+				_FlushLock lock( nodeman_.flusher);
+				if ( nodeman_.flusher)
+				{
+					nodeman_.flusher->drop_pending( node->offset);
+				}
+				nodeman_.write_held( node->offset);
+				nodeman_.log_page( node->offset, node->is_leaf() ? size_t( _Leaf::storage_size) : size_t( _Inner::storage_size));
+				nodeman_.preserve( node);
+				stream_type& io = get_stream();
+				io.seek( node->offset);
+				io.write( &free_head, sizeof( offset_type));
+			}
+			free_head = node->offset;
+			change_flags_ |= free_mask;
+
+			node->parent = 0;
+			if ( node->is_leaf())
+			{
+				static_cast<_Leaf*>( node)->siblings_ptr_bmp = 0;
+			}
+			else
+			{
+				static_cast<_Inner*>( node)->children_ptr_bmp = 0;
+			}
+			nodeman_.release( node);
+		}
+
+		// remembers a node that failed its checksum
+		bool check_load( const bool loaded, const offset_type offset) const
+		{
+			if ( !loaded)
+			{
+				corrupt_.push_back( offset);
+			}
+			return loaded;
+		}
+
+		// Writes the header fields changed since open or the last checkpoint
+		void save_header( _Stream& stream)
+		{
+			if ( change_flags_)
+			{
+				nodeman_.log_page( 0, items_offset);
+			}
+
+			if ( change_flags_ & count_mask)
+			{
+				stream.seek( count_offset);
+				stream.write( &item_count_, sizeof( item_count_));
+			}
+
+			if ( change_flags_ & free_mask)
+			{
+				stream.seek( free_leaf_offset);
+				stream.write( &free_leaf_, sizeof( offset_type));
+				stream.write( &free_inner_, sizeof( offset_type));
+				stream.write( &eof_, sizeof( offset_type));
+			}
+
+			if ( item_count_)
+			{
+				BP_TREE_ASSERT( root_);
+				if ( change_flags_ & root_mask)
+				{
+					stream.seek( root_level_offset);
+					stream.write( &root_->level, sizeof( slotn_t));
+
+					stream.seek( root_offset);
+					stream.write( &root_->offset, sizeof( offset_type));
+				}
+
+				if ( !root_->is_leaf())
+				{
+					BP_TREE_ASSERT( head_);
+					if ( change_flags_ & head_mask)
+					{
+						stream.seek( head_offset);
+						stream.write( &head_->offset, sizeof( offset_type));
+					}
+
+					BP_TREE_ASSERT( tail_);
+					if ( change_flags_ & tail_mask)
+					{
+						stream.seek( tail_offset);
+						stream.write( &tail_->offset, sizeof( offset_type));
+					}
+				}
+			}
+		}
+
+		// Hands the flusher copies of the dirty nodes among the next flush_window_ victims of
+		// the cache, in the order the eviction policy takes them, every flush_window_ / 4
+		// inserts and erases. Called when an insert or erase
+		// starts, so the value written through the iterator of the previous insert is in.
+		void clean_ahead()
+		{
+			if ( !nodeman_.flusher || flush_countdown_--)
+			{
+				return;
+			}
+			flush_countdown_ = flush_window_ / 4;
+
+			_FlushLock lock( nodeman_.flusher);
+			size_t count = 0;
+			for( typename _Cache::const_victim_iterator i = cache_.victim_begin(); i != cache_.victim_end() && count < flush_window_; ++i, ++count)
+			{
+				_Node* const node = *i;
+				if ( nodeman_.flusher->is_pending( node->offset))
+				{
+					continue; // written first, the later changes wait for the next round
+				}
+
+				if ( node->is_leaf())
+				{
+					_Leaf* const leaf = static_cast<_Leaf*>( node);
+					if ( leaf->is_changed())
+					{
+						nodeman_.flusher->add( nodeman_.copy( leaf));
+						leaf->key_changes_bmp = leaf->data_changes_bmp = leaf->siblings_changes_bmp = 0;
+					}
+				}
+				else
+				{
+					_Inner* const inner = static_cast<_Inner*>( node);
+					if ( inner->is_changed())
+					{
+						nodeman_.flusher->add( nodeman_.copy( inner));
+						inner->key_changes_bmp = 0;
+					}
+				}
+			}
+		}
+
+		// loads a node missing from the cache
+		template <typename _N>
+		bool load_node( _N* const node) const
+		{
+			_FlushLock lock( nodeman_.flusher);
+			if ( nodeman_.flusher)
+			{
+				nodeman_.flusher->write_pending( node->offset);
+			}
+			nodeman_.write_held( node->offset);
+
+			stream_type& io = get_stream();
+			bool loaded = node->load_from( io);
+			if ( shadow_)
+			{
+				// checked after the read: an expired snapshot lost the images it may have raced
+				loaded = shadow_->restore( node) || loaded;
+				loaded = loaded && !shadow_->is_expired();
+			}
+			loaded = check_load( loaded, node->offset);
+			if ( _Stats::enabled)
+			{
+				stats_.miss( node->level);
+				stats_.read( io.position() - node->offset);
+			}
+			return loaded;
+		}
+
+		// checks the nodes of one level for verify, reading them into scratch nodes
+		struct _VerifyTask
+		{
+			stream_type*				io;
+			const offset_type*			first;
+			const offset_type*			last;
+			offset_type					eof;
+			bool						leaves;
+			std::vector<offset_type>	children;	//< of the valid inner nodes, in order
+			std::vector<offset_type>	corrupt;
+
+			void operator () ()
+			{
+				_Inner inner;
+				_Leaf leaf;
+				for( const offset_type* i = first; i != last; ++i)
+				{
+					bool valid;
+					if ( leaves)
+					{
+						leaf.offset = *i;
+						valid = leaf.load_from( *io);
+					}
+					else
+					{
+						inner.offset = *i;
+						valid = inner.load_from( *io);
+						for( slotn_t c = 0; valid && c < inner.used_slots + 1; ++c)
+						{
+							valid = inner.children[ c].offset && inner.children[ c].offset < eof;
+						}
+						for( slotn_t c = 0; valid && c < inner.used_slots + 1; ++c)
+						{
+							children.push_back( inner.children[ c].offset);
+						}
+					}
+
+					if ( !valid)
+					{
+						corrupt.push_back( *i);
+					}
+				}
+			}
+		};
+
+		// Writes the pages of the log back over the file, newest first, so the file is as it was
+		// when the log started; they stay in the log until the next checkpoint truncates it
+		void restore_pages( stream_type& io, wal_type& wal)
+		{
+			std::vector<typename wal_type::record> pages;
+			typename wal_type::record rec;
+			for( wal.rewind(); wal.read( rec); )
+			{
+				if ( rec.op == wal_type::op_page)
+				{
+					pages.push_back( rec);
+				}
+			}
+
+			for( typename std::vector<typename wal_type::record>::const_reverse_iterator i = pages.rbegin(); i != pages.rend(); ++i)
+			{
+				io.seek( offset_type( i->offset));
+				io.write( &i->page[ 0], i->page.size());
+				size_t& logged = nodeman_.logged[ offset_type( i->offset)];
+				logged = std::max( logged, i->page.size());
+			}
+			io.seek( 0);
+		}
+
+		// applies the changes of the log, before it is attached
+		void replay( wal_type& wal)
+		{
+			BP_TREE_ASSERT( !wal_);
+			typename wal_type::record rec;
+			for( wal.rewind(); wal.read( rec); )
+			{
+				switch( rec.op)
+				{
+				case wal_type::op_put:		put( rec.key, rec.value); break;
+				case wal_type::op_erase:	erase( rec.key); break;
+				case wal_type::op_clear:	clear(); break;
+				case wal_type::op_insert:	*insert_( rec.key) = rec.value; break;
+				}
+			}
+		}
+
+		typedef std::vector<std::pair<bool, value_type> >	_Results;
+		typedef std::vector<size_t>							_Probes;
+		typedef typename _Probes::const_iterator			_ProbeIter;
+
+		// orders the probes of find_many by key
+		struct _ProbeLess
+		{
+			const std::vector<key_type>& keys;
+
+			_ProbeLess( const std::vector<key_type>& keys): keys( keys) {}
+			bool operator () ( const size_t a, const size_t b) const { return keys[ a] < keys[ b]; }
+		};
+
+		// probes [ first, last) are sorted by key and all fall in the subtree of node
+		void find_many_descend( _Node* const node, const std::vector<key_type>& keys, const _ProbeIter first, const _ProbeIter last, _Results& results) const
+		{
+			if ( node->is_leaf())
+			{
+				const _Leaf* const leaf = static_cast<const _Leaf*>( node);
+				slotn_t pos = 0;
+				for( _ProbeIter i = first; i != last && pos < leaf->used_slots; ++i)
+				{
+					const key_type& key = keys[ *i];
+					pos = slotn_t( pos + bp_tree_node_search<key_type>::lower( leaf->keys + pos, leaf->used_slots - pos, key));
+					if ( pos < leaf->used_slots && leaf->keys[ pos] == key)
+					{
+						results[ *i] = std::make_pair( true, leaf->data[ pos]);
+					}
+				}
+				return;
+			}
+
+			// probes grouped by child
+			_Inner* const inner = static_cast<_Inner*>( node);
+			slotn_t children[ _Node::slot_count + 1];
+			_ProbeIter ends[ _Node::slot_count + 1];
+			size_t count = 0;
+			for( _ProbeIter i = first; i != last; ++count)
+			{
+				const slotn_t pos = inner->find_upper( keys[ *i]);
+				if ( pos < inner->used_slots)
+				{
+					const key_type& limit = inner->keys[ pos];
+					while( ++i != last && keys[ *i] < limit);
+				}
+				else
+				{
+					i = last;
+				}
+				children[ count] = pos;
+				ends[ count] = i;
+			}
+
+			// the children not in memory are hinted to the stream together, before the first load,
+			// if the stream prefetches at all
+			if ( stream_type::prefetches)
+			{
+				offset_type offsets[ _Node::slot_count + 1];
+				for( ;;)
+				{
+					const size_t version = inner->latch.read_lock();
+					for( size_t i = 0; i < count; ++i)
+					{
+						offsets[ i] = inner->is_ptr_at( children[ i]) ? 0 : inner->children[ children[ i]].offset;
+					}
+					if ( inner->latch.validate( version))
+					{
+						break;
+					}
+				}
+				stream_type& io = get_stream();
+				for( size_t i = 0; i < count; ++i)
+				{
+					if ( offsets[ i] && offsets[ i] < eof_)
+					{
+						io.prefetch( offsets[ i], inner->level == 1 ? _Leaf::stride_size : _Inner::stride_size);
+					}
+				}
+			}
+
+			// inner is locked in the cache, so loading its children does not evict it
+			pin_( inner, true);
+			_ProbeIter begin = first;
+			for( size_t i = 0; i < count; begin = ends[ i++])
+			{
+				find_many_descend( read_child( inner, children[ i]), keys, begin, ends[ i], results);
+			}
+			pin_( inner, false);
+		}
+
+		// locks or unlocks node in the cache, under mutex_ when readers are concurrent
+		void pin_( _Inner* const node, const bool pin) const
+		{
+			if ( _Sync::concurrent_reads)
+			{
+				_Lock lock( mutex_);
+				pin ? lock_( node) : unlock_( node);
+			}
+			else
+			{
+				pin ? lock_( node) : unlock_( node);
+			}
+		}
+
+		// orders batch items by key
+		struct _BatchLess
+		{
+			template <typename _Item>
+			bool operator () ( const _Item& a, const _Item& b) const { return a.first < b.first; }
+		};
+
+		// an inner node on the path of insert_batch and the bound of its key range
+		struct _PathStep
+		{
+			_Inner*		node;
+			key_type	limit;
+			bool		bounded;
+		};
+
+		typedef std::vector<_PathStep> _Path;
+
+		void unlock_path( _Path& path) const
+		{
+			for( typename _Path::iterator i = path.begin(); i != path.end(); ++i)
+			{
+				unlock_( i->node);
+			}
+			path.clear();
+		}
+
+		// Leaf of key, descending from the deepest node of path whose range holds key; the nodes
+		// of path are locked in the cache, so they stay valid while the batch is inserted.
+		_Leaf* batch_descend( _Path& path, const key_type& key, key_type& limit, bool& bounded) const
+		{
+			while( !path.empty() && path.back().bounded && !( key < path.back().limit))
+			{
+				unlock_( path.back().node);
+				path.pop_back();
+			}
+
+			if ( path.empty())
+			{
+				if ( root_->is_leaf())
+				{
+					bounded = false;
+					return static_cast<_Leaf*>( root_);
+				}
+				const _PathStep step = { static_cast<_Inner*>( root_), key_type(), false };
+				path.push_back( step);
+			}
+
+			for( ;;)
+			{
+				const _PathStep& parent = path.back();
+				const slotn_t pos = parent.node->find_upper( key);
+				_PathStep step;
+				step.node = 0;
+				step.bounded = pos < parent.node->used_slots || parent.bounded;
+				step.limit = pos < parent.node->used_slots ? parent.node->keys[ pos] : parent.limit;
+
+				_Node* const child = get_child( parent.node, pos);
+				if ( child->is_leaf())
+				{
+					limit = step.limit;
+					bounded = step.bounded;
+					return static_cast<_Leaf*>( child);
+				}
+				step.node = static_cast<_Inner*>( child);
+				lock_( step.node);
+				path.push_back( step);
+			}
+		}
+
+		// Splits the full leaf of key, the last one batch_descend returned for path, inserting
+		// key, and inserts the new leaf into the nodes of path, splitting those that are full in
+		// turn. leaf, limit and bounded become those of the half holding key; a split inner node
+		// leaves path empty, to be descended again by the next split. Returns the value of key.
+		value_type& batch_split( _Path& path, _Leaf*& leaf, const key_type& key, key_type& limit, bool& bounded)
+		{
+			_IterDef def;
+			key_type splitkey;
+			_Node* splitnode = split_leaf( def, splitkey, leaf, key);
+			if ( def.first == leaf)
+			{
+				limit = splitkey;
+				bounded = true;
+			}
+			leaf = def.first;
+
+			bool split_inner = false;
+			while( splitnode)
+			{
+				if ( path.empty())
+				{
+					grow_root( splitkey, splitnode);
+					break;
+				}
+
+				_Inner* const node = path.back().node;
+				if ( !node->is_full())
+				{
+					node->insert( splitkey, splitnode);
+					break;
+				}
+
+				key_type new_key;
+				_Inner* const new_node = nodeman_.allocate_inner( allocate_inner_offset(), node->parent, node->level);
+				node->split( new_key, *new_node, splitkey, splitnode);
+				cache_new_node( new_node);
+				stats_.split( node->level);
+				splitkey = new_key;
+				splitnode = new_node;
+				unlock_( node);
+				path.pop_back();
+				split_inner = true;
+			}
+			if ( split_inner)
+			{
+				unlock_path( path);
+			}
+
+			++item_count_;
+			change_flags_ |= count_mask;
+			return def.first->data[ def.second];
+		}
+
+		template <typename _Iter>
+		void insert_sorted_batch( _Iter first, const _Iter last)
+		{
+			_Path path;
+			_Leaf* leaf = 0;
+			key_type limit = key_type();
+			bool bounded = false;
+			for( ; first != last; ++first)
+			{
+				const key_type& key = first->first;
+				if ( wal_)
+				{
+					wal_->log_insert( key, first->second);
+				}
+				if ( leaf && bounded && !( key < limit))
+				{
+					leaf = 0;
+				}
+				if ( !leaf && root_)
+				{
+					leaf = batch_descend( path, key, limit, bounded);
+				}
+
+				if ( leaf && !leaf->is_full())
+				{
+					const slotn_t slot = leaf->find_lower( key);
+					leaf->insert( key, slot);
+					leaf->data[ slot] = first->second;
+					++item_count_;
+					change_flags_ |= count_mask;
+				}
+				else if ( leaf)
+				{
+					if ( path.empty() && leaf != root_)
+					{
+						// a split inner node left the path to be descended again
+						leaf = batch_descend( path, key, limit, bounded);
+					}
+					batch_split( path, leaf, key, limit, bounded) = first->second;
+				}
+				else
+				{
+					*insert_( key) = first->second;
+				}
+			}
+			unlock_path( path);
+		}
+
+		_Node*					root_;
+		_Leaf*					head_;
+		_Leaf*					tail_;
+		offset_type				eof_;
+		offset_type				free_leaf_;
+		offset_type				free_inner_;
+		size_t					item_count_;
+		mutable bitmap_type		change_flags_;
+		mutable _Cache			cache_;
+		mutable _NodeManager	nodeman_;
+		mutable _Mutex			mutex_;			//< serializes cache misses and evictions of concurrent readers
+		mutable std::vector<offset_type> corrupt_;	//< nodes that failed their checksum when loaded
+		wal_type*				wal_;			//< write-ahead log, if attached
+		mutable _Stats			stats_;			//< counters of statistics(), if the traits collect them
+		size_t					flush_window_;	//< coldest cached nodes kept clean by the flusher
+		size_t					flush_countdown_;//< inserts and erases until the next clean_ahead
+		_Shadow*				shadow_;		//< what the file lacks of the tree, if a snapshot
+		offset_type				leaf_begin_;	//< extent of the leaves of a compact file, in key order
+		offset_type				leaf_end_;
+		open_error_type			open_error_;	//< why the last open failed
+
+	public:
+		bp_tree( const size_t cache_size):
+			root_( 0),
+			head_( 0),
+			tail_( 0),
+			eof_( 0),
+			free_leaf_( 0),
+			free_inner_( 0),
+			item_count_( 0),
+			change_flags_( ~0),
+			cache_( cache_size),
+			wal_( 0),
+			flush_window_( 0),
+			flush_countdown_( 0),
+			shadow_( 0),
+			leaf_begin_( 0),
+			leaf_end_( 0),
+			open_error_( no_error)
+		{
+			cache_.set_observer( &nodeman_);
+			nodeman_.stats = &stats_;
+			nodeman_.reserve( cache_size);
+		}
+
+		bp_tree( const size_t cache_size, const inner_allocator_type& inner_allocator, const leaf_allocator_type& leaf_allocator):
+			root_( 0),
+			head_( 0),
+			tail_( 0),
+			eof_( 0),
+			free_leaf_( 0),
+			free_inner_( 0),
+			item_count_( 0),
+			change_flags_( ~0),
+			cache_( cache_size),
+			nodeman_( inner_allocator, leaf_allocator),
+			wal_( 0),
+			flush_window_( 0),
+			flush_countdown_( 0),
+			shadow_( 0),
+			leaf_begin_( 0),
+			leaf_end_( 0),
+			open_error_( no_error)
+		{
+			cache_.set_observer( &nodeman_);
+			nodeman_.stats = &stats_;
+			nodeman_.reserve( cache_size);
+		}
+
+		~bp_tree()
+		{
+			BP_TREE_ASSERT( nodeman_.shadows.empty()); // the snapshots go first
+			stop_flusher();
+			cache_.clear();
+			_Stream* const stream = nodeman_.stream;
+			if ( stream)
+			{
+				save_header( *stream);
+				if ( item_count_)
+				{
+					if ( !root_->is_leaf())
+					{
+						BP_TREE_ASSERT( head_ != root_);
+						nodeman_.save( root_);
+						nodeman_.save( head_);
+						nodeman_.save( tail_);
+						nodeman_.release( head_);
+						nodeman_.release( tail_);
 					}
 					else
 					{
-						--index;
+						nodeman_.save( root_);
+					}
+					nodeman_.release( root_);
+				}
+
+				// the file holds every logged change now
+				nodeman_.write_held();
+				if ( stream->sync() && wal_)
+				{
+					wal_->reset();
+				}
+			}
+			delete shadow_;
+		}
+
+		// signature
+		// format version
+		// item count
+		// flags: 1 compact, 2 packed keys, 4 bit packed keys and values, 8 node checksums
+		// root level
+		// root offset
+		// head offset
+		// tail offset
+		// free leaf offset (first leaf of a compact file)
+		// free inner offset (end of the leaves of a compact file)
+		// end offset
+		/// Opens the tree over io; with a write-ahead log the following put, erase, clear,
+		/// insert_batch and bulk_load calls are logged to it, and insert( key) is refused. A log
+		/// left by a crash is recovered from: the file must be the one the log was written with,
+		/// opened with its size as end_off. The log is truncated once the file holds its changes,
+		/// which takes a stream whose sync reaches the disk: over any other the open fails with
+		/// bad_log, as the log would be replayed over the changes made since it started.
+		bool open( stream_type& io, const offset_type end_off = 0, wal_type* const wal = 0)
+		{
+			if ( wal && !stream_type::durable)
+			{
+				open_error_ = bad_log;
+				return false;
+			}
+
+			bool ok;
+			eof_ = end_off;
+			if ( eof_ && wal)
+			{
+				restore_pages( io, *wal);
+			}
+			open_error_ = no_error;
+			if ( eof_)
+			{ // existing file
+				char sign[ traits::signature_size];
+				io.read( sign, traits::signature_size);
+				unsigned char version = 0;
+				io.read( &version, 1);
+				if ( memcmp( traits::signature(), sign, traits::signature_size))
+				{
+					// the default signature of the files written before the format version
+					open_error_ = traits::signature_size == 2 && !memcmp( sign, "B+", 2) ? bad_version : bad_signature;
+					ok = false;
+				}
+				else if ( version != format_version)
+				{
+					open_error_ = bad_version;
+					ok = false;
+				}
+				else
+				{
+					io.read( &item_count_, sizeof( item_count_));
+
+					char flags;
+					io.read( &flags, 1);
+					// the node layout differs with and without checksums and with the page size
+					const bool checksums = ( flags & 8) != 0;
+					const bool layout = ( flags & 0xf0) == ( _Layout::flag() & 0xf0);
+					io.set_compact( ( flags & 1) != 0);
+					io.set_packed( ( flags & 2) != 0);
+					io.set_bit_packed( ( flags & 4) != 0);
+
+					slotn_t root_level;
+					io.read( &root_level, sizeof( slotn_t));
+
+					offset_type root_off, head_off, tail_off;
+					io.read( &root_off, sizeof( offset_type));
+					io.read( &head_off, sizeof( offset_type));
+					io.read( &tail_off, sizeof( offset_type));
+
+					io.read( &free_leaf_, sizeof( offset_type));
+					io.read( &free_inner_, sizeof( offset_type));
+					if ( io.is_compact())
+					{
+						// no free slots, the leaves in key order instead (0 if written before that)
+						leaf_begin_ = free_leaf_;
+						leaf_end_ = free_inner_;
+						free_leaf_ = free_inner_ = 0;
+					}
+
+					offset_type end;
+					io.read( &end, sizeof( offset_type));
+					if ( end > eof_)
+					{
+						eof_ = end;
+					}
+
+					ok = io.ok() && checksums == ( traits::checksum_size != 0) && layout;
+					if ( !ok)
+					{
+						open_error_ = io.ok() ? bad_layout : bad_data;
+					}
+					else if ( item_count_)
+					{
+						BP_TREE_ASSERT( root_off && root_off < eof_);
+						change_flags_ = 0;
+						if ( root_level)
+						{
+							BP_TREE_ASSERT( head_off && head_off < eof_);
+							BP_TREE_ASSERT( tail_off && tail_off < eof_);
+
+							_Inner* const node = nodeman_.allocate_inner( root_off, 0, root_level);
+							ok = check_load( node->load_from( io), root_off);
+							root_ = node;
+
+							head_ = nodeman_.allocate_leaf( head_off);
+							ok = check_load( head_->load_from( io), head_off) && ok;
+
+							tail_ = nodeman_.allocate_leaf( tail_off);
+							ok = check_load( tail_->load_from( io), tail_off) && ok;
+						}
+						else
+						{
+							_Leaf* const node = nodeman_.allocate_leaf( root_off);
+							ok = check_load( node->load_from( io), root_off);
+							root_ = head_ = tail_ = node;
+						}
+
+						if ( !ok)
+						{
+							if ( root_ != head_)
+							{
+								nodeman_.release( head_);
+								nodeman_.release( tail_);
+							}
+							nodeman_.release( root_);
+							root_ = head_ = tail_ = 0;
+							item_count_ = 0;
+							open_error_ = bad_data;
+						}
 					}
 				}
 			}
+			else
+			{ // new file
+				io.write( traits::signature(), traits::signature_size);
+				const unsigned char version = format_version;
+				io.write( &version, 1);
+				item_count_ = 0;
+				free_leaf_ = free_inner_ = 0;
+				io.write( &item_count_, sizeof item_count_);
+				const char flags = ( traits::checksum_size ? 8 : 0) | _Layout::flag();
+				io.write( &flags, 1);
+				const slotn_t root_level = 0;
+				io.write( &root_level, sizeof( slotn_t));
+				const offset_type offsets[ 6] = { 0, 0, 0, 0, 0, 0 }; // root, head, tail, free leaf, free inner, end
+				io.write( offsets, sizeof( offsets));
+				eof_ = nodes_offset;
+				ok = io.ok();
+			}
+			nodeman_.stream = ok ? &io : 0;
+			if ( ok && wal)
+			{
+				// the writes of the replay keep their pages in the log as well
+				nodeman_.wal = wal;
+				nodeman_.log_base = eof_;
+				replay( *wal);
+				wal_ = wal;
+			}
+			return ok;
+		}
 
+		class const_iterator: public base_iterator
+		{
+			friend bp_tree;
 
+			const_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): base_iterator( tree, node, index) {}
 		public:
-			base_iterator(): tree( 0), node( 0), index( 0) {}
+			typedef const_iterator _Self;
 
-			const key_type& key() const { return node->keys[ index]; }
-			const value_type& value() const { return node->data[ index]; }
+			const_iterator() {}
+			const_iterator( const base_iterator& item): base_iterator( item) {}
 
-			const value_type& operator * () const { return node->data[ index]; }
-			const value_type* operator -> () const { return &node->data[ index]; }
+			_Self& operator ++ ()
+			{
+				to_next();
+				return *this;
+			}
 
-			bool operator == ( const base_iterator& x) const
+			_Self operator ++ (int)
 			{
-				return node == x.node && index == x.index;
+				_Self tmp = *this;
+				to_next();
+				return tmp;
 			}
 
-			bool operator != ( const base_iterator& x) const
+			_Self& operator -- ()
 			{
-				return node != x.node || index != x.index;
+				to_prev();
+				return *this;
 			}
 
-			operator bool () const { return node != 0; }
+			_Self operator -- (int)
+			{
+				_Self tmp = *this;
+				to_prev();
+				return tmp;
+			}
 		};
 
-		bool is_locked_( _Node* const node) const
+		class iterator: public const_iterator
 		{
-			return cache_.is_locked( cache_.find( node->offset, false));
+			friend bp_tree;
+
+			iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): const_iterator( tree, node, index) {}
+
+		public:
+			iterator() {}
+			iterator( const base_iterator& item): const_iterator( item) {}
+
+			value_type& operator * () { return node->data[ index]; }
+			value_type* operator -> () { return &node->data[ index]; }
+		};
+
+		class const_reverse_iterator: public base_iterator
+		{
+			friend bp_tree;
+
+			const_reverse_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): base_iterator( tree, node, index) {}
+		public:
+			typedef const_reverse_iterator _Self;
+
+			const_reverse_iterator() {}
+			const_reverse_iterator( const base_iterator& item): base_iterator( item) {}
+
+			_Self& operator ++ ()
+			{
+				to_prev();
+				return *this;
+			}
+
+			_Self operator ++ (int)
+			{
+				_Self tmp = *this;
+				to_prev();
+				return tmp;
+			}
+
+			_Self& operator -- ()
+			{
+				to_next();
+				return *this;
+			}
+
+			_Self operator -- (int)
+			{
+				_Self tmp = *this;
+				to_next();
+				return tmp;
+			}
+		};
+
+		class reverse_iterator: public const_reverse_iterator
+		{
+			friend bp_tree;
+
+			reverse_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): const_reverse_iterator( tree, node, index) {}
+
+		public:
+			reverse_iterator() {}
+			reverse_iterator( const base_iterator& item): const_reverse_iterator( item) {}
+
+			value_type& operator * () { return node->data[ index]; }
+			value_type* operator -> () { return &node->data[ index]; }
+		};
+
+		const_iterator begin() const
+		{
+			return const_iterator( this, head_, 0);
+		}
+
+		const_iterator end() const
+		{
+			return const_iterator( this, 0, 0);
+		}
+
+		iterator begin()
+		{
+			return iterator( this, head_, 0);
+		}
+
+		iterator end()
+		{
+			return iterator( this, 0, 0);
+		}
+
+		const_reverse_iterator rbegin() const
+		{
+			return const_reverse_iterator( this, tail_, tail_ ? tail_->used_slots - 1 : 0);
+		}
+
+		const_reverse_iterator rend() const
+		{
+			return const_reverse_iterator( this, 0, 0);
+		}
+
+		reverse_iterator rbegin()
+		{
+			return reverse_iterator( this, tail_, tail_ ? tail_->used_slots - 1 : 0);
+		}
+
+		reverse_iterator rend()
+		{
+			return reverse_iterator( this, 0, 0);
+		}
+
+		size_t size() const
+		{
+			return item_count_;
+		}
+
+		size_t depth() const
+		{
+			return root_ ? root_->level + 1: 0;
+		}
+
+		const_iterator find( const key_type& key) const
+		{
+			typename _Stats::timer timer( stats_, false);
+			_ReadScope scope( this);
+			const _IterDef def = find_( key);
+			return const_iterator( this, def.first, def.second);
+		}
+
+		const iterator find( const key_type& key)
+		{
+			typename _Stats::timer timer( stats_, false);
+			_ReadScope scope( this);
+			const _IterDef def = find_( key);
+			return iterator( this, def.first, def.second);
+		}
+
+		/// Looks up all the keys of [ first, last) at once: the probes are sorted, every subtree
+		/// is descended once for all the probes falling in it and each leaf is searched for all
+		/// its probes in one pass. results[ i] is ( true, value) for the i-th key, if found.
+		/// Returns the number of keys found.
+		template <typename _KeyIter>
+		size_t find_many( const _KeyIter first, const _KeyIter last, std::vector<std::pair<bool, value_type> >& results) const
+		{
+			const std::vector<key_type> keys( first, last);
+			results.assign( keys.size(), std::make_pair( false, value_type()));
+
+			_Probes probes( keys.size());
+			for( size_t i = 0; i < probes.size(); ++i)
+			{
+				probes[ i] = i;
+			}
+			std::sort( probes.begin(), probes.end(), _ProbeLess( keys));
+
+			if ( root_ && !probes.empty())
+			{
+				_ReadScope scope( this);
+				find_many_descend( root_, keys, probes.begin(), probes.end(), results);
+			}
+
+			size_t found = 0;
+			for( typename _Results::const_iterator i = results.begin(); i != results.end(); ++i)
+			{
+				found += i->first;
+			}
+			return found;
+		}
+
+		/// First item whose key is not less than key, end() if none
+		const_iterator lower_bound( const key_type& key) const
+		{
+			_ReadScope scope( this);
+			const _IterDef def = lower_bound_( key);
+			return const_iterator( this, def.first, def.second);
+		}
+
+		iterator lower_bound( const key_type& key)
+		{
+			_ReadScope scope( this);
+			const _IterDef def = lower_bound_( key);
+			return iterator( this, def.first, def.second);
+		}
+
+		/// First item whose key is greater than key, end() if none
+		const_iterator upper_bound( const key_type& key) const
+		{
+			_ReadScope scope( this);
+			const _IterDef def = upper_bound_( key);
+			return const_iterator( this, def.first, def.second);
+		}
+
+		iterator upper_bound( const key_type& key)
+		{
+			_ReadScope scope( this);
+			const _IterDef def = upper_bound_( key);
+			return iterator( this, def.first, def.second);
 		}
 
-		void lock_( _Node* const node) const
+		std::pair<const_iterator, const_iterator> equal_range( const key_type& key) const
 		{
-			cache_.lock( cache_.find( node->offset, false));
+			return std::pair<const_iterator, const_iterator>( lower_bound( key), upper_bound( key));
 		}
 
-		void unlock_( _Node* const node) const
+		std::pair<iterator, iterator> equal_range( const key_type& key)
 		{
-			cache_.unlock( cache_.find( node->offset, false));
+			return std::pair<iterator, iterator>( lower_bound( key), upper_bound( key));
 		}
 
-		static std::ostream& pad( std::ostream& out, const int padding)
+		/// Calls fn( key, value) for the items with keys in [ from, to), in key order.
+		/// The tree is descended once, then the leaves are walked directly; returns the
+		/// number of items visited.
+		template <typename _Fn>
+		size_t scan( const key_type& from, const key_type& to, _Fn fn) const
 		{
-			for( int i = 0; i < padding; ++i)
+			size_t count = 0;
+			for( const_iterator it = lower_bound( from); it.node; it.to_next())
 			{
-				out << ' ';
+				const _Leaf* const leaf = it.node;
+				for( ; it.index < leaf->used_slots; ++it.index, ++count)
+				{
+					if ( !( leaf->keys[ it.index] < to))
+					{
+						return count;
+					}
+					fn( leaf->keys[ it.index], leaf->data[ it.index]);
+				}
+				it.index = leaf->used_slots - 1; // to_next moves to the next leaf
 			}
-			return out;
+			return count;
 		}
 
-		static void print_keys( std::ostream& out, const _Node* const node, const int padding)
+		/// Inserts the key, even if the tree holds it already, and returns the position its value
+		/// is to be written to. The value cannot be logged, so while a write-ahead log is
+		/// attached the insert is refused and end() returned: use put or insert_batch.
+		iterator insert( const key_type& key)
 		{
-			pad( out, padding) << "Keys ";
-			for( slotn_t i = 0; i < node->used_slots; ++i)
-			{
-				out << node->keys[ i] << '\t';
-			}
-			out << '\n';
+			BP_TREE_ASSERT( !wal_);
+			return wal_ ? end() : insert_( key);
 		}
 
-		void print_( std::ostream& out, _Node* const item, int padding)
+	protected:
+		iterator insert_( const key_type& key)
 		{
-			BP_TREE_ASSERT( item->used_slots && item->used_slots <= _Node::slot_count);
-			pad( out, padding) << "Offset " << item->offset << '\n';
-			if ( !item->is_leaf())
+			typename _Stats::timer timer( stats_, true);
+			clean_ahead();
+			BP_TREE_ASSERT( !get_stream().is_compact() && !shadow_);
+			if ( root_)
 			{
-				_Inner* const node = static_cast<_Inner*>( item);
-				pad( out, padding) << "Level " << node->level << '\n';
-				print_keys( out, node, padding);
-				padding += 4;
-				lock_( node);
-				for( slotn_t i = 0; i < node->used_slots + 1; ++i)
+				key_type splitkey;
+				_Node* splitnode = 0;
+				_IterDef pos;
+				insert_descend( pos, splitkey, splitnode, root_, key);
+				if ( splitnode)
 				{
-					print_( out, get_child( node, i), padding);
-					BP_TREE_ASSERT( node->used_slots <= _Node::slot_count);
-					out << '\n';
+					grow_root( splitkey, splitnode);
 				}
-				unlock_( node);
+
+				if ( pos.first)
+				{
+					++item_count_;
+					change_flags_ |= count_mask;
+				}
+				return iterator( this, pos.first, pos.second);
 			}
 			else
 			{
-				_Leaf* const node = static_cast<_Leaf*>( item);
-				print_keys( out, node, padding);
-				out << '\n';
+				_Leaf* const leaf = nodeman_.allocate_leaf( allocate_leaf_offset());
+
+				leaf->insert( key, 0);
+				root_ = head_ = tail_ = leaf;
+				change_flags_ = ~0;
+
+				if ( leaf)
+				{
+					item_count_ = 1;
+				}
+				return iterator( this, leaf, 0);
 			}
 		}
 
 	public:
-		typedef typename _NodeManager::_InnerAllocator	inner_allocator_type;
-		typedef typename _NodeManager::_LeafAllocator	leaf_allocator_type;
-
-	protected:
-		typedef lru_cache<offset_type, _Node*, typename bp_tree::_NodeManager> _Cache;
-		typedef std::pair<typename _Cache::iterator, bool> _GetResult;
-
-		void cache_node( _Node* const node) const
+		/// Inserts the key, or overwrites the value of an existing one, and logs the change to
+		/// the write-ahead log
+		iterator put( const key_type& key, const value_type& value)
 		{
-			if ( node != head_ && node != tail_)
+			const _IterDef def = find_( key);
+			iterator it = def.first ? iterator( this, def.first, def.second) : insert_( key);
+			*it = value;
+			if ( def.first)
 			{
-				cache_new_node( node);
+				def.first->data_changes_bmp |= bitmap_type( 1) << def.second;
+			}
+			if ( wal_)
+			{
+				wal_->log_put( key, value);
 			}
+			return it;
 		}
 
-		void cache_new_node( _Node* const node) const
+		/// Inserts the ( key, value) pairs of [ first, last), sorting them by key first if they are
+		/// not. Consecutive keys that fall into the same leaf are inserted there directly and the
+		/// path of inner nodes is kept between keys, so only its part below the deepest node
+		/// whose range holds the next key is descended again. A full leaf is split along the kept
+		/// path and the batch goes on filling the half holding the next key; only a split of an
+		/// inner node has the path rebuilt from the root. Each item is logged to the write-ahead
+		/// log, if attached, in key order.
+		template <typename _Iter>
+		void insert_batch( const _Iter first, const _Iter last)
 		{
-			_GetResult pos = cache_.get( node->offset);
-			if ( !pos.second)
+			BP_TREE_ASSERT( !get_stream().is_compact() && !shadow_);
+			if ( std::is_sorted( first, last, _BatchLess()))
 			{
-				*pos.first = node;
+				insert_sorted_batch( first, last);
+			}
+			else
+			{
+				std::vector<std::pair<key_type, value_type> > items( first, last);
+				std::stable_sort( items.begin(), items.end(), _BatchLess());
+				insert_sorted_batch( items.begin(), items.end());
 			}
 		}
 
-		enum E 
-		{ 
-			count_mask	= 1,
-			root_mask	= 2,
-			head_mask	= 4,
-			tail_mask	= 8,
+		/// Builds the tree bottom-up from keys pushed in strictly increasing order.
+		/// Leaves and inner nodes are filled up to the fill factor and every node is written
+		/// exactly once, when it is complete; only the node being filled and its left neighbour
+		/// are kept in memory for each level. The tree must be empty and opened. With a
+		/// write-ahead log attached the items go to it, so only push( key, value) may be used.
+		class bulk_loader
+		{
+			bulk_loader( const bulk_loader&);
+			bulk_loader& operator = ( const bulk_loader&);
 
-			count_offset		= traits::signature_size,
-			flag_offset			= count_offset + sizeof( size_t),
-			root_level_offset	= flag_offset + 1,
-			root_offset			= root_level_offset + sizeof( slotn_t),
-			head_offset			= root_offset + sizeof( offset_type),
-			tail_offset			= head_offset + sizeof( offset_type),
-			items_offset		= tail_offset + sizeof( offset_type)
-		};
+			struct _Level
+			{
+				_Inner*		prev;
+				_Inner*		cur;
+				key_type	prev_first;	//< first key of prev's subtree
+				key_type	cur_first;	//< first key of cur's subtree
+				size_t		count;		//< nodes created on this level
 
-		_Node*					root_;
-		_Leaf*					head_;
-		_Leaf*					tail_;
-		offset_type				eof_;
-		size_t					item_count_;
-		mutable bitmap_type		change_flags_;
-		mutable _Cache			cache_;
-		mutable _NodeManager	nodeman_;
+				_Level(): prev( 0), cur( 0), count( 0) {}
+			};
 
-	public:
-		bp_tree( const size_t cache_size):
-			root_( 0),
-			head_( 0),
-			tail_( 0),
-			eof_( 0),
-			item_count_( 0),
-			change_flags_( ~0),
-			cache_( cache_size)
-		{
-			cache_.set_observer( &nodeman_);
-		}
+			typedef std::vector<_Level> _Levels;
 
-		bp_tree( const size_t cache_size, const inner_allocator_type& inner_allocator, const leaf_allocator_type& leaf_allocator):
-			root_( 0),
-			head_( 0),
-			tail_( 0),
-			eof_( 0),
-			item_count_( 0),
-			change_flags_( ~0),
-			cache_( cache_size),
-			nodeman_( inner_allocator, leaf_allocator)
-		{
-			cache_.set_observer( &nodeman_);
-		}
+			bp_tree&	tree;
+			_Leaf*		prev_leaf;
+			_Leaf*		cur_leaf;
+			size_t		leaf_count;
+			size_t		item_count;
+			slotn_t		leaf_fill;
+			slotn_t		inner_fill;	//< children per inner node
+			_Levels		levels;
+			bool		finished;
 
-		~bp_tree()
-		{
-			cache_.clear();
-			_Stream* const stream = nodeman_.stream;
-			if ( stream)
+			_Leaf* new_leaf()
 			{
-				if ( change_flags_ & count_mask)
+				_Leaf* const leaf = tree.nodeman_.allocate_leaf( tree.eof_);
+				tree.eof_ += _Leaf::stride_size;
+				leaf->used_slots = 0;
+				++leaf_count;
+				if ( cur_leaf)
 				{
-					stream->seek( count_offset);
-					stream->write( &item_count_, sizeof( item_count_));
+					cur_leaf->siblings[ _Leaf::sibling_next].offset = leaf->offset;
+					leaf->siblings[ _Leaf::sibling_prev].offset = cur_leaf->offset;
 				}
+				return leaf;
+			}
 
-				if ( item_count_)
+			// marks everything changed, so the eviction observer writes the whole node and frees it
+			void write( _Node* const node)
+			{
+				node->key_changes_bmp = bitmap_type( ~0);
+				if ( node->is_leaf())
 				{
-					BP_TREE_ASSERT( root_);
-					if ( change_flags_ & root_mask)
-					{
-						stream->seek( root_level_offset);
-						stream->write( &root_->level, sizeof( slotn_t));
+					_Leaf* const leaf = static_cast<_Leaf*>( node);
+					leaf->siblings_changes_bmp = leaf->data_changes_bmp = bitmap_type( ~0);
+				}
+				tree.nodeman_( node);
+			}
 
-						stream->seek( root_offset);
-						stream->write( &root_->offset, sizeof( offset_type));
-					}
+			// a complete leaf goes to its parent and to disk; head and tail stay resident
+			void flush_leaf( _Leaf* const leaf)
+			{
+				if ( leaf_count > 1)
+				{
+					push_child( 0, leaf->keys[ 0], leaf->offset);
+				}
 
-					if ( !root_->is_leaf())
+				if ( !tree.head_)
+				{
+					tree.head_ = leaf;
+				}
+				else if ( leaf != cur_leaf)
+				{
+					write( leaf);
+				}
+			}
+
+			void flush_inner( const size_t level, _Inner* const node, const key_type first)
+			{
+				push_child( level + 1, first, node->offset);
+				write( node);
+			}
+
+			void push_child( const size_t level, const key_type first, const offset_type offset)
+			{
+				if ( levels.size() == level)
+				{
+					levels.push_back( _Level());
+				}
+
+				_Level& l = levels[ level];
+				if ( !l.cur || l.cur->used_slots + 1 == inner_fill)
+				{
+					_Inner* const node = tree.nodeman_.allocate_inner( tree.eof_, 0, slotn_t( level + 1));
+					tree.eof_ += _Inner::stride_size;
+					node->used_slots = 0;
+					node->children[ 0].offset = offset;
+					++l.count;
+					if ( l.prev)
 					{
-						BP_TREE_ASSERT( head_);
-						if ( change_flags_ & head_mask)
-						{
-							stream->seek( head_offset);
-							stream->write( &head_->offset, sizeof( offset_type));
-						}
+						flush_inner( level, l.prev, l.prev_first);
+					}
+					// flush_inner may have grown levels, so l is reloaded
+					_Level& m = levels[ level];
+					m.prev = m.cur;
+					m.prev_first = m.cur_first;
+					m.cur = node;
+					m.cur_first = first;
+				}
+				else
+				{
+					l.cur->keys[ l.cur->used_slots] = first;
+					l.cur->children[ ++l.cur->used_slots].offset = offset;
+				}
+			}
 
-						BP_TREE_ASSERT( tail_);
-						if ( change_flags_ & tail_mask)
-						{
-							stream->seek( tail_offset);
-							stream->write( &tail_->offset, sizeof( offset_type));
-						}
+			// moves keys from the end of prev into an underfull last leaf
+			void balance( _Leaf* const prev, _Leaf* const cur)
+			{
+				if ( prev && cur->used_slots < leaf_fill / 2)
+				{
+					const slotn_t total = prev->used_slots + cur->used_slots;
+					const slotn_t move = total / 2 - cur->used_slots;
+					std::move_backward( cur->keys, cur->keys + cur->used_slots, cur->keys + cur->used_slots + move);
+					std::move_backward( cur->data, cur->data + cur->used_slots, cur->data + cur->used_slots + move);
+					std::move( prev->keys + prev->used_slots - move, prev->keys + prev->used_slots, cur->keys);
+					std::move( prev->data + prev->used_slots - move, prev->data + prev->used_slots, cur->data);
+					prev->used_slots -= move;
+					cur->used_slots += move;
+				}
+			}
 
-						BP_TREE_ASSERT( head_ != root_);
-						static_cast<_Inner*>( root_)->save_to( *stream);
-						head_->save_to( *stream);
-						tail_->save_to( *stream);
-						delete head_;
-						delete tail_;
+			// splits the children of prev and an underfull last inner node evenly
+			void balance( _Level& l)
+			{
+				if ( l.prev && l.cur->used_slots + 1 < inner_fill / 2)
+				{
+					_Inner& prev = *l.prev;
+					_Inner& cur = *l.cur;
+					key_type keys[ 2 * ( _Node::slot_count + 1)];
+					offset_type children[ 2 * ( _Node::slot_count + 1)];
+
+					// all separators, the one between prev and cur included, and all children
+					std::copy( prev.keys, prev.keys + prev.used_slots, keys);
+					keys[ prev.used_slots] = l.cur_first;
+					std::copy( cur.keys, cur.keys + cur.used_slots, keys + prev.used_slots + 1);
+					const size_t child_count = prev.used_slots + cur.used_slots + 2;
+					for( size_t i = 0; i < child_count; ++i)
+					{
+						children[ i] = i <= prev.used_slots ? prev.children[ i].offset : cur.children[ i - prev.used_slots - 1].offset;
 					}
-					else
+
+					const size_t prev_children = child_count - child_count / 2;
+					prev.used_slots = slotn_t( prev_children - 1);
+					cur.used_slots = slotn_t( child_count - prev_children - 1);
+					l.cur_first = keys[ prev.used_slots];
+					std::copy( keys + prev_children, keys + child_count - 1, cur.keys);
+					for( size_t i = 0; i < child_count; ++i)
 					{
-						static_cast<_Leaf*>( root_)->save_to( *stream);
+						( i < prev_children ? prev.children[ i] : cur.children[ i - prev_children]).offset = children[ i];
 					}
-					delete root_;
 				}
 			}
-		}
 
-		// signature
-		// item count
-		// root level
-		// root offset
-		// head offset
-		// tail offset
-		bool open( stream_type& io, const offset_type end_off = 0)
-		{
-			bool ok;
-			eof_ = end_off;
-			if ( eof_)
-			{ // existing file
-				char sign[ traits::signature_size];
-				io.read( sign, traits::signature_size);
-				if ( !memcmp( traits::signature(), sign, traits::signature_size))
+			value_type& push_( const key_type& key)
+			{
+				BP_TREE_ASSERT( !finished);
+				BP_TREE_ASSERT( !cur_leaf || cur_leaf->keys[ cur_leaf->used_slots - 1] < key);
+				if ( !cur_leaf || cur_leaf->used_slots == leaf_fill)
 				{
-					io.read( &item_count_, sizeof( item_count_));
-					if ( item_count_)
+					_Leaf* const leaf = new_leaf();
+					if ( prev_leaf)
 					{
-						char flags;
-						io.read( &flags, 1);
-						io.set_compact( flags & 1);
+						flush_leaf( prev_leaf);
+					}
+					prev_leaf = cur_leaf;
+					cur_leaf = leaf;
+				}
+				++item_count;
+				cur_leaf->keys[ cur_leaf->used_slots] = key;
+				return cur_leaf->data[ cur_leaf->used_slots++];
+			}
 
-						slotn_t root_level;
-						io.read( &root_level, sizeof( slotn_t));
+		public:
+			bulk_loader( bp_tree& tree, const float fill = 1):
+				tree( tree),
+				prev_leaf( 0),
+				cur_leaf( 0),
+				leaf_count( 0),
+				item_count( 0),
+				finished( false)
+			{
+				BP_TREE_ASSERT( !tree.root_ && tree.nodeman_.stream);
+				BP_TREE_ASSERT( fill > 0 && fill <= 1);
+				leaf_fill = slotn_t( std::max( 1, std::min( int( _Node::slot_count), int( fill * _Node::slot_count + 0.5f))));
+				inner_fill = slotn_t( std::max( 3, std::min( int( _Node::slot_count + 1), int( fill * ( _Node::slot_count + 1) + 0.5f))));
+			}
 
-						offset_type root_off;
-						io.read( &root_off, sizeof( offset_type));
-						BP_TREE_ASSERT( root_off && root_off < end_off);
+			~bulk_loader()
+			{
+				finish();
+			}
 
-						ok = io.ok();
-						if ( ok)
-						{
-							change_flags_ = 0;
-							if ( item_count_ > traits::slot_count)
-							{
-								offset_type head_off, tail_off;
+			value_type& push( const key_type& key)
+			{
+				BP_TREE_ASSERT( !tree.wal_);
+				return push_( key);
+			}
 
-								io.read( &head_off, sizeof( offset_type));
-								BP_TREE_ASSERT( head_off && head_off < end_off);
+			void push( const key_type& key, const value_type& value)
+			{
+				if ( tree.wal_)
+				{
+					tree.wal_->log_insert( key, value);
+				}
+				push_( key) = value;
+			}
 
-								io.read( &tail_off, sizeof( offset_type));
-								BP_TREE_ASSERT( tail_off && tail_off < end_off);
+			/// Writes the pending nodes and installs root, head and tail in the tree
+			void finish()
+			{
+				if ( finished || !cur_leaf)
+				{
+					finished = true;
+					return;
+				}
+				finished = true;
 
-								ok = io.ok();
-								if ( ok)
-								{
-									_Inner* const node = nodeman_.allocate_inner( root_off, 0, root_level);
-									node->load_from( io);
-									root_ = node;
+				balance( prev_leaf, cur_leaf);
+				if ( prev_leaf)
+				{
+					flush_leaf( prev_leaf);
+				}
+				flush_leaf( cur_leaf);
+				tree.tail_ = cur_leaf;
 
-									head_ = nodeman_.allocate_leaf( head_off);
-									head_->load_from( io);
+				if ( leaf_count == 1)
+				{
+					tree.root_ = cur_leaf;
+				}
+				else
+				{
+					for( size_t level = 0; ; ++level)
+					{
+						balance( levels[ level]);
+						_Level l = levels[ level];
+						if ( l.prev)
+						{
+							flush_inner( level, l.prev, l.prev_first);
+						}
 
-									tail_ = nodeman_.allocate_leaf( tail_off);
-									tail_->load_from( io);
-								}
-							}
-							else
-							{
-								_Leaf* const node = nodeman_.allocate_leaf( root_off);
-								node->load_from( io);
-								root_ = head_ = tail_ = node;
-							}
+						if ( levels[ level].count == 1)
+						{
+							tree.root_ = l.cur;
+							break;
 						}
+						flush_inner( level, l.cur, l.cur_first);
 					}
-					else
+				}
+
+				tree.item_count_ = item_count;
+				tree.change_flags_ = bitmap_type( ~0);
+			}
+		};
+
+		/// Bulk loads an empty tree from a sorted range of ( key, value) pairs
+		template <typename _Iter>
+		void bulk_load( _Iter first, const _Iter last, const float fill = 1)
+		{
+			bulk_loader loader( *this, fill);
+			for( ; first != last; ++first)
+			{
+				loader.push( first->first, first->second);
+			}
+			loader.finish();
+		}
+		size_t erase( const key_type& key)
+		{
+			clean_ahead();
+			bool found = false;
+			if ( root_)
+			{
+				BP_TREE_ASSERT( !get_stream().is_compact() && !shadow_);
+				erase_descend( found, root_, key);
+				if ( found)
+				{
+					--item_count_;
+					change_flags_ |= count_mask;
+					collapse_root();
+					if ( wal_)
 					{
-						ok = true;
+						wal_->log_erase( key);
 					}
 				}
-				else
+			}
+			return found;
+		}
+
+		/// Erases the keys in [ a, b). The tree is descended once per leaf holding some of them,
+		/// which loses them all at once and is rebalanced once.
+		size_t erase( const key_type& a, const key_type& b)
+		{
+			size_t count = 0;
+			key_type from = a;
+			for( bool more = root_ && a < b; more; )
+			{
+				BP_TREE_ASSERT( !get_stream().is_compact() && !shadow_);
+				clean_ahead();
+				more = false;
+				const size_t before = count;
+				erase_range_descend( count, more, from, root_, b);
+				if ( count != before)
 				{
-					ok = false;
+					item_count_ -= count - before;
+					change_flags_ |= count_mask;
+					collapse_root();
 				}
-			}
-			else
-			{ // new file
-				io.write( traits::signature(), traits::signature_size);
-				item_count_ = 0;
-				io.write( &item_count_, sizeof item_count_);
-				io.write( &item_count_, 1);
-				eof_ = items_offset;
-				ok = io.ok();
-			}
-			nodeman_.stream = ok ? &io : 0;
-			return ok;
+				more = more && root_;
+			}
+			return count;
 		}
 
-		class const_iterator: public base_iterator
+		void clear()
 		{
-			friend bp_tree;
-
-			const_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): base_iterator( tree, node, index) {}
-		public:
-			typedef const_iterator _Self;
-
-			const_iterator() {}
-			const_iterator( const base_iterator& item): base_iterator( item) {}
-
-			_Self& operator ++ ()
+			if ( wal_)
 			{
-				to_next();
-				return *this;
+				wal_->log_clear();
 			}
-
-			_Self& operator ++ (int)
+			if ( root_)
 			{
-				_Self tmp = *this;
-				to_next();
-				return tmp;
+				{
+					_FlushLock lock( nodeman_.flusher);
+					if ( nodeman_.flusher)
+					{
+						nodeman_.flusher->drop_all();
+					}
+					nodeman_.drop_held();
+				}
+				stream_type* tmp = nodeman_.stream;
+				nodeman_.stream = 0;
+				cache_.clear();
+				nodeman_.release_retired();
+				if ( !root_->is_leaf())
+				{
+					nodeman_.release( head_);
+					nodeman_.release( tail_);
+				}
+				nodeman_.release( root_);
+				item_count_ = 0;
+				change_flags_ = count_mask | free_mask /*| root_mask | head_mask | tail_mask*/;
+				root_ = head_ = tail_ = 0;
+				{
+					// the slots snapshots still see must not be reused by nodes of another type
+					std::lock_guard<std::mutex> lock( nodeman_.snap_mutex);
+					if ( nodeman_.shadows.empty())
+					{
+						eof_ = nodes_offset;
+					}
+				}
+				free_leaf_ = free_inner_ = 0;
+				nodeman_.stream = tmp;
 			}
+		}
 
-			_Self& operator -- ()
+		void print( std::ostream& out)
+		{
+			if ( root_)
 			{
-				to_prev();
-				return *this;
+				print_( out, root_, 0);
 			}
+		}
 
-			_Self& operator -- (int)
+		/// Starts a thread that writes, in the background, the dirty nodes about to be evicted:
+		/// every window / 4 inserts and erases the dirty nodes among the window coldest of the
+		/// cache (a quarter of it by default) are copied, marked clean and queued for the thread,
+		/// so evictions mostly drop clean nodes and a lookup seldom waits for a write. A larger
+		/// window cleans earlier, at the price of writing hot nodes more often. The tree must
+		/// be open; as for insert, nothing else may use it while the flusher starts or stops.
+		bool start_flusher( const size_t window = 0)
+		{
+			if ( nodeman_.flusher || !nodeman_.stream || get_stream().is_compact() || shadow_)
 			{
-				_Self tmp = *this;
-				to_prev();
-				return tmp;
+				return false;
 			}
-		};
+			flush_window_ = window ? window : std::max<size_t>( cache_.max_limit() / 4, 1);
+			flush_countdown_ = flush_window_ / 4;
+			nodeman_.flusher = new _Flusher( nodeman_);
+			return true;
+		}
 
-		class iterator: public const_iterator
+		/// Writes the queued nodes and stops the flusher thread
+		void stop_flusher()
 		{
-			friend bp_tree;
-
-			iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): const_iterator( tree, node, index) {}
-
-		public:
-			iterator() {}
-			iterator( const base_iterator& item): const_iterator( item) {}
-
-			value_type& operator * () { return node->data[ index]; }
-			value_type* operator -> () { return &node->data[ index]; }
-		};
+			delete nodeman_.flusher;
+			nodeman_.flusher = 0;
+		}
 
-		class const_reverse_iterator: public base_iterator
+		/// Writes the dirty nodes, cached or queued for the flusher, in offset order and then the
+		/// header, so the file holds the whole tree as the destructor would leave it, but the
+		/// cache stays warm. With sync the stream is then flushed to disk and an attached log,
+		/// now covered by the file, is reset. As for insert, nothing else may use the tree
+		/// meanwhile.
+		bool checkpoint( const bool sync = true)
 		{
-			friend bp_tree;
-
-			const_reverse_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): base_iterator( tree, node, index) {}
-		public:
-			typedef const_reverse_iterator _Self;
-
-			const_reverse_iterator() {}
-			const_reverse_iterator( const base_iterator& item): base_iterator( item) {}
-
-			_Self& operator ++ ()
+			_Stream* const stream = nodeman_.stream;
+			if ( !stream || stream->is_compact() || shadow_)
 			{
-				to_prev();
-				return *this;
+				return false;
 			}
 
-			_Self& operator ++ (int)
+			_FlushLock lock( nodeman_.flusher);
+			if ( nodeman_.flusher)
 			{
-				_Self tmp = *this;
-				to_prev();
-				return tmp;
+				nodeman_.flusher->write_all();
 			}
 
-			_Self& operator -- ()
+			// the nodes by offset, root, head and tail live outside of the cache; the cached ones
+			// from its map, as the mru order leaves out the locked nodes and 2Q's A1in queue
+			std::map<offset_type, const _Node*> nodes;
+			for( typename _Cache::const_iterator i = cache_.begin(); i != cache_.end(); ++i)
 			{
-				to_next();
-				return *this;
+				nodes[ ( *i)->offset] = *i;
 			}
-
-			_Self& operator -- (int)
+			if ( item_count_)
 			{
-				_Self tmp = *this;
-				to_next();
-				return tmp;
+				nodes[ root_->offset] = root_;
+				if ( !root_->is_leaf())
+				{
+					nodes[ head_->offset] = head_;
+					nodes[ tail_->offset] = tail_;
+				}
 			}
-		};
-
-		class reverse_iterator: public const_reverse_iterator
-		{
-			friend bp_tree;
-
-			reverse_iterator( bp_tree* const tree, _Leaf* const node, const slotn_t index): const_reverse_iterator( tree, node, index) {}
-
-		public:
-			reverse_iterator() {}
-			reverse_iterator( const base_iterator& item): const_reverse_iterator( item) {}
-
-			value_type& operator * () { return node->data[ index]; }
-			value_type* operator -> () { return &node->data[ index]; }
-		};
-
-		const_iterator begin() const
-		{
-			return const_iterator( this, head_, 0);
-		}
 
-		const_iterator end() const
-		{
-			return const_iterator( this, 0, 0);
-		}
+			for( typename std::map<offset_type, const _Node*>::const_iterator i = nodes.begin(); i != nodes.end(); ++i)
+			{
+				const _Node* const node = i->second;
+				const bool dirty = _NodeManager::is_changed( node);
+				if ( nodeman_.save( node) && _Stats::enabled && dirty)
+				{
+					stats_.written( stream->position() - node->offset);
+				}
+			}
+			nodeman_.write_held();
 
-		iterator begin()
-		{
-			return iterator( this, head_, 0);
+			save_header( *stream);
+			bool ok = stream->ok();
+			if ( ok)
+			{
+				change_flags_ = 0;
+				if ( sync)
+				{
+					ok = stream->sync();
+					if ( ok && wal_)
+					{
+						wal_->reset();
+						nodeman_.logged.clear();
+						nodeman_.log_base = eof_;
+					}
+				}
+			}
+			return ok;
 		}
 
-		iterator end()
+		/// Writes the dirty nodes and the header without syncing, see checkpoint
+		bool flush()
 		{
-			return iterator( this, 0, 0);
+			return checkpoint( false);
 		}
 
-		const_reverse_iterator rbegin() const
+		/// Opens view, a tree constructed but not opened, as a read-only snapshot of this one,
+		/// over io, a stream of its own over the same file. The tree is checkpointed first; from
+		/// then on, before it overwrites a node in the file, it keeps the node's image in memory
+		/// for the view, until the view is destroyed. The view may be read from another thread
+		/// while the tree changes, neither waits for the other but for an image lookup, and
+		/// it must be destroyed before the tree. Not for compact files.
+		/// Each slot rewritten while the view lives keeps its old node in memory, up to
+		/// max_images nodes (0 for no bound, letting a long lived view of a busy tree grow up to
+		/// the size of the file). Past them the view expires: its images are dropped, the nodes
+		/// it reads from then on fail as corrupt and snapshot_expired() tells so.
+		bool snapshot( bp_tree& view, stream_type& io, const size_t max_images = 0)
 		{
-			return const_reverse_iterator( this, tail_, tail_ ? tail_->used_slots - 1 : 0);
-		}
+			if ( view.nodeman_.stream || !checkpoint())
+			{
+				return false;
+			}
 
-		const_reverse_iterator rend() const
-		{
-			return const_reverse_iterator( this, 0, 0);
+			_Shadow* const shadow = new _Shadow( nodeman_, eof_, max_images);
+			if ( !view.open( io, eof_))
+			{
+				delete shadow;
+				return false;
+			}
+			view.shadow_ = shadow;
+			view.change_flags_ = 0;
+			return true;
 		}
 
-		reverse_iterator rbegin()
+		/// True once this view, opened by snapshot, outgrew the images it may keep: what it read
+		/// before still holds, the nodes it loads since fail as corrupt (see corrupt_nodes)
+		bool snapshot_expired() const
 		{
-			return reverse_iterator( this, tail_, tail_ ? tail_->used_slots - 1 : 0);
+			return shadow_ && shadow_->is_expired();
 		}
 
-		reverse_iterator rend()
+		/// Extent [ first, second) of the leaves of a compact file, written one after the other in
+		/// key order by compact_to, for scans to read in large sequential blocks. Empty for other
+		/// files and for compact files written before the extent was recorded.
+		std::pair<offset_type, offset_type> leaf_extent() const
 		{
-			return reverse_iterator( this, 0, 0);
+			return std::make_pair( leaf_begin_, leaf_end_);
 		}
 
-		size_t size() const
+		/// Why the last open returned false, no_error if it did not
+		open_error_type open_error() const
 		{
-			return item_count_;
+			return open_error_;
 		}
 
-		size_t depth() const
+		/// Offsets of the nodes that failed their checksum when loaded, since open. A corrupt
+		/// node is still linked in the tree, the items reached through it are not reliable.
+		const std::vector<offset_type>& corrupt_nodes() const
 		{
-			return root_ ? root_->level + 1: 0;
+			return corrupt_;
 		}
 
-		const_iterator find( const key_type& key) const
+		/// Cache hits and misses per level, evictions, bytes moved and find / insert latencies
+		/// since construction or reset_statistics(). Collected only when the traits' stats_type
+		/// is bp_tree_stats, otherwise all zero with enabled false.
+		bp_tree_stats_snapshot statistics() const
 		{
-			const _IterDef def = find_( key);
-			return const_iterator( this, def.first, def.second);
+			bp_tree_stats_snapshot snapshot;
+			stats_.snapshot( snapshot);
+			return snapshot;
 		}
 
-		const iterator find( const key_type& key)
+		void reset_statistics()
 		{
-			const _IterDef def = find_( key);
-			return iterator( this, def.first, def.second);
+			stats_.reset();
 		}
 
-		iterator insert( const key_type& key)
+		/// Checks the checksum of every node of the file, level by level, the nodes of a level
+		/// being split between threads workers (all the hardware threads by default). Streams are
+		/// not thread safe, so the i-th worker reads through its own stream_of( i) over the file.
+		/// The file is checked as last written, so the tree should have just been opened.
+		/// Nodes under a corrupt inner node are not reached. The offsets of the corrupt nodes
+		/// go to corrupt in increasing order; returns true if there are none.
+		template <typename _StreamOf>
+		bool verify( _StreamOf stream_of, std::vector<offset_type>& corrupt, size_t threads = 0) const
 		{
-			BP_TREE_ASSERT( !get_stream().is_compact());
-			if ( root_)
+			corrupt.clear();
 			{
-				key_type splitkey;
-				_Node* splitnode = 0;
-				_IterDef pos;
-				insert_descend( pos, splitkey, splitnode, root_, key);
-				if ( splitnode)
+				_FlushLock lock( nodeman_.flusher);
+				if ( nodeman_.flusher)
 				{
-					_Inner* const new_root = nodeman_.allocate_inner( eof_, 0, root_->level + 1);
-					eof_ += _Inner::storage_size;
-
-					new_root->keys[ 0] = splitkey;
-					new_root->link( 0, root_);
-					new_root->link( 1, splitnode);
-					new_root->used_slots = 1;
+					nodeman_.flusher->write_all();
+				}
+				nodeman_.write_held();
+			}
+			if ( !root_)
+			{
+				return true;
+			}
+			if ( !threads)
+			{
+				threads = std::max<size_t>( 1, std::thread::hardware_concurrency());
+			}
 
-					cache_node( root_);
-					cache_node( splitnode);
+			const stream_type& file = get_stream();
+			std::vector<_VerifyTask> tasks( threads);
+			for( size_t i = 0; i < threads; ++i)
+			{
+				stream_type& io = stream_of( i);
+				io.set_compact( file.is_compact());
+				io.set_packed( file.is_packed());
+				io.set_bit_packed( file.is_bit_packed());
+				tasks[ i].io = &io;
+				tasks[ i].eof = eof_;
+			}
 
-					change_flags_ |= root_mask;
-					root_ = new_root;
+			std::vector<offset_type> level( 1, root_->offset), next;
+			for( size_t depth = root_->level + 1; depth-- && !level.empty(); )
+			{
+				const size_t chunk = ( level.size() + threads - 1) / threads;
+				std::vector<std::thread> workers;
+				for( size_t i = 0; i < threads; ++i)
+				{
+					_VerifyTask& task = tasks[ i];
+					task.first = &level[ 0] + std::min( level.size(), i * chunk);
+					task.last = &level[ 0] + std::min( level.size(), ( i + 1) * chunk);
+					task.leaves = !depth;
+					if ( i && task.first != task.last)
+					{
+						workers.push_back( std::thread( std::ref( task)));
+					}
+				}
+				tasks[ 0]();
+				for( size_t i = 0; i < workers.size(); ++i)
+				{
+					workers[ i].join();
 				}
 
-				if ( pos.first)
+				next.clear();
+				for( size_t i = 0; i < threads; ++i)
 				{
-					++item_count_;
+					_VerifyTask& task = tasks[ i];
+					next.insert( next.end(), task.children.begin(), task.children.end());
+					corrupt.insert( corrupt.end(), task.corrupt.begin(), task.corrupt.end());
+					task.children.clear();
+					task.corrupt.clear();
 				}
-				return iterator( this, pos.first, pos.second);
+				level.swap( next);
 			}
-			else
-			{
-				_Leaf* const leaf = nodeman_.allocate_leaf( eof_);
-				eof_ += _Leaf::storage_size;
 
-				leaf->insert( key, 0);
-				root_ = head_ = tail_ = leaf;
-				change_flags_ = ~0;
+			std::sort( corrupt.begin(), corrupt.end());
+			return corrupt.empty();
+		}
 
-				if ( leaf)
+		/// Writes the tree to out as a read only compact file. Keys are packed; with bit_pack the
+		/// keys and integral values of every node are stored as bit packed deltas from a base.
+		/// The nodes are streamed out in two passes over the tree, the first summing their sizes
+		/// per level; only a node per level is kept besides the cache. The leaves are written in
+		/// key order in one extent, recorded in the header, see leaf_extent.
+		bool compact_to( stream_type& out, const bool bit_pack = false)
+		{
+			bool ok;
+			if ( root_ && !root_->is_leaf())
+			{
+				out.set_compact( true);
+				out.set_packed( true);
+				out.set_bit_packed( bit_pack);
+
+				key_type first, last;
+				_Leaf leaf;
+				const size_t levels = root_->level + 1;
+				_CompactLayout sizes( levels);
+				const _CompactStream size = { *this, out, sizes, leaf, false };
+				size( root_, first, last);
+
+				_CompactLayout layout( levels);
+				offset_type offset = items_offset;
+				for( size_t level = levels; level--; )
 				{
-					item_count_ = 1;
+					layout.next[ level] = offset;
+					offset += sizes.next[ level];
 				}
-				return iterator( this, leaf, 0);
+				save_compact_header( out, bit_pack, items_offset, layout.next[ 0], offset - sizes.leaf_size, offset);
+
+				const _CompactStream write = { *this, out, layout, leaf, true };
+				write( root_, first, last);
+				ok = out.ok();
 			}
+			else
+			{
+				ok = false;
+			}
+			return ok;
 		}
 
-		void erase( const key_type& key)
+		/// Writes the tree to out as a read only compact file like compact_to above, with the
+		/// subtrees under the root sized and then written by threads workers (all the hardware
+		/// threads by default). The i-th worker reads the tree's file through in_of( i) and writes
+		/// out's file through out_of( i), streams of its own; over the mmap and pio streams these
+		/// are shared views of the tree's stream and of out (writable ones for out_of), which
+		/// never resize the file. Each subtree gets the share of each level's region following
+		/// those of the subtrees before it, so the workers write disjoint regions, and out extends
+		/// the file to its full size before they start. The tree is checkpointed first, for the
+		/// workers to read it all from the file; out and the workers' streams hold the compact
+		/// file once all are flushed.
+		template <typename _InOf, typename _OutOf>
+		bool compact_to( stream_type& out, _InOf in_of, _OutOf out_of, const bool bit_pack = false, size_t threads = 0)
 		{
-			if ( root_)
+			if ( !root_ || root_->is_leaf() || ( !get_stream().is_compact() && !checkpoint()))
 			{
-				// not implemented
-				BP_TREE_ASSERT( 0);
+				return false;
 			}
-		}
 
-		void erase( const key_type& a, const key_type& b)
-		{
-			if ( root_)
+			out.set_compact( true);
+			out.set_packed( true);
+			out.set_bit_packed( bit_pack);
+
+			const _Inner* const root = static_cast<const _Inner*>( root_);
+			std::vector<_CompactTask> tasks( root->used_slots + 1);
+			bitmap_type flag = 1;
+			for( slotn_t i = 0; i < root->used_slots + 1; ++i, flag <<= 1)
 			{
-				// not implemented
-				BP_TREE_ASSERT( 0);
+				_CompactTask& task = tasks[ i];
+				task.offset = root->child_offset( flag, i);
+				task.level = root->level - 1;
+				task.layout = _CompactLayout( root->level);
+				task.next_size = task.next_inner = 0;
+				task.ok = false;
 			}
-		}
 
-		void clear()
-		{
-			if ( root_)
+			if ( !threads)
 			{
-				stream_type* tmp = nodeman_.stream;
-				nodeman_.stream = 0;
-				cache_.clear();
-				if ( item_count_ > 1)
-				{
-					delete head_;
-					delete tail_;
-				}
-				delete root_;
-				item_count_ = 0;
-				change_flags_ = count_mask /*| root_mask | head_mask | tail_mask*/;
-				root_ = head_ = tail_ = 0;
-				eof_ = items_offset;
-				nodeman_.stream = tmp;
+				threads = std::max<size_t>( 1, std::thread::hardware_concurrency());
 			}
-		}
+			threads = std::min( threads, tasks.size());
 
-		void print( std::ostream& out)
-		{
-			if ( root_)
+			const stream_type& file = get_stream();
+			std::vector<_CompactWorker> workers( threads);
+			for( size_t i = 0; i < threads; ++i)
 			{
-				print_( out, root_, 0);
+				stream_type& in = in_of( i);
+				in.set_compact( file.is_compact());
+				in.set_packed( file.is_packed());
+				in.set_bit_packed( file.is_bit_packed());
+				stream_type& io = out_of( i);
+				io.set_compact( true);
+				io.set_packed( true);
+				io.set_bit_packed( bit_pack);
+				workers[ i].in = &in;
+				workers[ i].out = &io;
+				workers[ i].tasks = &tasks;
 			}
-		}
 
-		bool compact_to( stream_type& out)
-		{
-			bool ok;
-			if ( root_ && !root_->is_leaf())
+			run_compact( workers, false);
+			_Inner inner;
+			key_type separators[ _Node::slot_count];
+			for( slotn_t i = 0; i < root->used_slots + 1; ++i)
 			{
-				struct _NodeInfo
+				if ( !tasks[ i].ok)
 				{
-					size_t		storage_size;
-					offset_type	new_offset;
-
-					_NodeInfo() {}
-					_NodeInfo( const size_t size): storage_size( size) {}
-				};
-
-				using namespace std;
-				typedef map<offset_type, _NodeInfo> NodeInfoMap;
-				NodeInfoMap nodeInfoMap;
-
-				compact_analyse_descend( nodeInfoMap, (_Inner*) root_);
-				size_t offset = items_offset;
-				for( NodeInfoMap::iterator i = nodeInfoMap.begin(); i != nodeInfoMap.end(); ++i)
+					return false;
+				}
+				if ( i)
 				{
-					i->second.new_offset = offset;
-					offset += i->second.storage_size;
+					separators[ i - 1] = _KeyCodec::separator( tasks[ i - 1].last, tasks[ i].first, root->keys[ i - 1]);
 				}
+			}
 
-				out.write( traits::signature(), traits::signature_size);
-				out.write( &item_count_, sizeof( item_count_));
-				char flags = 1;
-				out.write( &flags, 1);
-				out.write( &root_->level, sizeof( slotn_t));
-				out.write( &nodeInfoMap[ root_->offset].new_offset, sizeof( offset_type));
-				out.write( &nodeInfoMap[ head_->offset].new_offset, sizeof( offset_type));
-				out.write( &nodeInfoMap[ tail_->offset].new_offset, sizeof( offset_type));
-
-				_Inner inner;
-				_Leaf leaf;
-				out.set_compact( true);
-				compact_write_descend( (_Inner*) root_, out, nodeInfoMap, inner, leaf);
-				inner.clear();
-				ok = true;
+			// the subtrees' shares of each level's region, from the sums of the sizes before them
+			offset_type offset = items_offset + root->actual_storage_size( out, separators);
+			for( size_t level = root->level; level--; )
+			{
+				for( size_t i = 0; i < tasks.size(); ++i)
+				{
+					const size_t size = tasks[ i].layout.next[ level];
+					tasks[ i].layout.next[ level] = offset;
+					offset += size;
+				}
 			}
-			else
+			for( size_t i = 0; i < tasks.size(); ++i)
 			{
-				ok = false;
+				tasks[ i].layout.prev_leaf = i ? tasks[ i].layout.next[ 0] - tasks[ i - 1].layout.leaf_size : 0;
 			}
-			return ok;
+			save_compact_header( out, bit_pack, items_offset, tasks.front().layout.next[ 0], offset - tasks.back().layout.leaf_size, offset);
+			const char zero = 0;
+			out.seek( offset - 1);
+			out.write( &zero, 1);
+			if ( !out.sync())
+			{
+				return false;
+			}
+
+			run_compact( workers, true);
+			std::copy( separators, separators + root->used_slots, inner.keys);
+			inner.offset = items_offset;
+			inner.used_slots = root->used_slots;
+			inner.key_changes_bmp = bitmap_type( ~0);
+			bool ok = true;
+			for( size_t i = 0; i < tasks.size(); ++i)
+			{
+				ok = ok && tasks[ i].ok;
+				inner.children[ i].offset = tasks[ i].layout.written;
+			}
+			out.seek( items_offset);
+			inner.raw_save_to( out);
+			return ok && out.ok();
 		}
 	};
 }
@@ -0,0 +1,445 @@
+﻿#pragma once
+/// B+ Tree key codecs of compact files
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+// SSE2 unpacking of bit packed blocks; BP_TREE_NO_SIMD turns it off like the key search
+#if !defined(BP_TREE_NO_SIMD) && ( defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define BP_TREE_CODEC_SSE2
+#endif
+
+#ifndef PCH
+	#include <cstddef>
+	#include <algorithm>
+	#include <type_traits>
+	#ifdef BP_TREE_CODEC_SSE2
+		#include <emmintrin.h>
+	#endif
+#endif
+
+namespace stdext
+{
+	/// Key block encoding of the compact files, used by the streams' read_keys / write_keys
+	/// once set_packed( true). Generic keys are stored as they are and their separators are
+	/// kept as the tree has them.
+	template <typename _Key, bool integral = std::is_integral<_Key>::value && !std::is_same<_Key, bool>::value && sizeof( _Key) <= 8>
+	struct bp_tree_key_codec
+	{
+		/// Separator to write between the subtrees ending with left and starting with right
+		static _Key separator( const _Key& left, const _Key& right, const _Key& current)
+		{
+			return current;
+		}
+
+		static size_t size( const _Key* const keys, const size_t used)
+		{
+			return sizeof( _Key) * used;
+		}
+
+		template <typename _Stream>
+		static void write( _Stream& out, const _Key* const keys, const size_t used)
+		{
+			out.write( keys, sizeof( _Key) * used);
+		}
+
+		template <typename _Stream>
+		static bool read( _Stream& input, _Key* const keys, const size_t used)
+		{
+			input.read( keys, sizeof( _Key) * used);
+			return true;
+		}
+	};
+
+	/// Integral keys. Separators are cut to the value of ( left, right] with the most trailing
+	/// zero bits and a block stores only the bytes that differ between its keys:
+	/// one byte ( prefix << 4 | suffix), the prefix high bytes common to all the keys, then
+	/// for every key the bytes between the common prefix and the suffix low bytes that are
+	/// zero in all of them; all bytes low first. An empty block takes no byte.
+	template <typename _Key>
+	struct bp_tree_key_codec<_Key, true>
+	{
+		typedef typename std::make_unsigned<_Key>::type	_Bits;
+		typedef unsigned long long						_Word;
+
+		enum E
+		{
+			key_size	= sizeof( _Key),
+			read_chunk	= 64		//< keys decoded per read
+		};
+
+		// signed keys are ordered as unsigned after flipping the sign bit
+		static _Word bias()
+		{
+			return std::is_signed<_Key>::value ? _Word( 1) << ( 8 * key_size - 1) : 0;
+		}
+
+		static _Word bits( const _Key key)
+		{
+			return _Word( _Bits( key));
+		}
+
+		static _Key separator( const _Key& left, const _Key& right, const _Key& current)
+		{
+			const _Word l = bits( left) ^ bias(), r = bits( right) ^ bias();
+			if ( !( left < right))
+			{
+				return current;
+			}
+
+			// right with the bits below the highest one differing from left cleared
+			int high = 0;
+			for( _Word diff = l ^ r; diff >>= 1; )
+			{
+				++high;
+			}
+			const _Word cut = ( r >> high) << high;
+			return _Key( _Bits( cut ^ bias()));
+		}
+
+		static void layout( const _Key* const keys, const size_t used, unsigned& prefix, unsigned& suffix)
+		{
+			const _Word first = bits( keys[ 0]);
+			_Word diff = 0, any = 0;
+			for( size_t i = 0; i < used; ++i)
+			{
+				diff |= bits( keys[ i]) ^ first;
+				any |= bits( keys[ i]);
+			}
+
+			prefix = key_size;
+			for( ; diff; diff >>= 8)
+			{
+				--prefix;
+			}
+
+			suffix = 0;
+			if ( any)
+			{
+				for( ; !( any & 0xff); any >>= 8)
+				{
+					++suffix;
+				}
+			}
+			if ( suffix > key_size - prefix)
+			{
+				suffix = key_size - prefix;
+			}
+		}
+
+		static size_t size( const _Key* const keys, const size_t used)
+		{
+			if ( !used)
+			{
+				return 0;
+			}
+			unsigned prefix, suffix;
+			layout( keys, used, prefix, suffix);
+			return 1 + prefix + used * ( key_size - prefix - suffix);
+		}
+
+		template <typename _Stream>
+		static void write( _Stream& out, const _Key* const keys, const size_t used)
+		{
+			if ( !used)
+			{
+				return;
+			}
+			unsigned prefix, suffix;
+			layout( keys, used, prefix, suffix);
+			const unsigned width = key_size - prefix - suffix;
+
+			unsigned char bytes[ 1 + key_size];
+			bytes[ 0] = (unsigned char)( prefix << 4 | suffix);
+			if ( prefix)
+			{
+				const _Word high = bits( keys[ 0]) >> ( 8 * ( key_size - prefix));
+				for( unsigned i = 0; i < prefix; ++i)
+				{
+					bytes[ 1 + i] = (unsigned char)( high >> ( 8 * i));
+				}
+			}
+			out.write( bytes, 1 + prefix);
+
+			for( size_t k = 0; k < used && width; ++k)
+			{
+				const _Word middle = bits( keys[ k]) >> ( 8 * suffix);
+				for( unsigned i = 0; i < width; ++i)
+				{
+					bytes[ i] = (unsigned char)( middle >> ( 8 * i));
+				}
+				out.write( bytes, width);
+			}
+		}
+
+		/// Returns false on a corrupt block header
+		template <typename _Stream>
+		static bool read( _Stream& input, _Key* const keys, const size_t used)
+		{
+			if ( !used)
+			{
+				return true;
+			}
+			unsigned char bytes[ read_chunk * key_size];
+			input.read( bytes, 1);
+			const unsigned prefix = bytes[ 0] >> 4, suffix = bytes[ 0] & 0xf;
+			if ( prefix + suffix > key_size)
+			{
+				return false;
+			}
+			const unsigned width = key_size - prefix - suffix;
+
+			_Word base = 0;
+			if ( prefix)
+			{
+				input.read( bytes, prefix);
+				for( unsigned i = prefix; i--; )
+				{
+					base = base << 8 | bytes[ i];
+				}
+				base <<= 8 * ( key_size - prefix);
+			}
+
+			for( size_t k = 0; k < used; )
+			{
+				size_t n = used - k < size_t( read_chunk) ? used - k : size_t( read_chunk);
+				input.read( bytes, n * width);
+				for( const unsigned char* p = bytes; n--; p += width, ++k)
+				{
+					_Word middle = 0;
+					for( unsigned i = width; i--; )
+					{
+						middle = middle << 8 | p[ i];
+					}
+					keys[ k] = _Key( _Bits( width ? base | middle << ( 8 * suffix) : base));
+				}
+			}
+			return true;
+		}
+	};
+
+	/// Frame of reference codec of the bit packed compact files, for the keys and the integral
+	/// values of a node. Generic items are stored as they are.
+	template <typename _Item, bool integral = std::is_integral<_Item>::value && !std::is_same<_Item, bool>::value && sizeof( _Item) <= 8>
+	struct bp_tree_for_codec
+	{
+		static size_t size( const _Item* const items, const size_t used)
+		{
+			return sizeof( _Item) * used;
+		}
+
+		template <typename _Stream>
+		static void write( _Stream& out, const _Item* const items, const size_t used)
+		{
+			out.write( items, sizeof( _Item) * used);
+		}
+
+		template <typename _Stream>
+		static bool read( _Stream& input, _Item* const items, const size_t used)
+		{
+			input.read( items, sizeof( _Item) * used);
+			return true;
+		}
+	};
+
+	/// Integral items. A block holds the bit width of the deltas, their shift (the trailing
+	/// zero bits common to all of them), the base (the smallest item), then ( item - base) >> shift
+	/// of every item on that many bits, in 4 interleaved lanes of 32 bit words: item i goes to
+	/// lane i % 4, so a row of 4 items is unpacked with a few SSE2 operations. Blocks whose
+	/// deltas need more than 32 bits hold the items as they are, after a raw marker byte.
+	template <typename _Item>
+	struct bp_tree_for_codec<_Item, true>
+	{
+		typedef typename std::make_unsigned<_Item>::type	_Bits;
+		typedef unsigned long long							_Word;
+		typedef unsigned int								_Lane;
+
+		enum E
+		{
+			item_size	= sizeof( _Item),
+			lanes		= 4,
+			max_items	= 256,
+			max_words	= lanes * ( max_items / lanes + 1),
+			raw			= 0xff	//< width byte of a raw block
+		};
+
+		static _Word delta( const _Item item, const _Item base)
+		{
+			return _Word( _Bits( _Bits( item) - _Bits( base)));
+		}
+
+		static void layout( const _Item* const items, const size_t used, _Item& base, unsigned& shift, unsigned& width)
+		{
+			base = *std::min_element( items, items + used);
+			_Word any = 0;
+			for( size_t i = 0; i < used; ++i)
+			{
+				any |= delta( items[ i], base);
+			}
+
+			shift = 0;
+			if ( any)
+			{
+				for( ; !( ( any >> shift) & 1); ++shift);
+			}
+			width = 0;
+			for( any >>= shift; any; any >>= 1)
+			{
+				++width;
+			}
+		}
+
+		static bool is_raw( const size_t used, const unsigned width)
+		{
+			return width > 32 || used > max_items;
+		}
+
+		// 32 bit words per lane
+		static size_t lane_words( const size_t used, const unsigned width)
+		{
+			return ( ( used + lanes - 1) / lanes * width + 31) / 32;
+		}
+
+		static _Lane mask( const unsigned width)
+		{
+			return width == 32 ? ~_Lane( 0) : ( _Lane( 1) << width) - 1;
+		}
+
+		static size_t size( const _Item* const items, const size_t used)
+		{
+			if ( !used)
+			{
+				return 0;
+			}
+			_Item base;
+			unsigned shift, width;
+			layout( items, used, base, shift, width);
+			return is_raw( used, width) ? 1 + item_size * used : 2 + item_size + lanes * sizeof( _Lane) * lane_words( used, width);
+		}
+
+		template <typename _Stream>
+		static void write( _Stream& out, const _Item* const items, const size_t used)
+		{
+			if ( !used)
+			{
+				return;
+			}
+			_Item base;
+			unsigned shift, width;
+			layout( items, used, base, shift, width);
+			if ( is_raw( used, width))
+			{
+				const unsigned char marker = raw;
+				out.write( &marker, 1);
+				out.write( items, item_size * used);
+				return;
+			}
+
+			const unsigned char header[ 2] = { (unsigned char) width, (unsigned char) shift };
+			out.write( header, 2);
+			out.write( &base, item_size);
+
+			_Lane words[ max_words] = { 0 };
+			for( size_t i = 0; i < used && width; ++i)
+			{
+				const _Lane value = _Lane( delta( items[ i], base) >> shift);
+				const size_t bit = i / lanes * width, word = bit / 32 * lanes + i % lanes;
+				const unsigned offset = bit % 32;
+				words[ word] |= value << offset;
+				if ( offset + width > 32)
+				{
+					words[ word + lanes] |= value >> ( 32 - offset);
+				}
+			}
+			out.write( words, lanes * sizeof( _Lane) * lane_words( used, width));
+		}
+
+		/// Returns false on a corrupt block header
+		template <typename _Stream>
+		static bool read( _Stream& input, _Item* const items, const size_t used)
+		{
+			if ( !used)
+			{
+				return true;
+			}
+			unsigned char header[ 2] = { 0, 0 };
+			input.read( header, 1);
+			if ( header[ 0] == raw)
+			{
+				input.read( items, item_size * used);
+				return true;
+			}
+			input.read( header + 1, 1);
+			const unsigned width = header[ 0], shift = header[ 1];
+			if ( is_raw( used, width) || shift >= 8 * item_size)
+			{
+				return false;
+			}
+
+			_Item base;
+			input.read( &base, item_size);
+			_Lane words[ max_words + lanes];
+			input.read( words, lanes * sizeof( _Lane) * lane_words( used, width));
+			if ( !width)
+			{
+				std::fill( items, items + used, base);
+				return true;
+			}
+
+			size_t i = 0;
+		#ifdef BP_TREE_CODEC_SSE2
+			const __m128i m = _mm_set1_epi32( int( mask( width)));
+			for( ; i + lanes <= used; i += lanes)
+			{
+				const size_t bit = i / lanes * width;
+				const unsigned offset = bit % 32;
+				const __m128i* const p = (const __m128i*)( words + bit / 32 * lanes);
+				__m128i v = _mm_srl_epi32( _mm_loadu_si128( p), _mm_cvtsi32_si128( int( offset)));
+				if ( offset + width > 32)
+				{
+					v = _mm_or_si128( v, _mm_sll_epi32( _mm_loadu_si128( p + 1), _mm_cvtsi32_si128( int( 32 - offset))));
+				}
+				store( items + i, _mm_and_si128( v, m), base, shift, std::integral_constant<size_t, item_size>());
+			}
+		#endif
+			for( ; i < used; ++i)
+			{
+				const size_t bit = i / lanes * width, word = bit / 32 * lanes + i % lanes;
+				const unsigned offset = bit % 32;
+				_Lane value = words[ word] >> offset;
+				if ( offset + width > 32)
+				{
+					value |= words[ word + lanes] << ( 32 - offset);
+				}
+				items[ i] = _Item( _Bits( _Bits( base) + _Bits( _Word( value & mask( width)) << shift)));
+			}
+			return true;
+		}
+
+	#ifdef BP_TREE_CODEC_SSE2
+		// a row of 4 unpacked deltas to items
+		static void store( _Item* const items, const __m128i v, const _Item base, const unsigned shift, std::integral_constant<size_t, 4>)
+		{
+			const __m128i deltas = _mm_sll_epi32( v, _mm_cvtsi32_si128( int( shift)));
+			_mm_storeu_si128( (__m128i*) items, _mm_add_epi32( deltas, _mm_set1_epi32( int( base))));
+		}
+
+		static void store( _Item* const items, const __m128i v, const _Item base, const unsigned shift, std::integral_constant<size_t, 8>)
+		{
+			const __m128i zero = _mm_setzero_si128(), s = _mm_cvtsi32_si128( int( shift));
+			const __m128i b = _mm_set1_epi64x( (long long) base);
+			_mm_storeu_si128( (__m128i*) items, _mm_add_epi64( _mm_sll_epi64( _mm_unpacklo_epi32( v, zero), s), b));
+			_mm_storeu_si128( (__m128i*) items + 1, _mm_add_epi64( _mm_sll_epi64( _mm_unpackhi_epi32( v, zero), s), b));
+		}
+
+		template <typename _Size>
+		static void store( _Item* const items, const __m128i v, const _Item base, const unsigned shift, _Size)
+		{
+			_Lane values[ lanes];
+			_mm_storeu_si128( (__m128i*) values, v);
+			for( size_t i = 0; i < lanes; ++i)
+			{
+				items[ i] = _Item( _Bits( _Bits( base) + _Bits( _Word( values[ i]) << shift)));
+			}
+		}
+	#endif
+	};
+}
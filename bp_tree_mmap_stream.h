@@ -0,0 +1,530 @@
+﻿#pragma once
+/// B+ Tree memory mapped stream
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+#ifndef PCH
+	#include <cstring>
+	#include <cstddef>
+	#include "bp_tree_codec.h"
+	#ifdef _WIN32
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#include <windows.h>
+	#else
+		#include <sys/mman.h>
+		#include <sys/stat.h>
+		#include <fcntl.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+namespace stdext
+{
+	/// Stream over a memory mapped file, usable as the _Stream parameter of bp_tree.
+	/// Nodes are copied straight from the mapped pages; the mapping grows (by doubling)
+	/// when a write goes past its end and the file is truncated to the written size on close.
+	/// Other views of the same file (see the shared constructor) read it, or write their own
+	/// parts of it, concurrently.
+	template <typename _Key, typename _Val, typename _Bitmap>
+	class bp_tree_mmap_stream
+	{
+		bp_tree_mmap_stream( const bp_tree_mmap_stream&);
+		bp_tree_mmap_stream& operator = ( const bp_tree_mmap_stream&);
+
+	public:
+		typedef _Key	key_type;
+		typedef _Val	value_type;
+		typedef size_t	offset_type;
+		typedef _Bitmap bitmap_type;
+
+		enum E
+		{
+			key_storage_size	= sizeof( _Key),
+			value_storage_size	= sizeof( _Val),
+			prefetches			= 1,		//< prefetch hints the OS, see bp_tree_default_stream
+			durable				= 1,		//< sync reaches the disk, the write-ahead log may be truncated
+			min_map_size		= 1 << 20
+		};
+
+		/// Tag of the constructor sharing the file of another stream
+		struct shared {};
+
+	protected:
+	#ifdef _WIN32
+		HANDLE	file_;
+		HANDLE	mapping_;
+	#else
+		int		fd_;
+	#endif
+		char*	base_;		//< mapped view
+		size_t	mapped_;	//< size of the mapped view
+		size_t	end_;		//< logical end of file (highest byte written or existing size)
+		size_t	pos_;		//< current position
+		bool	compact_;
+		bool	packed_;	//< key blocks are encoded by bp_tree_key_codec
+		bool	bit_packed_;//< key and value blocks are encoded by bp_tree_for_codec
+		bool	read_only_;
+		bool	owner_;		//< sizes and closes the file
+		bool	ok_;
+
+		bool file_size( size_t& size) const
+		{
+		#ifdef _WIN32
+			LARGE_INTEGER n;
+			if ( !GetFileSizeEx( file_, &n))
+			{
+				return false;
+			}
+			size = size_t( n.QuadPart);
+		#else
+			struct stat st;
+			if ( fstat( fd_, &st))
+			{
+				return false;
+			}
+			size = size_t( st.st_size);
+		#endif
+			return true;
+		}
+
+		void unmap()
+		{
+			if ( base_)
+			{
+			#ifdef _WIN32
+				UnmapViewOfFile( base_);
+				CloseHandle( mapping_);
+				mapping_ = 0;
+			#else
+				munmap( base_, mapped_);
+			#endif
+				base_ = 0;
+			}
+			mapped_ = 0;
+		}
+
+		bool map( const size_t size)
+		{
+			unmap();
+			if ( !size)
+			{
+				return true;
+			}
+		#ifdef _WIN32
+			const DWORD protect = read_only_ ? PAGE_READONLY : PAGE_READWRITE;
+			mapping_ = CreateFileMappingA( file_, 0, protect, DWORD( (unsigned long long) size >> 32), DWORD( size), 0);
+			if ( mapping_)
+			{
+				base_ = (char*) MapViewOfFile( mapping_, read_only_ ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, size);
+				if ( !base_)
+				{
+					CloseHandle( mapping_);
+					mapping_ = 0;
+				}
+			}
+		#else
+			if ( !read_only_ && owner_ && ftruncate( fd_, size))
+			{
+				return false;
+			}
+			void* const p = mmap( 0, size, read_only_ ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+			base_ = p == MAP_FAILED ? 0 : (char*) p;
+		#endif
+			mapped_ = base_ ? size : 0;
+			return base_ != 0;
+		}
+
+		// a view maps the file as far as its owner has extended it, up to need at least
+		bool follow( const size_t need)
+		{
+			size_t size;
+			if ( owner_ || !file_size( size) || need > size || ( size > mapped_ && !map( size)))
+			{
+				return false;
+			}
+			end_ = size;
+			return true;
+		}
+
+		// makes sure [pos_, pos_ + bytes) is mapped
+		bool grow( const size_t bytes)
+		{
+			const size_t need = pos_ + bytes;
+			if ( need <= mapped_)
+			{
+				return true;
+			}
+			if ( !owner_)
+			{
+				return follow( need);
+			}
+			if ( read_only_)
+			{
+				return false;
+			}
+			size_t size = mapped_ ? mapped_ : min_map_size;
+			while( size < need)
+			{
+				size *= 2;
+			}
+			return map( size);
+		}
+
+		void skip_keys( const size_t count)
+		{
+			skip( sizeof( key_type) * count);
+		}
+
+		void skip_data( const size_t count)
+		{
+			skip( sizeof( value_type) * count);
+		}
+
+	public:
+		bp_tree_mmap_stream( const char* const file_name, const bool create = false, const bool read_only = false):
+		#ifdef _WIN32
+			file_( INVALID_HANDLE_VALUE),
+			mapping_( 0),
+		#else
+			fd_( -1),
+		#endif
+			base_( 0),
+			mapped_( 0),
+			end_( 0),
+			pos_( 0),
+			compact_( false),
+			packed_( false),
+			bit_packed_( false),
+			read_only_( read_only && !create),
+			owner_( true),
+			ok_( false)
+		{
+		#ifdef _WIN32
+			file_ = CreateFileA( file_name, read_only_ ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+				create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, 0);
+		#else
+			fd_ = ::open( file_name, ( read_only_ ? O_RDONLY : O_RDWR) | ( create ? O_CREAT | O_TRUNC : 0), 0644);
+		#endif
+			ok_ = is_open() && file_size( end_);
+			if ( ok_ && end_)
+			{
+				ok_ = map( read_only_ ? end_ : end_ < min_map_size ? size_t( min_map_size) : end_);
+			}
+		}
+
+		/// Another view of the file of owner, with its own mapping and position, for a concurrent
+		/// reader or, with writable, a writer of its own part of the file (the parallel
+		/// bp_tree::compact_to's workers, for instance). It follows the file as owner extends it
+		/// but never resizes or closes it: owner keeps the size it gives the file on close.
+		bp_tree_mmap_stream( const bp_tree_mmap_stream& owner, shared, const bool writable = false):
+		#ifdef _WIN32
+			file_( owner.file_),
+			mapping_( 0),
+		#else
+			fd_( owner.fd_),
+		#endif
+			base_( 0),
+			mapped_( 0),
+			end_( 0),
+			pos_( 0),
+			compact_( false),
+			packed_( false),
+			bit_packed_( false),
+			read_only_( !writable || owner.read_only_),
+			owner_( false),
+			ok_( false)
+		{
+			ok_ = is_open() && file_size( end_) && ( !end_ || map( end_));
+		}
+
+		~bp_tree_mmap_stream()
+		{
+			close();
+		}
+
+		/// Unmaps the file and truncates it to the logical end; a view only unmaps it
+		void close()
+		{
+			unmap();
+		#ifdef _WIN32
+			if ( file_ != INVALID_HANDLE_VALUE && owner_)
+			{
+				if ( !read_only_)
+				{
+					LARGE_INTEGER size;
+					size.QuadPart = end_;
+					SetFilePointerEx( file_, size, 0, FILE_BEGIN);
+					SetEndOfFile( file_);
+				}
+				CloseHandle( file_);
+			}
+			file_ = INVALID_HANDLE_VALUE;
+		#else
+			if ( fd_ >= 0 && owner_)
+			{
+				if ( !read_only_)
+				{
+					ftruncate( fd_, end_);
+				}
+				::close( fd_);
+			}
+			fd_ = -1;
+		#endif
+		}
+
+		bool is_open() const
+		{
+		#ifdef _WIN32
+			return file_ != INVALID_HANDLE_VALUE;
+		#else
+			return fd_ >= 0;
+		#endif
+		}
+
+		/// Logical size of the file, to be passed as bp_tree::open's end_off
+		size_t size() const
+		{
+			return end_;
+		}
+
+		/// Flushes the mapped pages to disk
+		bool sync()
+		{
+			if ( !base_)
+			{
+				return true;
+			}
+		#ifdef _WIN32
+			return FlushViewOfFile( base_, end_) && FlushFileBuffers( file_);
+		#else
+			return !msync( base_, end_, MS_SYNC);
+		#endif
+		}
+
+		/// Asks the OS to read [offset, offset + bytes) into the page cache in the background
+		void prefetch( const offset_type offset, const size_t bytes) const
+		{
+			if ( !base_ || offset >= mapped_)
+			{
+				return;
+			}
+			const size_t end = offset + bytes < mapped_ ? offset + bytes : mapped_;
+		#ifdef _WIN32
+			#if _WIN32_WINNT >= 0x0602
+				WIN32_MEMORY_RANGE_ENTRY range = { base_ + offset, end - offset };
+				PrefetchVirtualMemory( GetCurrentProcess(), 1, &range, 0);
+			#endif
+		#else
+			static const size_t page = size_t( sysconf( _SC_PAGESIZE));
+			const size_t begin = offset & ~( page - 1);
+			madvise( base_ + begin, end - begin, MADV_WILLNEED);
+		#endif
+		}
+
+		bool is_compact() const
+		{
+			return compact_;
+		}
+
+		void set_compact( const bool value)
+		{
+			compact_ = value;
+		}
+
+		bool is_packed() const
+		{
+			return packed_;
+		}
+
+		/// Packed key blocks, compact files only
+		void set_packed( const bool value)
+		{
+			packed_ = value;
+		}
+
+		bool is_bit_packed() const
+		{
+			return bit_packed_;
+		}
+
+		/// Bit packed keys and values, compact files only; takes over from set_packed
+		void set_bit_packed( const bool value)
+		{
+			bit_packed_ = value;
+		}
+
+		/// Bytes taken by a key block of a compact file
+		size_t packed_keys_size( const key_type* const keys, const size_t used) const
+		{
+			if ( bit_packed_)
+			{
+				return bp_tree_for_codec<key_type>::size( keys, used);
+			}
+			return packed_ ? bp_tree_key_codec<key_type>::size( keys, used) : sizeof( key_type) * used;
+		}
+
+		/// Bytes taken by a value block of a compact file
+		size_t packed_data_size( const value_type* const data, const size_t used) const
+		{
+			return bit_packed_ ? bp_tree_for_codec<value_type>::size( data, used) : sizeof( value_type) * used;
+		}
+
+		void read( void* data, const size_t bytes)
+		{
+			if ( ok_ && ( pos_ + bytes <= end_ || follow( pos_ + bytes)))
+			{
+				memcpy( data, base_ + pos_, bytes);
+				pos_ += bytes;
+			}
+			else
+			{
+				ok_ = false;
+			}
+		}
+
+		void write( const void* data, const size_t bytes)
+		{
+			if ( ok_ && grow( bytes))
+			{
+				memcpy( base_ + pos_, data, bytes);
+				pos_ += bytes;
+				if ( pos_ > end_)
+				{
+					end_ = pos_;
+				}
+			}
+			else
+			{
+				ok_ = false;
+			}
+		}
+
+		void read_keys( key_type* const keys, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				if ( !bp_tree_for_codec<key_type>::read( *this, keys, used))
+				{
+					ok_ = false;
+				}
+			}
+			else if ( packed_)
+			{
+				if ( !bp_tree_key_codec<key_type>::read( *this, keys, used))
+				{
+					ok_ = false;
+				}
+			}
+			else
+			{
+				read( keys, sizeof( key_type) * used);
+				if ( !compact_)
+				{
+					skip_keys( count - used);
+				}
+			}
+		}
+
+		void write_keys( const key_type* const keys, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				bp_tree_for_codec<key_type>::write( *this, keys, used);
+			}
+			else if ( packed_)
+			{
+				bp_tree_key_codec<key_type>::write( *this, keys, used);
+			}
+			else
+			{
+				write( keys, sizeof( key_type) * used);
+				if ( !compact_)
+				{
+					skip_keys( count - used);
+				}
+			}
+		}
+
+		void read_offsets( offset_type* const items, const size_t used)
+		{
+			read( items, sizeof( offset_type) * used);
+		}
+
+		void read_offsets( offset_type* const items, const size_t used, const size_t count)
+		{
+			read( items, sizeof( offset_type) * used);
+			if ( !compact_)
+			{
+				skip( sizeof( offset_type) * ( count - used));
+			}
+		}
+
+		void read_data( value_type* const data, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				if ( !bp_tree_for_codec<value_type>::read( *this, data, used))
+				{
+					ok_ = false;
+				}
+			}
+			else
+			{
+				read( data, sizeof( value_type) * used);
+				if ( !compact_)
+				{
+					skip_data( count - used);
+				}
+			}
+		}
+
+		void write_data( const value_type* const data, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				bp_tree_for_codec<value_type>::write( *this, data, used);
+			}
+			else
+			{
+				write( data, sizeof( value_type) * used);
+				if ( !compact_)
+				{
+					skip_data( count - used);
+				}
+			}
+		}
+
+		void seek( const size_t pos)
+		{
+			pos_ = pos;
+		}
+
+		size_t position() const
+		{
+			return pos_;
+		}
+
+		// skipped bytes past the end are zero filled by the mapping, so the end advances too
+		void skip( const size_t bytes)
+		{
+			if ( !read_only_ && pos_ + bytes > end_)
+			{
+				if ( grow( bytes))
+				{
+					end_ = pos_ + bytes;
+				}
+				else
+				{
+					ok_ = false;
+				}
+			}
+			pos_ += bytes;
+		}
+
+		bool ok() const
+		{
+			return ok_;
+		}
+	};
+}
@@ -0,0 +1,189 @@
+﻿#pragma once
+/// B+ Tree node pool
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+#ifndef PCH
+	#include <cstddef>
+	#include <atomic>
+	#ifdef _WIN32
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#include <windows.h>
+	#else
+		#include <sys/mman.h>
+	#endif
+#endif
+
+namespace stdext
+{
+	/// Fixed size slab of raw slots for objects of type T, reserved once and never grown.
+	/// Slots are rounded up to whole cache lines and start on a cache line. The free slots are
+	/// kept in a lock-free stack of slot numbers, tagged against ABA, so allocate and deallocate
+	/// are O(1) and safe from any thread. allocate returns 0 once the slab is exhausted, the
+	/// caller falls back to its own allocator.
+	template <typename T>
+	class bp_tree_node_pool
+	{
+		bp_tree_node_pool( const bp_tree_node_pool&);
+		bp_tree_node_pool& operator = ( const bp_tree_node_pool&);
+
+	public:
+		enum E
+		{
+			line_size	= 64,
+			slot_size	= ( sizeof( T) + line_size - 1) / line_size * line_size,
+			huge_size	= 2 << 20	// huge pages are asked for in multiples of this
+		};
+
+	protected:
+		typedef std::atomic<unsigned>			_Link;
+		typedef std::atomic<unsigned long long>	_Head;
+
+		char*		base_;
+		size_t		capacity_;	//< slots
+		size_t		bytes_;		//< mapped
+		_Link*		next_;		//< next free slot + 1 of each free slot, 0 ends the stack
+		_Head		free_;		//< ( tag << 32) | ( first free slot + 1)
+
+		static char* map( const size_t bytes, const bool huge_pages)
+		{
+			void* p = 0;
+		#ifdef _WIN32
+			const SIZE_T large = huge_pages ? GetLargePageMinimum() : 0;
+			if ( large && bytes % large == 0)
+			{
+				p = VirtualAlloc( 0, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			}
+			if ( !p)
+			{
+				p = VirtualAlloc( 0, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			}
+		#else
+			#ifdef MAP_HUGETLB
+			if ( huge_pages)
+			{
+				p = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				p = p != MAP_FAILED ? p : 0;
+			}
+			#endif
+			if ( !p)
+			{
+				p = mmap( 0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				p = p != MAP_FAILED ? p : 0;
+				#ifdef MADV_HUGEPAGE
+				if ( p && huge_pages)
+				{
+					madvise( p, bytes, MADV_HUGEPAGE); // transparent huge pages, a hint only
+				}
+				#endif
+			}
+		#endif
+			return static_cast<char*>( p);
+		}
+
+		static void unmap( char* const base, const size_t bytes)
+		{
+		#ifdef _WIN32
+			VirtualFree( base, 0, MEM_RELEASE);
+		#else
+			munmap( base, bytes);
+		#endif
+		}
+
+	public:
+		bp_tree_node_pool(): base_( 0), capacity_( 0), bytes_( 0), next_( 0), free_( 0) {}
+
+		~bp_tree_node_pool()
+		{
+			release();
+		}
+
+		/// Maps room for count objects, dropping the previous slab (whose slots must all be free)
+		bool reserve( const size_t count, const bool huge_pages = false)
+		{
+			release();
+			if ( !count || count >= 0xffffffffU)
+			{
+				return false;
+			}
+
+			size_t bytes = count * slot_size;
+			if ( huge_pages)
+			{
+				bytes = ( bytes + huge_size - 1) / huge_size * huge_size;
+			}
+
+			base_ = map( bytes, huge_pages);
+			if ( !base_)
+			{
+				return false;
+			}
+
+			bytes_ = bytes;
+			capacity_ = bytes / slot_size;
+			next_ = new _Link[ capacity_];
+			for( size_t i = 0; i < capacity_; ++i)
+			{
+				next_[ i].store( unsigned( i + 2 <= capacity_ ? i + 2 : 0), std::memory_order_relaxed);
+			}
+			free_.store( 1, std::memory_order_release);
+			return true;
+		}
+
+		void release()
+		{
+			if ( base_)
+			{
+				unmap( base_, bytes_);
+				delete [] next_;
+				base_ = 0;
+				next_ = 0;
+				capacity_ = bytes_ = 0;
+				free_.store( 0, std::memory_order_relaxed);
+			}
+		}
+
+		size_t capacity() const
+		{
+			return capacity_;
+		}
+
+		bool owns( const void* const p) const
+		{
+			return p >= base_ && p < base_ + capacity_ * slot_size;
+		}
+
+		/// Raw memory for one object, 0 when every slot is taken
+		T* allocate()
+		{
+			unsigned long long head = free_.load( std::memory_order_acquire);
+			for( ;;)
+			{
+				const unsigned slot = unsigned( head);
+				if ( !slot)
+				{
+					return 0;
+				}
+
+				const unsigned long long next = ( ( head >> 32) + 1) << 32 | next_[ slot - 1].load( std::memory_order_relaxed);
+				if ( free_.compare_exchange_weak( head, next, std::memory_order_acquire, std::memory_order_acquire))
+				{
+					return reinterpret_cast<T*>( base_ + ( slot - 1) * size_t( slot_size));
+				}
+			}
+		}
+
+		/// Gives back the memory of an object allocated here (and already destroyed)
+		void deallocate( T* const p)
+		{
+			const unsigned slot = unsigned( ( reinterpret_cast<char*>( p) - base_) / slot_size) + 1;
+			unsigned long long head = free_.load( std::memory_order_relaxed);
+			do
+			{
+				next_[ slot - 1].store( unsigned( head), std::memory_order_relaxed);
+			}
+			while( !free_.compare_exchange_weak( head, ( ( head >> 32) + 1) << 32 | slot, std::memory_order_release, std::memory_order_relaxed));
+		}
+	};
+}
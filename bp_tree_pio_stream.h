@@ -0,0 +1,614 @@
+﻿#pragma once
+/// B+ Tree positional I/O stream
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+#ifndef PCH
+	#include <cstring>
+	#include <cstddef>
+	#include <cstdlib>
+	#include "bp_tree_codec.h"
+	#ifdef _WIN32
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#include <windows.h>
+		#include <malloc.h>
+	#else
+		#include <sys/stat.h>
+		#include <fcntl.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+namespace stdext
+{
+	/// Stream over a file descriptor read and written at explicit offsets (pread / pwrite),
+	/// usable as the _Stream parameter of bp_tree. There is no shared file position: the stream
+	/// keeps its own, and other views of the same file (see the shared constructor) read it,
+	/// or write their own parts of it, concurrently. Bytes go through one aligned buffer of
+	/// whole blocks around the position, loaded block by block as a node is read and written
+	/// back (only the changed bytes) before the buffer moves elsewhere, so a node costs one or
+	/// two system calls.
+	/// With direct I/O (O_DIRECT, F_NOCACHE, FILE_FLAG_NO_BUFFERING) the OS page cache is
+	/// bypassed and the nodes are cached once, by the tree; the file is opened normally where
+	/// the file system refuses it (see is_direct).
+	template <typename _Key, typename _Val, typename _Bitmap>
+	class bp_tree_pio_stream
+	{
+		bp_tree_pio_stream( const bp_tree_pio_stream&);
+		bp_tree_pio_stream& operator = ( const bp_tree_pio_stream&);
+
+	public:
+		typedef _Key	key_type;
+		typedef _Val	value_type;
+		typedef size_t	offset_type;
+		typedef _Bitmap bitmap_type;
+
+		enum E
+		{
+			key_storage_size	= sizeof( _Key),
+			value_storage_size	= sizeof( _Val),
+			prefetches			= 1,		//< prefetch hints the OS, see bp_tree_default_stream
+			durable				= 1,		//< sync reaches the disk, the write-ahead log may be truncated
+			block_size			= 4096,		//< alignment of the direct transfers and of the buffer
+			default_buffer_size	= 64 << 10
+		};
+
+		/// Tag of the constructor sharing the file of another stream
+		struct shared {};
+
+	protected:
+	#ifdef _WIN32
+		HANDLE	file_;
+	#else
+		int		fd_;
+	#endif
+		char*	buf_;		//< block aligned buffer
+		size_t	capacity_;	//< bytes of buf_, whole blocks
+		size_t	base_;		//< file offset of buf_, block aligned
+		size_t	valid_;		//< loaded bytes of buf_, whole blocks
+		size_t	dirty_lo_;	//< changed bytes of buf_, empty when dirty_lo_ >= dirty_hi_
+		size_t	dirty_hi_;
+		size_t	end_;		//< logical end of file (highest byte written or existing size)
+		size_t	pos_;		//< current position
+		bool	owner_;		//< sizes and closes the file
+		bool	direct_;
+		bool	compact_;
+		bool	packed_;	//< key blocks are encoded by bp_tree_key_codec
+		bool	bit_packed_;//< key and value blocks are encoded by bp_tree_for_codec
+		bool	read_only_;
+		bool	ok_;
+
+		bool file_size( size_t& size) const
+		{
+		#ifdef _WIN32
+			LARGE_INTEGER n;
+			if ( !GetFileSizeEx( file_, &n))
+			{
+				return false;
+			}
+			size = size_t( n.QuadPart);
+		#else
+			struct stat st;
+			if ( fstat( fd_, &st))
+			{
+				return false;
+			}
+			size = size_t( st.st_size);
+		#endif
+			return true;
+		}
+
+		static size_t align_down( const size_t n)	{ return n / block_size * block_size; }
+		static size_t align_up( const size_t n)		{ return ( n + block_size - 1) / block_size * block_size; }
+
+		bool allocate( const size_t buffer_size)
+		{
+			capacity_ = align_up( buffer_size > size_t( block_size) ? buffer_size : size_t( block_size));
+		#ifdef _WIN32
+			buf_ = (char*) _aligned_malloc( capacity_, block_size);
+		#else
+			void* p;
+			buf_ = posix_memalign( &p, block_size, capacity_) ? 0 : (char*) p;
+		#endif
+			return buf_ != 0;
+		}
+
+		// bytes read at offset, short at the end of the file; -1 on errors
+		long long pread_( void* const data, const size_t bytes, const size_t offset) const
+		{
+		#ifdef _WIN32
+			OVERLAPPED at = {};
+			at.Offset = DWORD( offset);
+			at.OffsetHigh = DWORD( (unsigned long long) offset >> 32);
+			DWORD done = 0;
+			if ( !ReadFile( file_, data, DWORD( bytes), &done, &at))
+			{
+				return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+			}
+			return done;
+		#else
+			size_t done = 0;
+			while( done < bytes)
+			{
+				const ssize_t n = ::pread( fd_, (char*) data + done, bytes - done, off_t( offset + done));
+				if ( n <= 0)
+				{
+					return n < 0 ? -1 : (long long) done;
+				}
+				done += size_t( n);
+			}
+			return (long long) done;
+		#endif
+		}
+
+		bool pwrite_( const void* const data, const size_t bytes, const size_t offset) const
+		{
+		#ifdef _WIN32
+			OVERLAPPED at = {};
+			at.Offset = DWORD( offset);
+			at.OffsetHigh = DWORD( (unsigned long long) offset >> 32);
+			DWORD done = 0;
+			return WriteFile( file_, data, DWORD( bytes), &done, &at) && done == bytes;
+		#else
+			size_t done = 0;
+			while( done < bytes)
+			{
+				const ssize_t n = ::pwrite( fd_, (const char*) data + done, bytes - done, off_t( offset + done));
+				if ( n <= 0)
+				{
+					return false;
+				}
+				done += size_t( n);
+			}
+			return true;
+		#endif
+		}
+
+		// loads the blocks of buf_ up to upto (block aligned); past the end of the file they are zero
+		bool load( const size_t upto)
+		{
+			const long long n = pread_( buf_ + valid_, upto - valid_, base_ + valid_);
+			if ( n < 0)
+			{
+				return false;
+			}
+			memset( buf_ + valid_ + size_t( n), 0, upto - valid_ - size_t( n));
+			valid_ = upto;
+			return true;
+		}
+
+		// writes the changed bytes of buf_ back, the blocks holding them with direct I/O; views
+		// writing next to each other thus keep out of each other's bytes when not direct
+		bool flush()
+		{
+			if ( dirty_lo_ < dirty_hi_)
+			{
+				const size_t lo = direct_ ? align_down( dirty_lo_) : dirty_lo_;
+				const size_t hi = direct_ ? align_up( dirty_hi_) : dirty_hi_;
+				if ( !pwrite_( buf_ + lo, hi - lo, base_ + lo))
+				{
+					return false;
+				}
+				dirty_lo_ = capacity_;
+				dirty_hi_ = 0;
+			}
+			return true;
+		}
+
+		// makes buf_ hold the bytes from the position on and returns how many it holds, up to bytes
+		size_t window( const size_t bytes)
+		{
+			if ( !ok_ || !buf_)
+			{
+				return 0;
+			}
+			if ( pos_ < base_ || pos_ >= base_ + capacity_)
+			{
+				if ( !flush())
+				{
+					return 0;
+				}
+				base_ = align_down( pos_);
+				valid_ = 0;
+			}
+
+			const size_t offset = pos_ - base_;
+			const size_t want = offset + bytes < capacity_ ? offset + bytes : capacity_;
+			if ( want > valid_ && !load( align_up( want)))
+			{
+				return 0;
+			}
+			return want - offset;
+		}
+
+		void skip_keys( const size_t count)
+		{
+			skip( sizeof( key_type) * count);
+		}
+
+		void skip_data( const size_t count)
+		{
+			skip( sizeof( value_type) * count);
+		}
+
+		void init( const bool own, const bool direct)
+		{
+			buf_ = 0;
+			capacity_ = base_ = valid_ = dirty_hi_ = end_ = pos_ = 0;
+			dirty_lo_ = 1;
+			owner_ = own;
+			direct_ = direct;
+			compact_ = packed_ = bit_packed_ = false;
+			ok_ = false;
+		}
+
+	public:
+		bp_tree_pio_stream( const char* const file_name, const bool create = false, const bool read_only = false,
+			const bool direct = false, const size_t buffer_size = default_buffer_size)
+		{
+			init( true, direct);
+			read_only_ = read_only && !create;
+		#ifdef _WIN32
+			const DWORD access = read_only_ ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+			const DWORD disposition = create ? CREATE_ALWAYS : OPEN_EXISTING;
+			file_ = INVALID_HANDLE_VALUE;
+			if ( direct_)
+			{
+				file_ = CreateFileA( file_name, access, FILE_SHARE_READ, 0, disposition,
+					FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, 0);
+			}
+			if ( file_ == INVALID_HANDLE_VALUE)
+			{
+				direct_ = false;
+				file_ = CreateFileA( file_name, access, FILE_SHARE_READ, 0, disposition, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, 0);
+			}
+		#else
+			const int flags = ( read_only_ ? O_RDONLY : O_RDWR) | ( create ? O_CREAT | O_TRUNC : 0);
+			fd_ = -1;
+			#ifdef O_DIRECT
+			if ( direct_)
+			{
+				fd_ = ::open( file_name, flags | O_DIRECT, 0644);
+			}
+			#endif
+			if ( fd_ < 0)
+			{
+				fd_ = ::open( file_name, flags, 0644);
+				#ifdef F_NOCACHE
+				direct_ = direct_ && fd_ >= 0 && fcntl( fd_, F_NOCACHE, 1) != -1;
+				#else
+				direct_ = false;
+				#endif
+			}
+		#endif
+			ok_ = is_open() && file_size( end_) && allocate( buffer_size);
+		}
+
+		/// Another view of the file of owner, with its own position and buffer, for a concurrent
+		/// reader (verify's streams, for instance) or, with writable, a writer of its own part of
+		/// the file (the parallel bp_tree::compact_to's workers). It sees what owner has written
+		/// back (sync) but never resizes or closes the file: owner keeps the size it gives the
+		/// file on close. The blocks of direct I/O cannot be shared by writers, so a view of a
+		/// direct owner is read only.
+		bp_tree_pio_stream( const bp_tree_pio_stream& owner, shared, const bool writable = false, const size_t buffer_size = default_buffer_size)
+		{
+			init( false, owner.direct_);
+		#ifdef _WIN32
+			file_ = owner.file_;
+		#else
+			fd_ = owner.fd_;
+		#endif
+			read_only_ = !writable || owner.read_only_ || direct_;
+			ok_ = owner.is_open() && file_size( end_) && allocate( buffer_size);
+		}
+
+		~bp_tree_pio_stream()
+		{
+			close();
+		}
+
+		/// Writes the buffer back and truncates the file to the logical end
+		void close()
+		{
+			if ( is_open() && !read_only_)
+			{
+				flush();
+			}
+		#ifdef _WIN32
+			_aligned_free( buf_);
+			if ( file_ != INVALID_HANDLE_VALUE && owner_)
+			{
+				if ( !read_only_)
+				{
+					LARGE_INTEGER size;
+					size.QuadPart = end_;
+					SetFilePointerEx( file_, size, 0, FILE_BEGIN);
+					SetEndOfFile( file_);
+				}
+				CloseHandle( file_);
+			}
+			file_ = INVALID_HANDLE_VALUE;
+		#else
+			free( buf_);
+			if ( fd_ >= 0 && owner_)
+			{
+				if ( !read_only_)
+				{
+					ftruncate( fd_, off_t( end_));
+				}
+				::close( fd_);
+			}
+			fd_ = -1;
+		#endif
+			buf_ = 0;
+		}
+
+		bool is_open() const
+		{
+		#ifdef _WIN32
+			return file_ != INVALID_HANDLE_VALUE;
+		#else
+			return fd_ >= 0;
+		#endif
+		}
+
+		/// True when the OS page cache is bypassed
+		bool is_direct() const
+		{
+			return direct_;
+		}
+
+		/// Logical size of the file, to be passed as bp_tree::open's end_off
+		size_t size() const
+		{
+			return end_;
+		}
+
+		/// Writes the buffer back and flushes the file to disk
+		bool sync()
+		{
+			if ( !flush())
+			{
+				return false;
+			}
+		#ifdef _WIN32
+			return read_only_ || FlushFileBuffers( file_) != 0;
+		#else
+			return read_only_ || !fsync( fd_);
+		#endif
+		}
+
+		/// Asks the OS to read [offset, offset + bytes) into the page cache in the background;
+		/// there is no page cache to fill with direct I/O
+		void prefetch( const offset_type offset, const size_t bytes) const
+		{
+		#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+			if ( !direct_ && offset < end_)
+			{
+				posix_fadvise( fd_, off_t( offset), off_t( bytes), POSIX_FADV_WILLNEED);
+			}
+		#endif
+		}
+
+		bool is_compact() const
+		{
+			return compact_;
+		}
+
+		void set_compact( const bool value)
+		{
+			compact_ = value;
+		}
+
+		bool is_packed() const
+		{
+			return packed_;
+		}
+
+		/// Packed key blocks, compact files only
+		void set_packed( const bool value)
+		{
+			packed_ = value;
+		}
+
+		bool is_bit_packed() const
+		{
+			return bit_packed_;
+		}
+
+		/// Bit packed keys and values, compact files only; takes over from set_packed
+		void set_bit_packed( const bool value)
+		{
+			bit_packed_ = value;
+		}
+
+		/// Bytes taken by a key block of a compact file
+		size_t packed_keys_size( const key_type* const keys, const size_t used) const
+		{
+			if ( bit_packed_)
+			{
+				return bp_tree_for_codec<key_type>::size( keys, used);
+			}
+			return packed_ ? bp_tree_key_codec<key_type>::size( keys, used) : sizeof( key_type) * used;
+		}
+
+		/// Bytes taken by a value block of a compact file
+		size_t packed_data_size( const value_type* const data, const size_t used) const
+		{
+			return bit_packed_ ? bp_tree_for_codec<value_type>::size( data, used) : sizeof( value_type) * used;
+		}
+
+		void read( void* data, size_t bytes)
+		{
+			// a view reads as far as owner has written the file back
+			if ( pos_ + bytes > end_ && ( owner_ || !file_size( end_) || pos_ + bytes > end_))
+			{
+				ok_ = false;
+				return;
+			}
+			while( bytes)
+			{
+				const size_t n = window( bytes);
+				if ( !n)
+				{
+					ok_ = false;
+					return;
+				}
+				memcpy( data, buf_ + ( pos_ - base_), n);
+				data = (char*) data + n;
+				pos_ += n;
+				bytes -= n;
+			}
+		}
+
+		void write( const void* data, size_t bytes)
+		{
+			if ( read_only_)
+			{
+				ok_ = false;
+				return;
+			}
+			while( bytes)
+			{
+				const size_t n = window( bytes);
+				if ( !n)
+				{
+					ok_ = false;
+					return;
+				}
+				const size_t offset = pos_ - base_;
+				memcpy( buf_ + offset, data, n);
+				dirty_lo_ = offset < dirty_lo_ ? offset : dirty_lo_;
+				dirty_hi_ = offset + n > dirty_hi_ ? offset + n : dirty_hi_;
+				data = (const char*) data + n;
+				pos_ += n;
+				bytes -= n;
+				if ( pos_ > end_)
+				{
+					end_ = pos_;
+				}
+			}
+		}
+
+		void read_keys( key_type* const keys, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				if ( !bp_tree_for_codec<key_type>::read( *this, keys, used))
+				{
+					ok_ = false;
+				}
+			}
+			else if ( packed_)
+			{
+				if ( !bp_tree_key_codec<key_type>::read( *this, keys, used))
+				{
+					ok_ = false;
+				}
+			}
+			else
+			{
+				read( keys, sizeof( key_type) * used);
+				if ( !compact_)
+				{
+					skip_keys( count - used);
+				}
+			}
+		}
+
+		void write_keys( const key_type* const keys, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				bp_tree_for_codec<key_type>::write( *this, keys, used);
+			}
+			else if ( packed_)
+			{
+				bp_tree_key_codec<key_type>::write( *this, keys, used);
+			}
+			else
+			{
+				write( keys, sizeof( key_type) * used);
+				if ( !compact_)
+				{
+					skip_keys( count - used);
+				}
+			}
+		}
+
+		void read_offsets( offset_type* const items, const size_t used)
+		{
+			read( items, sizeof( offset_type) * used);
+		}
+
+		void read_offsets( offset_type* const items, const size_t used, const size_t count)
+		{
+			read( items, sizeof( offset_type) * used);
+			if ( !compact_)
+			{
+				skip( sizeof( offset_type) * ( count - used));
+			}
+		}
+
+		void read_data( value_type* const data, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				if ( !bp_tree_for_codec<value_type>::read( *this, data, used))
+				{
+					ok_ = false;
+				}
+			}
+			else
+			{
+				read( data, sizeof( value_type) * used);
+				if ( !compact_)
+				{
+					skip_data( count - used);
+				}
+			}
+		}
+
+		void write_data( const value_type* const data, const size_t used, const size_t count, const bitmap_type bmp)
+		{
+			if ( bit_packed_)
+			{
+				bp_tree_for_codec<value_type>::write( *this, data, used);
+			}
+			else
+			{
+				write( data, sizeof( value_type) * used);
+				if ( !compact_)
+				{
+					skip_data( count - used);
+				}
+			}
+		}
+
+		void seek( const size_t pos)
+		{
+			pos_ = pos;
+		}
+
+		size_t position() const
+		{
+			return pos_;
+		}
+
+		// skipped bytes past the end read as zeros, so the end advances too
+		void skip( const size_t bytes)
+		{
+			pos_ += bytes;
+			if ( !read_only_ && pos_ > end_)
+			{
+				end_ = pos_;
+			}
+		}
+
+		bool ok() const
+		{
+			return ok_;
+		}
+	};
+}
@@ -0,0 +1,223 @@
+﻿#pragma once
+/// B+ Tree instrumentation policies
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+#ifndef PCH
+	#include <cstddef>
+	#include <atomic>
+	#include <chrono>
+#endif
+
+namespace stdext
+{
+	/// Counters of a bp_tree at one moment, returned by bp_tree::statistics().
+	/// Levels count from the leaves (0) up; deeper trees add their upper levels to the last one.
+	/// Latency bucket i counts the operations that took [ 2^i, 2^(i+1)) nanoseconds.
+	struct bp_tree_stats_snapshot
+	{
+		enum E
+		{
+			max_levels		= 16,
+			latency_buckets	= 40
+		};
+
+		bool				enabled;
+		size_t				hits[ max_levels];		// nodes found in memory
+		size_t				misses[ max_levels];	// nodes read from the stream
+		size_t				splits[ max_levels];
+		size_t				clean_evictions;		// nodes dropped from the cache as they were
+		size_t				dirty_evictions;		// nodes written out as they left the cache
+		unsigned long long	bytes_read;
+		unsigned long long	bytes_written;
+		size_t				find_latency[ latency_buckets];
+		size_t				insert_latency[ latency_buckets];
+
+		size_t total_hits() const		{ return sum( hits); }
+		size_t total_misses() const		{ return sum( misses); }
+		size_t total_splits() const		{ return sum( splits); }
+
+		double hit_rate() const
+		{
+			const size_t refs = total_hits() + total_misses();
+			return refs ? double( total_hits()) / refs : 0;
+		}
+
+		double hit_rate( const size_t level) const
+		{
+			const size_t refs = hits[ level] + misses[ level];
+			return refs ? double( hits[ level]) / refs : 0;
+		}
+
+		/// Upper bound in nanoseconds of the fraction p (0..1) of the operations of a latency histogram
+		static unsigned long long percentile( const size_t* const histogram, const double p)
+		{
+			size_t total = 0;
+			for( size_t i = 0; i < latency_buckets; ++i)
+			{
+				total += histogram[ i];
+			}
+
+			size_t count = 0;
+			for( size_t i = 0; i < latency_buckets; ++i)
+			{
+				count += histogram[ i];
+				if ( count && count >= p * total)
+				{
+					return 2ULL << i;
+				}
+			}
+			return 0;
+		}
+
+	private:
+		static size_t sum( const size_t* const items)
+		{
+			size_t total = 0;
+			for( size_t i = 0; i < max_levels; ++i)
+			{
+				total += items[ i];
+			}
+			return total;
+		}
+	};
+
+	/// Instrumentation of bp_tree_default_traits, all operations compile to nothing
+	struct bp_tree_no_stats
+	{
+		enum { enabled = false };
+
+		struct timer
+		{
+			timer( bp_tree_no_stats&, const bool) {}
+		};
+
+		void hit( const size_t) {}
+		void miss( const size_t) {}
+		void split( const size_t) {}
+		void evict( const bool) {}
+		void read( const size_t) {}
+		void written( const size_t) {}
+		void reset() {}
+
+		void snapshot( bp_tree_stats_snapshot& out) const
+		{
+			out = bp_tree_stats_snapshot();
+			out.enabled = false;
+		}
+	};
+
+	/// Counting instrumentation; set as the stats_type of the traits to size the cache from
+	/// the hit rates per level. The counters are relaxed atomics, so the concurrent readers of
+	/// bp_tree_read_sync may update them; a snapshot taken meanwhile is not exact.
+	class bp_tree_stats
+	{
+		typedef std::atomic<size_t>				_Counter;
+		typedef std::atomic<unsigned long long>	_ByteCounter;
+		typedef bp_tree_stats_snapshot			_Snapshot;
+
+		_Counter		hits_[ _Snapshot::max_levels];
+		_Counter		misses_[ _Snapshot::max_levels];
+		_Counter		splits_[ _Snapshot::max_levels];
+		_Counter		clean_evictions_;
+		_Counter		dirty_evictions_;
+		_ByteCounter	bytes_read_;
+		_ByteCounter	bytes_written_;
+		_Counter		find_latency_[ _Snapshot::latency_buckets];
+		_Counter		insert_latency_[ _Snapshot::latency_buckets];
+
+		static void add( _Counter& counter, const size_t value = 1)
+		{
+			counter.fetch_add( value, std::memory_order_relaxed);
+		}
+
+		static void add_level( _Counter* const counters, const size_t level)
+		{
+			add( counters[ level < _Snapshot::max_levels ? level : _Snapshot::max_levels - 1]);
+		}
+
+		static void copy( size_t* const dest, const _Counter* const src, const size_t count)
+		{
+			for( size_t i = 0; i < count; ++i)
+			{
+				dest[ i] = src[ i].load( std::memory_order_relaxed);
+			}
+		}
+
+		static void clear( _Counter* const counters, const size_t count)
+		{
+			for( size_t i = 0; i < count; ++i)
+			{
+				counters[ i].store( 0, std::memory_order_relaxed);
+			}
+		}
+
+		void record_latency( const bool insert, unsigned long long ns)
+		{
+			size_t bucket = 0;
+			while( ns >>= 1)
+			{
+				++bucket;
+			}
+			add( ( insert ? insert_latency_ : find_latency_)[ bucket < _Snapshot::latency_buckets ? bucket : _Snapshot::latency_buckets - 1]);
+		}
+
+	public:
+		enum { enabled = true };
+
+		/// Times a find (insert = false) or an insert from construction to destruction
+		class timer
+		{
+			bp_tree_stats&							stats_;
+			const bool								insert_;
+			std::chrono::steady_clock::time_point	start_;
+
+			timer( const timer&);
+			timer& operator = ( const timer&);
+
+		public:
+			timer( bp_tree_stats& stats, const bool insert): stats_( stats), insert_( insert), start_( std::chrono::steady_clock::now()) {}
+
+			~timer()
+			{
+				const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start_;
+				stats_.record_latency( insert_, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed).count());
+			}
+		};
+
+		bp_tree_stats() { reset(); }
+
+		void hit( const size_t level)		{ add_level( hits_, level); }
+		void miss( const size_t level)		{ add_level( misses_, level); }
+		void split( const size_t level)		{ add_level( splits_, level); }
+		void evict( const bool dirty)		{ add( dirty ? dirty_evictions_ : clean_evictions_); }
+		void read( const size_t bytes)		{ bytes_read_.fetch_add( bytes, std::memory_order_relaxed); }
+		void written( const size_t bytes)	{ bytes_written_.fetch_add( bytes, std::memory_order_relaxed); }
+
+		void reset()
+		{
+			clear( hits_, _Snapshot::max_levels);
+			clear( misses_, _Snapshot::max_levels);
+			clear( splits_, _Snapshot::max_levels);
+			clean_evictions_.store( 0, std::memory_order_relaxed);
+			dirty_evictions_.store( 0, std::memory_order_relaxed);
+			bytes_read_.store( 0, std::memory_order_relaxed);
+			bytes_written_.store( 0, std::memory_order_relaxed);
+			clear( find_latency_, _Snapshot::latency_buckets);
+			clear( insert_latency_, _Snapshot::latency_buckets);
+		}
+
+		void snapshot( _Snapshot& out) const
+		{
+			out.enabled = true;
+			copy( out.hits, hits_, _Snapshot::max_levels);
+			copy( out.misses, misses_, _Snapshot::max_levels);
+			copy( out.splits, splits_, _Snapshot::max_levels);
+			out.clean_evictions = clean_evictions_.load( std::memory_order_relaxed);
+			out.dirty_evictions = dirty_evictions_.load( std::memory_order_relaxed);
+			out.bytes_read = bytes_read_.load( std::memory_order_relaxed);
+			out.bytes_written = bytes_written_.load( std::memory_order_relaxed);
+			copy( out.find_latency, find_latency_, _Snapshot::latency_buckets);
+			copy( out.insert_latency, insert_latency_, _Snapshot::latency_buckets);
+		}
+	};
+}
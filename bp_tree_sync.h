@@ -0,0 +1,169 @@
+﻿#pragma once
+/// B+ Tree synchronization policies
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+#ifndef PCH
+	#include <cstddef>
+	#include <atomic>
+	#include <mutex>
+	#include <thread>
+#endif
+
+namespace stdext
+{
+	/// Per node latch of bp_tree_read_sync.
+	/// The version is odd while the links of the node (child or sibling pointers) are changed;
+	/// readers take a snapshot of it, read the link and validate the snapshot afterwards,
+	/// retrying when a writer got in between (optimistic lock coupling). Keys and values are
+	/// not covered, they only change under the exclusive access of insert / erase.
+	/// The pin count keeps an evicted node alive while an iterator points into it.
+	class bp_tree_node_latch
+	{
+		mutable std::atomic<size_t>	version_;
+		mutable std::atomic<size_t>	pins_;
+		std::atomic<bool>			retired_;
+
+	public:
+		bp_tree_node_latch(): version_( 0), pins_( 0), retired_( false) {}
+
+		// nodes are copy constructed from a prototype, the latch state is not copied
+		bp_tree_node_latch( const bp_tree_node_latch&): version_( 0), pins_( 0), retired_( false) {}
+		bp_tree_node_latch& operator = ( const bp_tree_node_latch&) { return *this; }
+
+		size_t read_lock() const
+		{
+			size_t version;
+			while( ( version = version_.load( std::memory_order_acquire)) & 1)
+			{
+				std::this_thread::yield();
+			}
+			return version;
+		}
+
+		bool validate( const size_t version) const
+		{
+			std::atomic_thread_fence( std::memory_order_acquire);
+			return version_.load( std::memory_order_relaxed) == version;
+		}
+
+		// writers are serialized by the tree's mutex
+		void lock()		{ version_.fetch_add( 1, std::memory_order_acq_rel); }
+		void unlock()	{ version_.fetch_add( 1, std::memory_order_release); }
+
+		void pin() const	{ pins_.fetch_add( 1, std::memory_order_relaxed); }
+		void unpin() const	{ pins_.fetch_sub( 1, std::memory_order_release); }
+		bool is_pinned() const { return pins_.load( std::memory_order_acquire) != 0; }
+
+		void retire()			{ retired_.store( true, std::memory_order_relaxed); }
+		bool is_retired() const { return retired_.load( std::memory_order_relaxed); }
+	};
+
+	/// Epoch based reclamation of bp_tree_read_sync.
+	/// Every read operation runs inside an epoch; a node evicted from the cache is retired
+	/// in the current epoch and released only when all the readers that might still see it
+	/// have left, i.e. once the epoch could be advanced past it.
+	class bp_tree_epoch
+	{
+		std::atomic<size_t> epoch_;
+		std::atomic<size_t> active_[ 2];
+
+		bp_tree_epoch( const bp_tree_epoch&);
+		bp_tree_epoch& operator = ( const bp_tree_epoch&);
+
+	public:
+		bp_tree_epoch(): epoch_( 0)
+		{
+			active_[ 0] = active_[ 1] = 0;
+		}
+
+		size_t enter()
+		{
+			for( ;;)
+			{
+				const size_t epoch = epoch_.load();
+				++active_[ epoch & 1];
+				if ( epoch_.load() == epoch)
+				{
+					return epoch;
+				}
+				--active_[ epoch & 1];
+			}
+		}
+
+		void leave( const size_t epoch)
+		{
+			--active_[ epoch & 1];
+		}
+
+		size_t current() const
+		{
+			return epoch_.load();
+		}
+
+		/// Advances the epoch if no reader of the previous one is left; the nodes retired
+		/// in the previous epoch (same parity as the new current one) can then be released.
+		/// Must be serialized with the retirements.
+		bool try_advance()
+		{
+			const size_t epoch = epoch_.load();
+			if ( active_[ ( epoch + 1) & 1].load())
+			{
+				return false;
+			}
+			epoch_.store( epoch + 1);
+			return true;
+		}
+	};
+
+	/// Latch of bp_tree_no_sync, all operations compile to nothing
+	struct bp_tree_null_latch
+	{
+		size_t read_lock() const { return 0; }
+		bool validate( const size_t) const { return true; }
+		void lock() {}
+		void unlock() {}
+		void pin() const {}
+		void unpin() const {}
+		bool is_pinned() const { return false; }
+		void retire() {}
+		bool is_retired() const { return false; }
+	};
+
+	struct bp_tree_null_epoch
+	{
+		size_t enter() { return 0; }
+		void leave( const size_t) {}
+		size_t current() const { return 0; }
+		bool try_advance() { return true; }
+	};
+
+	struct bp_tree_null_mutex
+	{
+		void lock() {}
+		void unlock() {}
+	};
+
+	/// Single threaded bp_tree (default)
+	struct bp_tree_no_sync
+	{
+		enum { concurrent_reads = false };
+
+		typedef bp_tree_null_latch	latch_type;
+		typedef bp_tree_null_epoch	epoch_type;
+		typedef bp_tree_null_mutex	mutex_type;
+	};
+
+	/// bp_tree whose const operations (find, lower_bound, iteration ...) may run concurrently
+	/// from many threads. Linked nodes are reached without locking, cache misses and evictions
+	/// are serialized by a mutex. Operations that change the tree (insert, erase, clear ...)
+	/// still need exclusive access. With concurrent readers the cache order is refreshed only
+	/// on misses, a hit through a linked pointer does not move the node to the front.
+	struct bp_tree_read_sync
+	{
+		enum { concurrent_reads = true };
+
+		typedef bp_tree_node_latch	latch_type;
+		typedef bp_tree_epoch		epoch_type;
+		typedef std::mutex			mutex_type;
+	};
+}
@@ -0,0 +1,385 @@
+﻿#pragma once
+/// B+ Tree write-ahead log
+/// Copyright (c) Flaviu Cibu. All rights reserved.
+
+#ifndef PCH
+	#include <cstring>
+	#include <cstddef>
+	#include <vector>
+	#include <mutex>
+	#ifdef _WIN32
+		#ifndef WIN32_LEAN_AND_MEAN
+			#define WIN32_LEAN_AND_MEAN
+		#endif
+		#include <windows.h>
+	#else
+		#include <fcntl.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+namespace stdext
+{
+	/// Redo log of a bp_tree. Every put, erase and clear of the tree, and every item of its
+	/// insert_batch and bulk_load, is appended as a fixed size record ( op, key, value,
+	/// checksum); the tree refuses insert( key) while the log is attached. Records are buffered
+	/// and written with a single fsync once group_size of them are pending (group commit) or
+	/// on commit(). A put thus returns before its record is on disk: a crash loses up to the
+	/// last group_size - 1 changes, unless the caller waits for them with commit().
+	/// The nodes the tree writes in place between checkpoints would not match the logged
+	/// changes after a crash, so before a slot of the file is first overwritten since the log
+	/// started, its bytes are appended as a page record ( op_page, offset, size, bytes,
+	/// checksum) and synced. The tree holds the nodes waiting for their page records and
+	/// syncs those of many with one commit( count), which costs nothing once a group commit
+	/// has synced them. bp_tree::open writes the pages back, newest first, which turns the
+	/// file back into what it was when the log started, then replays the changes over it.
+	/// The tree truncates the log after a checkpoint or a clean close, which is why it takes a
+	/// log only over a stream whose sync reaches the disk. Reading stops at the first torn or corrupt record and cuts the log there.
+	/// The records may be appended from the tree's flusher thread.
+	template <typename _Key, typename _Val>
+	class bp_tree_wal
+	{
+		bp_tree_wal( const bp_tree_wal&);
+		bp_tree_wal& operator = ( const bp_tree_wal&);
+
+	public:
+		typedef _Key	key_type;
+		typedef _Val	value_type;
+
+		enum E
+		{
+			op_put		= 1,
+			op_erase	= 2,
+			op_clear	= 3,
+			op_insert	= 4,	//< an item of insert_batch, inserted even if the key exists
+			op_page		= 5,	//< bytes of the tree file before they were overwritten
+
+			record_size	= 1 + sizeof( _Key) + sizeof( _Val) + sizeof( unsigned),
+			page_header	= 1 + sizeof( unsigned long long) + sizeof( unsigned),
+			read_chunk	= 1 << 16
+		};
+
+		struct record
+		{
+			unsigned char		op;
+			key_type			key;
+			value_type			value;
+			unsigned long long	offset;	//< of a page record
+			std::vector<char>	page;
+		};
+
+	protected:
+	#ifdef _WIN32
+		HANDLE	file_;
+	#else
+		int		fd_;
+	#endif
+		std::vector<char>	buffer_;	//< records not written yet
+		std::vector<char>	chunk_;		//< replay read buffer
+		size_t				chunk_pos_;
+		size_t				pending_;	//< records in buffer_
+		size_t				group_size_;
+		size_t				end_;		//< bytes of valid records in the file
+		size_t				appended_;	//< records appended since open
+		size_t				durable_;	//< records appended and synced since open
+		std::mutex			mutex_;		//< guards the appends and the writes of the log
+
+		// FNV-1a
+		static unsigned checksum( const char* data, const size_t bytes)
+		{
+			unsigned h = 2166136261u;
+			for( size_t i = 0; i < bytes; ++i)
+			{
+				h = ( h ^ (unsigned char) data[ i]) * 16777619u;
+			}
+			return h;
+		}
+
+		bool write_file( const char* data, size_t bytes)
+		{
+		#ifdef _WIN32
+			while( bytes)
+			{
+				DWORD written;
+				if ( !WriteFile( file_, data, DWORD( bytes), &written, 0) || !written)
+				{
+					return false;
+				}
+				data += written;
+				bytes -= written;
+			}
+			return FlushFileBuffers( file_) != 0;
+		#else
+			while( bytes)
+			{
+				const ssize_t written = ::write( fd_, data, bytes);
+				if ( written <= 0)
+				{
+					return false;
+				}
+				data += written;
+				bytes -= size_t( written);
+			}
+			#if defined(__APPLE__)
+				return !fsync( fd_);
+			#else
+				return !fdatasync( fd_);
+			#endif
+		#endif
+		}
+
+		size_t read_file( char* const data, const size_t bytes)
+		{
+		#ifdef _WIN32
+			DWORD read;
+			return ReadFile( file_, data, DWORD( bytes), &read, 0) ? read : 0;
+		#else
+			const ssize_t read = ::read( fd_, data, bytes);
+			return read > 0 ? size_t( read) : 0;
+		#endif
+		}
+
+		bool seek_file( const size_t pos)
+		{
+		#ifdef _WIN32
+			LARGE_INTEGER offset;
+			offset.QuadPart = pos;
+			return SetFilePointerEx( file_, offset, 0, FILE_BEGIN) != 0;
+		#else
+			return lseek( fd_, off_t( pos), SEEK_SET) == off_t( pos);
+		#endif
+		}
+
+		bool truncate_file( const size_t size)
+		{
+			if ( !seek_file( size))
+			{
+				return false;
+			}
+		#ifdef _WIN32
+			return SetEndOfFile( file_) && FlushFileBuffers( file_);
+		#else
+			return !ftruncate( fd_, off_t( size)) && !fsync( fd_);
+		#endif
+		}
+
+		void append( const unsigned char op, const key_type& key, const value_type* const value)
+		{
+			std::lock_guard<std::mutex> lock( mutex_);
+			const size_t pos = buffer_.size();
+			buffer_.resize( pos + record_size);
+			char* const p = &buffer_[ pos];
+			p[ 0] = char( op);
+			memcpy( p + 1, &key, sizeof( key_type));
+			if ( value)
+			{
+				memcpy( p + 1 + sizeof( key_type), value, sizeof( value_type));
+			}
+			else
+			{
+				memset( p + 1 + sizeof( key_type), 0, sizeof( value_type));
+			}
+			const unsigned sum = checksum( p, record_size - sizeof( unsigned));
+			memcpy( p + record_size - sizeof( unsigned), &sum, sizeof( unsigned));
+
+			++appended_;
+			if ( ++pending_ >= group_size_)
+			{
+				commit_();
+			}
+		}
+
+		bool commit_()
+		{
+			if ( !pending_)
+			{
+				return true;
+			}
+			const bool ok = is_open() && seek_file( end_) && write_file( &buffer_[ 0], buffer_.size());
+			if ( ok)
+			{
+				end_ += buffer_.size();
+				durable_ = appended_;
+			}
+			buffer_.clear();
+			pending_ = 0;
+			return ok;
+		}
+
+		// true once chunk_ holds bytes past the read position, false at the end of the file
+		bool fill( const size_t bytes)
+		{
+			while( chunk_.size() - chunk_pos_ < bytes)
+			{
+				chunk_.erase( chunk_.begin(), chunk_.begin() + chunk_pos_);
+				chunk_pos_ = 0;
+				const size_t size = chunk_.size();
+				chunk_.resize( size + read_chunk);
+				const size_t read = read_file( &chunk_[ size], read_chunk);
+				chunk_.resize( size + read);
+				if ( !read)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+	public:
+		/// Opens or creates the log file; group_size records are synced together
+		bp_tree_wal( const char* const file_name, const size_t group_size = 256):
+		#ifdef _WIN32
+			file_( INVALID_HANDLE_VALUE),
+		#else
+			fd_( -1),
+		#endif
+			chunk_pos_( 0),
+			pending_( 0),
+			group_size_( group_size ? group_size : 1),
+			end_( 0),
+			appended_( 0),
+			durable_( 0)
+		{
+		#ifdef _WIN32
+			file_ = CreateFileA( file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0,
+				OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, 0);
+		#else
+			fd_ = ::open( file_name, O_RDWR | O_CREAT, 0644);
+		#endif
+		}
+
+		~bp_tree_wal()
+		{
+			commit_();
+		#ifdef _WIN32
+			if ( file_ != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle( file_);
+			}
+		#else
+			if ( fd_ >= 0)
+			{
+				::close( fd_);
+			}
+		#endif
+		}
+
+		bool is_open() const
+		{
+		#ifdef _WIN32
+			return file_ != INVALID_HANDLE_VALUE;
+		#else
+			return fd_ >= 0;
+		#endif
+		}
+
+		void log_put( const key_type& key, const value_type& value)	{ append( op_put, key, &value); }
+		void log_erase( const key_type& key)						{ append( op_erase, key, 0); }
+		void log_clear()											{ append( op_clear, key_type(), 0); }
+		void log_insert( const key_type& key, const value_type& value)	{ append( op_insert, key, &value); }
+
+		/// Appends the bytes at offset of the tree file, before the tree overwrites them; they
+		/// must be committed before the write. Returns the records appended so far, the page's
+		/// included, for commit( count)
+		size_t log_page( const unsigned long long offset, const void* const data, const unsigned bytes)
+		{
+			std::lock_guard<std::mutex> lock( mutex_);
+			const size_t pos = buffer_.size();
+			buffer_.resize( pos + page_header + bytes + sizeof( unsigned));
+			char* const p = &buffer_[ pos];
+			p[ 0] = char( op_page);
+			memcpy( p + 1, &offset, sizeof( offset));
+			memcpy( p + 1 + sizeof( offset), &bytes, sizeof( bytes));
+			memcpy( p + page_header, data, bytes);
+			const unsigned sum = checksum( p, page_header + bytes);
+			memcpy( p + page_header + bytes, &sum, sizeof( unsigned));
+
+			++appended_;
+			++pending_;
+			return appended_;
+		}
+
+		/// Writes the pending records and syncs the file
+		bool commit()
+		{
+			std::lock_guard<std::mutex> lock( mutex_);
+			return commit_();
+		}
+
+		/// Commits, unless the first count records appended since open are synced already
+		bool commit( const size_t count)
+		{
+			std::lock_guard<std::mutex> lock( mutex_);
+			return durable_ >= count || commit_();
+		}
+
+		/// Drops the whole log, once the tree file holds every logged change
+		bool reset()
+		{
+			std::lock_guard<std::mutex> lock( mutex_);
+			buffer_.clear();
+			pending_ = 0;
+			end_ = 0;
+			durable_ = appended_;
+			return is_open() && truncate_file( 0);
+		}
+
+		size_t appended() const	{ return appended_; }
+		size_t durable() const	{ return durable_; }
+
+		/// Restarts reading the records from the beginning of the log
+		void rewind()
+		{
+			commit();
+			end_ = 0;
+			chunk_.clear();
+			chunk_pos_ = 0;
+			seek_file( 0);
+		}
+
+		/// Reads the next record; at the end of the log, or at a torn record, the log is
+		/// cut after the last valid record and false is returned
+		bool read( record& rec)
+		{
+			size_t size = record_size;
+			if ( fill( 1) && chunk_[ chunk_pos_] == char( op_page) && fill( page_header))
+			{
+				unsigned bytes;
+				memcpy( &bytes, &chunk_[ chunk_pos_ + 1 + sizeof( rec.offset)], sizeof( bytes));
+				size = page_header + size_t( bytes) + sizeof( unsigned);
+			}
+
+			if ( fill( size))
+			{
+				const char* const p = &chunk_[ chunk_pos_];
+				unsigned sum;
+				memcpy( &sum, p + size - sizeof( unsigned), sizeof( unsigned));
+				if ( p[ 0] >= op_put && p[ 0] <= op_page && sum == checksum( p, size - sizeof( unsigned)))
+				{
+					rec.op = (unsigned char) p[ 0];
+					if ( rec.op == op_page)
+					{
+						memcpy( &rec.offset, p + 1, sizeof( rec.offset));
+						rec.page.assign( p + page_header, p + size - sizeof( unsigned));
+					}
+					else
+					{
+						memcpy( &rec.key, p + 1, sizeof( key_type));
+						memcpy( &rec.value, p + 1 + sizeof( key_type), sizeof( value_type));
+					}
+					chunk_pos_ += size;
+					end_ += size;
+					return true;
+				}
+			}
+
+			chunk_.clear();
+			chunk_pos_ = 0;
+			if ( is_open())
+			{
+				truncate_file( end_);
+			}
+			return false;
+		}
+	};
+}
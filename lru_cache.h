@@ -6,6 +6,7 @@
 
 #include <functional>
 #include <hash_map>
+#include <list>
 #include <set>
 
 namespace stdext
@@ -73,9 +74,257 @@ namespace stdext
 		void operator () ( const T&) {}
 	};
 
+
+	/// Eviction policies decide the order in which lru_cache drops its items.
+	/// Item is the cache's list node (prev, next, a queue tag and a stamp); a policy keeps the items
+	/// in its own lists and is told about insertions, hits and removals; restore() takes back an
+	/// item the cache had erased to lock it, into the queue it was in. A victim_cursor walks
+	/// the items in the order victim() would return them as new keys keep coming in.
+
+	/// Least recently used (default): a hit moves the item to the front, the back is evicted.
+	template <typename Key, typename Item>
+	class lru_cache_lru_policy
+	{
+		lru_cache_lru_policy( const lru_cache_lru_policy&);
+		lru_cache_lru_policy& operator = ( const lru_cache_lru_policy&);
+
+		protected:
+			Item iHead;
+
+		public:
+			lru_cache_lru_policy( const size_t) { clear(); }
+
+			Item* head() const { return (Item*) &iHead; }
+
+			void insert( const Key&, Item& item)	{ iHead.append( &item); }
+			void restore( Item& item)				{ iHead.append( &item); }
+			void erase( Item& item)					{ item.unlink(); }
+			void evict( const Key&, Item& item)		{ item.unlink(); }
+			void clear()							{ iHead.clear(); }
+
+			void touch( Item& item)
+			{
+				if ( item.prev != head())
+				{
+					item.unlink();
+					iHead.append( &item);
+				}
+			}
+
+			Item* victim() const { return iHead.prev != head() ? iHead.prev : 0; }
+
+			struct victim_cursor
+			{
+				Item* item;
+			};
+
+			victim_cursor first_victim() const
+			{
+				const victim_cursor c = { victim() };
+				return c;
+			}
+
+			void next_victim( victim_cursor& c) const
+			{
+				c.item = c.item->prev != head() ? c.item->prev : 0;
+			}
+	};
+
+	/// 2Q (Johnson & Shasha): new items enter the A1in queue; an item evicted from A1in leaves its
+	/// key in a ghost FIFO (A1out) and, if referenced again while remembered, is admitted to the
+	/// main LRU queue (Am). References closer than Kin to the previous one are correlated (a scan
+	/// touches a node only in such a burst) and just refresh the item in A1in, a later hit
+	/// promotes it to Am. The hot items thus settle in Am and a scan only cycles through A1in.
+	/// Unlike the paper A1in is kept in recency order, so the item just used is never the next
+	/// victim (bp_tree relies on it for the nodes on its current path); Kin is at least 8 items.
+	/// The mru iterators of the cache walk the Am queue, its victim iterators all the items.
+	template <typename Key, typename Item>
+	class lru_cache_2q_policy
+	{
+		lru_cache_2q_policy( const lru_cache_2q_policy&);
+		lru_cache_2q_policy& operator = ( const lru_cache_2q_policy&);
+
+		protected:
+			enum Queue { main_queue, in_queue };
+
+			typedef std::list<Key>									GhostList;
+			typedef hash_map<Key, typename GhostList::iterator>	GhostMap;
+
+			Item		iMain;		// Am, most recent first
+			Item		iIn;		// A1in, most recent first
+			size_t		iInSize;
+			size_t		iInLimit;	// Kin, a quarter of the cache
+			size_t		iClock;		// references so far
+			size_t		iOutLimit;	// Kout, half the cache
+			GhostList	iOut;		// A1out, newest first
+			GhostMap	iOutMap;
+
+			// a quarter of the cache, at least 8 items but no more than half of it
+			static size_t in_limit( const size_t maxLimit)
+			{
+				const size_t half = maxLimit / 2;
+				return maxLimit / 4 > 8 ? maxLimit / 4 : ( half < 8 ? ( half ? half : 1) : 8);
+			}
+
+		public:
+			lru_cache_2q_policy( const size_t maxLimit):
+				iInSize( 0),
+				iInLimit( in_limit( maxLimit)),
+				iClock( 0),
+				iOutLimit( maxLimit / 2 ? maxLimit / 2 : 1)
+			{
+				iMain.clear();
+				iIn.clear();
+			}
+
+			Item* head() const { return (Item*) &iMain; }
+
+			void insert( const Key& key, Item& item)
+			{
+				item.stamp = ++iClock;
+				typename GhostMap::iterator ghost = iOutMap.find( key);
+				if ( ghost != iOutMap.end())
+				{
+					iOut.erase( ghost->second);
+					iOutMap.erase( ghost);
+					item.queue = main_queue;
+					iMain.append( &item);
+				}
+				else
+				{
+					item.queue = in_queue;
+					iIn.append( &item);
+					++iInSize;
+				}
+			}
+
+			void restore( Item& item)
+			{
+				if ( item.queue == main_queue)
+				{
+					iMain.append( &item);
+				}
+				else
+				{
+					iIn.append( &item);
+					++iInSize;
+				}
+			}
+
+			void touch( Item& item)
+			{
+				if ( item.queue == in_queue && iClock - item.stamp > iInLimit)
+				{
+					item.unlink();
+					--iInSize;
+					item.queue = main_queue;
+					iMain.append( &item);
+				}
+				else
+				{
+					Item& queue = item.queue == main_queue ? iMain : iIn;
+					if ( item.prev != &queue)
+					{
+						item.unlink();
+						queue.append( &item);
+					}
+				}
+				item.stamp = ++iClock;
+			}
+
+			void erase( Item& item)
+			{
+				item.unlink();
+				if ( item.queue == in_queue)
+				{
+					--iInSize;
+				}
+			}
+
+			void evict( const Key& key, Item& item)
+			{
+				erase( item);
+				if ( item.queue == in_queue)
+				{
+					if ( iOut.size() == iOutLimit)
+					{
+						iOutMap.erase( iOut.back());
+						iOut.pop_back();
+					}
+					iOut.push_front( key);
+					iOutMap[ key] = iOut.begin();
+				}
+			}
+
+			void clear()
+			{
+				iMain.clear();
+				iIn.clear();
+				iInSize = 0;
+				iOut.clear();
+				iOutMap.clear();
+			}
+
+			Item* victim() const
+			{
+				if ( iInSize && ( iInSize > iInLimit || iMain.prev == head()))
+				{
+					return iIn.prev;
+				}
+				return iMain.prev != head() ? iMain.prev : 0;
+			}
+
+			// Each new key enters A1in, so once A1in is past Kin it loses an item per miss: the
+			// Am items that go while A1in grows past Kin, then all of A1in, then the rest of Am,
+			// oldest first
+			struct victim_cursor
+			{
+				Item*	item;
+				Item*	in;		//< next of A1in
+				Item*	main;	//< next of Am
+				size_t	lead;	//< Am items to go before A1in
+			};
+
+			victim_cursor first_victim() const
+			{
+				victim_cursor c;
+				c.in = iIn.prev;
+				c.main = iMain.prev;
+				c.lead = iInSize > iInLimit ? 0 : iInLimit + 1 - iInSize;
+				pick( c);
+				return c;
+			}
+
+			void next_victim( victim_cursor& c) const
+			{
+				if ( c.item == c.main)
+				{
+					c.main = c.main->prev;
+					if ( c.lead)
+					{
+						--c.lead;
+					}
+				}
+				else
+				{
+					c.in = c.in->prev;
+				}
+				pick( c);
+			}
+
+		protected:
+			void pick( victim_cursor& c) const
+			{
+				const bool in = c.in != &iIn;
+				const bool main = c.main != &iMain;
+				c.item = main && ( c.lead || !in) ? c.main : in ? c.in : 0;
+			}
+	};
+
 	template <typename Key, typename Data, typename EvictionObserver = lru_cache_dummy_eviction_observer, 
 				template <typename> class Statistics = lru_cache_dummy_statistics,
-				typename HashCompare = hash_compare<Key>, template <typename> class HashMapAccessor = hm_accessor>
+				typename HashCompare = hash_compare<Key>, template <typename> class HashMapAccessor = hm_accessor,
+				template <typename, typename> class EvictionPolicy = lru_cache_lru_policy>
 	class lru_cache
 	{
 		lru_cache( const lru_cache&);
@@ -86,10 +335,12 @@ namespace stdext
 
 			struct MruItem
 			{
-				Item*	prev;
-				Item*	next;
+				Item*			prev;
+				Item*			next;
+				size_t			stamp;	// policy's clock at the last reference
+				unsigned char	queue;	// policy's queue of the item
 
-				MruItem(): prev( 0), next( 0) {}
+				MruItem(): prev( 0), next( 0), stamp( 0), queue( 0) {}
 
 				void clear() { next = prev = (Item*) this; }
 
@@ -265,22 +516,66 @@ namespace stdext
 
 		protected:
 			typedef std::set<Item*>	LockedSet;
+			typedef EvictionPolicy<Key, Item> Policy;
 
-			MruItem					iMruHead;
+		public:
+			/// Walks the unlocked items in the order the policy would evict them in
+			class const_victim_iterator
+			{
+				protected:
+					friend class lru_cache;
+					typedef typename Policy::victim_cursor Cursor;
+					const Policy*	policy;
+					Cursor			cursor;
+					const_victim_iterator( const Policy* const p, const Cursor& c): policy( p), cursor( c) {}
+
+				public:
+					typedef std::forward_iterator_tag iterator_category;
+					typedef Data				value_type;
+					typedef ptrdiff_t			difference_type;
+					typedef const value_type*	pointer;
+					typedef const value_type&	reference;
+
+					const_victim_iterator(): policy( 0) { cursor.item = 0; }
+
+					reference operator* ()	const { return cursor.item->data; }
+					pointer	operator-> ()	const { return &cursor.item->data; }
+
+					const_victim_iterator& operator++() { policy->next_victim( cursor); return *this; }
+
+					bool operator == ( const const_victim_iterator& it) const { return cursor.item == it.cursor.item; }
+					bool operator != ( const const_victim_iterator& it) const { return cursor.item != it.cursor.item; }
+			};
+
+			const_victim_iterator victim_begin() const	{ return const_victim_iterator( &iPolicy, iPolicy.first_victim()); }
+			const_victim_iterator victim_end() const	{ return const_victim_iterator(); }
+
+		protected:
+
+			Policy					iPolicy;
 			size_t					iMaxLimit;
 			eviction_observer_type*	iObserver;
 			Statistics<lru_cache>		iStatistics;
 			HashMap					iMap;
 			LockedSet				iLockedSet;
 
-			Item* head() const { return (Item*) &iMruHead; }
+			Item* head() const { return iPolicy.head(); }
 			void touch( HmIterator& it) { if ( it != iMap.end()) set_mru( it); }
 
+			// locked items are out of the policy's queues
+			void unlink( Item& item)
+			{
+				if ( item.prev)
+				{
+					iPolicy.erase( item);
+				}
+			}
+
 			iterator erase( const HmIterator& it)
 			{
 				if ( it != iMap.end())
 				{
-					it->second.unlink();
+					unlink( it->second);
 					if ( iObserver)
 					{
 						(*iObserver)( it->second.data);
@@ -293,19 +588,20 @@ namespace stdext
 			void set_mru( HmIterator& it) { set_mru( it->second); }
 			void set_mru( Item& item)
 			{
-				if ( item.prev != head())
+				if ( item.prev)
 				{
-					item.unlink();
-					head()->append( &item);
+					iPolicy.touch( item);
 				}
 			}
 
 		public:
+			typedef Policy eviction_policy_type;
+
 			lru_cache( const size_t maxLimit, eviction_observer_type* const observer = 0):
+				iPolicy( maxLimit),
 				iMaxLimit( maxLimit),
 				iObserver( observer)
 			{ 
-				iMruHead.prev = iMruHead.next = head();
 			}
 
 			~lru_cache()
@@ -335,16 +631,16 @@ namespace stdext
 			const_reverse_iterator rend()	const { return iMap.end(); }
 
 
-			mru_iterator mru_begin()	{ return iMruHead.next; }
+			mru_iterator mru_begin()	{ return head()->next; }
 			mru_iterator mru_end()		{ return head(); }
 
-			const_mru_iterator mru_begin()	const { return iMruHead.next; }
+			const_mru_iterator mru_begin()	const { return head()->next; }
 			const_mru_iterator mru_end()	const { return head(); }
 
-			reverse_mru_iterator mru_rbegin()	{ return iMruHead.prev; }
+			reverse_mru_iterator mru_rbegin()	{ return head()->prev; }
 			reverse_mru_iterator mru_rend()		{ return head(); }
 
-			const_reverse_mru_iterator mru_rbegin()	const { return iMruHead.prev; }
+			const_reverse_mru_iterator mru_rbegin()	const { return head()->prev; }
 			const_reverse_mru_iterator mru_rend()	const { return head(); }
 
 
@@ -375,8 +671,7 @@ namespace stdext
 				if ( it.iter != iMap.end())
 				{
 					Item& item = it.iter->second;
-					item.prev->next = item.next;
-					item.next->prev = item.prev;
+					unlink( item);
 					item.next = item.prev = 0;
 					iLockedSet.insert( &it.iter->second);
 				}
@@ -384,22 +679,30 @@ namespace stdext
 
 			void unlock( const iterator& it)
 			{
-				if ( it.iter != iMap.end() && iLockedSet.find( &it.iter->second) != iLockedSet.end())
+				if ( it.iter != iMap.end() && iLockedSet.erase( &it.iter->second))
 				{
-					Item& item = it.iter->second;
-					item.next = iMruHead.next;
-					item.prev = head();
-					iMruHead.next->prev = &item;
-					iMruHead.next = &item;
+					iPolicy.restore( it.iter->second);
 				}
 			}
 
 			iterator erase( const iterator& it)	{ return erase( it.iter); }
 			iterator erase( const Key &key)		{ return erase( iMap.find( key)); }
 
+			/// Removes an item without notifying the eviction observer
+			iterator detach( const Key& key)
+			{
+				HmIterator it = iMap.find( key);
+				if ( it != iMap.end())
+				{
+					unlink( it->second);
+					return iMap.erase( it);
+				}
+				return iMap.end();
+			}
+
 			void clear() 
 			{ 
-				iMruHead.clear();
+				iPolicy.clear();
 				if ( iObserver)
 				{
 					//const HashMap::reverse_iterator end = iMap.rend();
@@ -424,10 +727,13 @@ namespace stdext
 					if ( find)
 						iStatistics.inc_misses();
 					typedef hm_accessor<HashMap> Accessor;
-					if ( is_full())
+					Item* const victim = is_full() ? iPolicy.victim() : 0;
+					if ( victim)
 					{
 						it = iMap.begin();
-						Accessor::set( it, iMruHead.prev->backRef);
+						Accessor::set( it, victim->backRef);
+						iPolicy.evict( it->first, it->second);
+						it->second.prev = 0; // already out of the policy's queues
 						erase( it);
 					}
 
@@ -435,7 +741,7 @@ namespace stdext
 					if ( item.second)
 					{
 						Accessor::assign( it, item.first);
-						iMruHead.append( &it->second);
+						iPolicy.insert( key, it->second);
 					}
 					exists = false;
 				}
@@ -0,0 +1,85 @@
+﻿#include "test_bp_tree.h"
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <stdlib.h>
+
+using namespace std;
+
+struct ConcurrentTraits: stdext::bp_tree_default_traits
+{
+	typedef stdext::bp_tree_read_sync sync_type;
+};
+
+typedef stdext::bp_tree<size_t, size_t, ConcurrentTraits> ConcurrentBpTree;
+
+static void find_keys( const ConcurrentBpTree& bpt, const vector<size_t>& keys, const size_t count, const unsigned seed, atomic<size_t>& misses)
+{
+	size_t missed = 0;
+	unsigned r = seed;
+	for( size_t i = 0; i < count; ++i)
+	{
+		r = r * 1103515245 + 12345;
+		const size_t key = keys[ ( r >> 8) % keys.size()];
+		const ConcurrentBpTree::const_iterator it = bpt.find( key);
+		if ( !it || *it != key)
+		{
+			++missed;
+		}
+	}
+	misses += missed;
+}
+
+/// Lookup throughput of a read sync tree as the number of reader threads grows
+void bench_concurrent_find()
+{
+	const char fileName[] = "concurrent.bpt";
+	const size_t n = 1000000;
+	const size_t lookups = 2000000;
+
+	vector<size_t> keys;
+	keys.reserve( n);
+	for( size_t i = 0; i < n; ++i)
+	{
+		keys.push_back( i * 3);
+	}
+
+	fstream bptFile;
+	ConcurrentBpTree::stream_type stream( bptFile);
+	create_bpt( fileName, bptFile);
+	if ( !bptFile.is_open())
+	{
+		return;
+	}
+
+	ConcurrentBpTree bpt( 4096);
+	bpt.open( stream);
+	for( size_t i = 0; i < n; ++i)
+	{
+		*bpt.insert( keys[ i]) = keys[ i];
+	}
+
+	const unsigned max_threads = max( thread::hardware_concurrency(), 1u);
+	for( unsigned threads = 1; threads <= max_threads; threads *= 2)
+	{
+		atomic<size_t> misses( 0);
+		vector<thread> workers;
+
+		const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		for( unsigned t = 0; t < threads; ++t)
+		{
+			workers.push_back( thread( find_keys, cref( bpt), cref( keys), lookups / threads, t + 1, ref( misses)));
+		}
+		for( size_t t = 0; t < workers.size(); ++t)
+		{
+			workers[ t].join();
+		}
+		const double seconds = chrono::duration<double>( chrono::steady_clock::now() - start).count();
+
+		cout << threads << " threads\t" << size_t( lookups / seconds) << " lookups/s\n";
+		assert( !misses);
+	}
+}
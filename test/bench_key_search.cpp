@@ -0,0 +1,80 @@
+﻿#include "test_bp_tree.h"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include <ctime>
+#include <stdlib.h>
+
+using namespace std;
+
+template <typename Search, typename Key>
+static double time_search( const vector<Key>& keys, const vector<Key>& probes, const size_t count, size_t& checksum)
+{
+	const clock_t start = clock();
+	const size_t nodes = keys.size() / count;
+	for( size_t i = 0; i < probes.size(); ++i)
+	{
+		const Key* const node = &keys[ ( i % nodes) * count];
+		checksum += Search::lower( node, count, probes[ i]) + Search::upper( node, count, probes[ i]);
+	}
+	return double( clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Key from 64 random bits, over the whole range of the type: negative keys for the signed types
+// and keys with the high bit set for the unsigned ones, which the SIMD search compares with the
+// sign flipped
+template <typename Key>
+static Key random_key()
+{
+	unsigned long long bits = 0;
+	for( int i = 0; i < 5; ++i)
+	{
+		bits = ( bits << 15) ^ (unsigned long long) rand(); // RAND_MAX may be 32767
+	}
+	return Key( (long long) bits);
+}
+
+template <typename Key>
+static void bench_key_type( const char* const name)
+{
+	typedef stdext::bp_tree_key_search<Key, sizeof( Key), false>	Scalar;
+	typedef stdext::bp_tree_node_search<Key>						Node;
+
+	const size_t count = stdext::bp_tree_default_traits::slot_count;
+	const size_t nodes = 1024;
+	const size_t probe_count = 4000000;
+
+	vector<Key> keys( count * nodes);
+	for( size_t n = 0; n < nodes; ++n)
+	{
+		for( size_t i = 0; i < count; ++i)
+		{
+			keys[ n * count + i] = random_key<Key>();
+		}
+		sort( keys.begin() + n * count, keys.begin() + ( n + 1) * count);
+	}
+
+	// every other probe is a key of the node it is searched in, so lower and upper differ
+	vector<Key> probes( probe_count);
+	for( size_t i = 0; i < probe_count; ++i)
+	{
+		probes[ i] = i % 2 ? random_key<Key>() : keys[ i % nodes * count + size_t( rand()) % count];
+	}
+
+	size_t scalar_sum = 0, node_sum = 0;
+	const double scalar_time = time_search<Scalar>( keys, probes, count, scalar_sum);
+	const double node_time = time_search<Node>( keys, probes, count, node_sum);
+
+	cout << name << "\tbinary " << scalar_time << "s\tnode search " << node_time << "s\n";
+	assert( scalar_sum == node_sum);
+}
+
+void bench_key_search()
+{
+	bench_key_type<int>( "int");
+	bench_key_type<unsigned int>( "unsigned");
+	bench_key_type<long long>( "int64");
+	bench_key_type<unsigned long long>( "uint64");
+	bench_key_type<float>( "float");
+	bench_key_type<double>( "double");
+}
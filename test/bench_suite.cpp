@@ -0,0 +1,337 @@
+﻿#include "test_bp_tree.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+/// splitmix64; unlike rand() it gives the same sequences on every platform
+struct BenchRandom
+{
+	unsigned long long state;
+
+	explicit BenchRandom( const unsigned long long seed): state( seed) {}
+
+	unsigned long long next()
+	{
+		unsigned long long z = ( state += 0x9e3779b97f4a7c15ULL);
+		z = ( z ^ ( z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = ( z ^ ( z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ ( z >> 31);
+	}
+
+	double uniform() { return ( next() >> 11) * ( 1.0 / 9007199254740992.0); }
+	size_t below( const size_t n) { return size_t( next() % n); }
+};
+
+/// Zipfian ranks in [ 0, n), rank 0 being the most frequent (Gray et al., as in YCSB)
+class BenchZipfian
+{
+	size_t	n;
+	double	theta, alpha, zetan, eta;
+
+	static double zeta( const size_t n, const double theta)
+	{
+		double sum = 0;
+		for( size_t i = 1; i <= n; ++i)
+		{
+			sum += 1 / pow( double( i), theta);
+		}
+		return sum;
+	}
+
+public:
+	BenchZipfian( const size_t n, const double theta = 0.99): n( n), theta( theta)
+	{
+		zetan = zeta( n, theta);
+		alpha = 1 / ( 1 - theta);
+		eta = ( 1 - pow( 2.0 / n, 1 - theta)) / ( 1 - zeta( 2, theta) / zetan);
+	}
+
+	size_t next( BenchRandom& random) const
+	{
+		const double u = random.uniform();
+		const double uz = u * zetan;
+		if ( uz < 1) return 0;
+		if ( uz < 1 + pow( 0.5, theta)) return 1;
+		return min( n - 1, size_t( n * pow( eta * u - eta + 1, alpha)));
+	}
+};
+
+enum BenchDistribution { bench_sequential, bench_uniform, bench_zipfian, bench_distributions };
+
+static const char* const benchDistributionNames[ bench_distributions] = { "sequential", "uniform", "zipfian" };
+
+/// Indexes of the keys probed by the lookups; zipfian ranks are scattered over the key
+/// space, so the hot keys do not all sit in the same leaves
+static vector<size_t> bench_probes( const size_t n, const size_t count, const BenchDistribution distribution, const unsigned long long seed)
+{
+	BenchRandom random( seed);
+	vector<size_t> probes( count);
+	if ( distribution == bench_zipfian)
+	{
+		const BenchZipfian zipfian( n);
+		for( size_t i = 0; i < count; ++i)
+		{
+			probes[ i] = size_t( ( zipfian.next( random) * 0x9e3779b97f4a7c15ULL) % n);
+		}
+	}
+	else
+	{
+		for( size_t i = 0; i < count; ++i)
+		{
+			probes[ i] = distribution == bench_uniform ? random.below( n) : i % n;
+		}
+	}
+	return probes;
+}
+
+struct BenchResult
+{
+	const char*	structure;
+	const char*	workload;
+	const char*	distribution;
+	size_t		items;
+	size_t		cache;
+	size_t		ops;
+	double		seconds;
+};
+
+class BenchReport
+{
+	vector<BenchResult> results;
+
+public:
+	void add( const char* structure, const char* workload, const char* distribution, const size_t items, const size_t cache, const size_t ops, const double seconds)
+	{
+		const BenchResult result = { structure, workload, distribution, items, cache, ops, seconds };
+		results.push_back( result);
+		cout << structure << '\t' << workload << '\t' << distribution << "\titems " << items << "\tcache " << cache
+			<< '\t' << size_t( ops / max( seconds, 1e-9)) << " ops/s\n";
+	}
+
+	bool write( const char* const fileName) const
+	{
+		ofstream out( fileName);
+		out << "{\n  \"results\": [\n";
+		for( size_t i = 0; i < results.size(); ++i)
+		{
+			const BenchResult& r = results[ i];
+			out << "    { \"structure\": \"" << r.structure << "\", \"workload\": \"" << r.workload
+				<< "\", \"distribution\": \"" << r.distribution << "\", \"items\": " << r.items
+				<< ", \"cache\": " << r.cache << ", \"ops\": " << r.ops << ", \"seconds\": " << r.seconds
+				<< ", \"ops_per_sec\": " << r.ops / max( r.seconds, 1e-9) << " }" << ( i + 1 < results.size() ? ",\n" : "\n");
+		}
+		out << "  ]\n}\n";
+		return !out.fail();
+	}
+};
+
+class BenchTimer
+{
+	chrono::steady_clock::time_point start;
+
+public:
+	BenchTimer(): start( chrono::steady_clock::now()) {}
+	double seconds() const { return chrono::duration<double>( chrono::steady_clock::now() - start).count(); }
+};
+
+// keeps the compiler from dropping the lookups
+static volatile size_t benchSink;
+
+static const char benchFileName[] = "bench.bpt";
+static const char benchCompactFileName[] = "bench_compact.bpt";
+
+/// Inserts keys in the given order into a new file; the time includes closing the tree,
+/// which writes the nodes still in the cache
+static void bench_insert( BenchReport& report, const vector<size_t>& keys, const char* const workload, const size_t cache)
+{
+	fstream file;
+	BpTree::stream_type stream( file);
+	create_bpt( benchFileName, file);
+	if ( file.is_open())
+	{
+		const BenchTimer timer;
+		{
+			BpTree bpt( cache);
+			bpt.open( stream);
+			for( size_t i = 0; i < keys.size(); ++i)
+			{
+				*bpt.insert( keys[ i]) = keys[ i];
+			}
+		}
+		report.add( "bp_tree", workload, "-", keys.size(), cache, keys.size(), timer.seconds());
+	}
+}
+
+/// Lookups, scans and compaction over the file left by bench_insert, reopened with a cold cache
+static void bench_read( BenchReport& report, const vector<size_t>& sorted, const size_t cache)
+{
+	fstream file;
+	BpTree::stream_type stream( file);
+	open_bpt( benchFileName, file);
+	if ( !file.is_open())
+	{
+		return;
+	}
+	file.seekg( 0, ios::end);
+	const streamsize fileSize = file.tellg();
+	file.seekg( 0, ios::beg);
+
+	BpTree bpt( cache);
+	if ( !bpt.open( stream, fileSize))
+	{
+		return;
+	}
+
+	const size_t n = sorted.size();
+	for( int d = 0; d < bench_distributions; ++d)
+	{
+		const vector<size_t> probes = bench_probes( n, n, BenchDistribution( d), 17 + d);
+		size_t sum = 0;
+		const BenchTimer timer;
+		for( size_t i = 0; i < probes.size(); ++i)
+		{
+			const BpTree::const_iterator it = bpt.find( sorted[ probes[ i]]);
+			sum += it ? *it : 0;
+		}
+		report.add( "bp_tree", "find", benchDistributionNames[ d], n, cache, probes.size(), timer.seconds());
+		benchSink = sum;
+	}
+
+	{
+		size_t sum = 0, count = 0;
+		const BenchTimer timer;
+		for( BpTree::const_iterator i = bpt.begin(); i != bpt.end(); ++i, ++count)
+		{
+			sum += *i;
+		}
+		report.add( "bp_tree", "scan_forward", "sequential", n, cache, count, timer.seconds());
+		benchSink = sum;
+	}
+
+	{
+		size_t sum = 0, count = 0;
+		const BenchTimer timer;
+		for( BpTree::const_reverse_iterator i = bpt.rbegin(); i != bpt.rend(); ++i, ++count)
+		{
+			sum += *i;
+		}
+		report.add( "bp_tree", "scan_reverse", "sequential", n, cache, count, timer.seconds());
+		benchSink = sum;
+	}
+
+	{
+		const BenchTimer timer;
+		compact_bpt( bpt, benchCompactFileName);
+		report.add( "bp_tree", "compact_to", "-", n, cache, n, timer.seconds());
+	}
+}
+
+/// The same workloads on std::map, the in-memory baseline
+static void bench_map( BenchReport& report, const vector<size_t>& sorted, const vector<size_t>& shuffled)
+{
+	typedef map<size_t, size_t> Map;
+	const size_t n = sorted.size();
+
+	{
+		Map m;
+		const BenchTimer timer;
+		for( size_t i = 0; i < n; ++i)
+		{
+			m[ sorted[ i]] = sorted[ i];
+		}
+		report.add( "std::map", "insert_sequential", "-", n, 0, n, timer.seconds());
+	}
+
+	Map m;
+	{
+		const BenchTimer timer;
+		for( size_t i = 0; i < n; ++i)
+		{
+			m[ shuffled[ i]] = shuffled[ i];
+		}
+		report.add( "std::map", "insert_random", "-", n, 0, n, timer.seconds());
+	}
+
+	for( int d = 0; d < bench_distributions; ++d)
+	{
+		const vector<size_t> probes = bench_probes( n, n, BenchDistribution( d), 17 + d);
+		size_t sum = 0;
+		const BenchTimer timer;
+		for( size_t i = 0; i < probes.size(); ++i)
+		{
+			const Map::const_iterator it = m.find( sorted[ probes[ i]]);
+			sum += it != m.end() ? it->second : 0;
+		}
+		report.add( "std::map", "find", benchDistributionNames[ d], n, 0, probes.size(), timer.seconds());
+		benchSink = sum;
+	}
+
+	{
+		size_t sum = 0;
+		const BenchTimer timer;
+		for( Map::const_iterator i = m.begin(); i != m.end(); ++i)
+		{
+			sum += i->second;
+		}
+		report.add( "std::map", "scan_forward", "sequential", n, 0, n, timer.seconds());
+		benchSink = sum;
+	}
+
+	{
+		size_t sum = 0;
+		const BenchTimer timer;
+		for( Map::const_reverse_iterator i = m.rbegin(); i != m.rend(); ++i)
+		{
+			sum += i->second;
+		}
+		report.add( "std::map", "scan_reverse", "sequential", n, 0, n, timer.seconds());
+		benchSink = sum;
+	}
+}
+
+/// Runs every workload for each dataset size and cache size (in nodes) and writes the
+/// results to outFileName as JSON. Seeds are fixed, so two runs do the same operations.
+/// The larger datasets hold many times more leaves than the smaller caches.
+void bench_suite( const char* outFileName)
+{
+	const size_t itemCounts[] = { 100000, 1000000 };
+	const size_t cacheSizes[] = { 64, 1024, 16384 };
+
+	BenchReport report;
+	for( size_t s = 0; s < sizeof( itemCounts) / sizeof( itemCounts[ 0]); ++s)
+	{
+		const size_t n = itemCounts[ s];
+
+		// distinct keys spread over the key space, and the same keys in a fixed random order
+		vector<size_t> sorted( n);
+		for( size_t i = 0; i < n; ++i)
+		{
+			sorted[ i] = i * 7 + 3;
+		}
+		vector<size_t> shuffled( sorted);
+		BenchRandom random( 42);
+		for( size_t i = n; i > 1; --i)
+		{
+			swap( shuffled[ i - 1], shuffled[ random.below( i)]);
+		}
+
+		for( size_t c = 0; c < sizeof( cacheSizes) / sizeof( cacheSizes[ 0]); ++c)
+		{
+			bench_insert( report, sorted, "insert_sequential", cacheSizes[ c]);
+			bench_insert( report, shuffled, "insert_random", cacheSizes[ c]);
+			bench_read( report, sorted, cacheSizes[ c]);
+		}
+		bench_map( report, sorted, shuffled);
+	}
+
+	if ( !report.write( outFileName))
+	{
+		cerr << "cannot write " << outFileName << '\n';
+	}
+}
@@ -1,7 +1,35 @@
 ﻿#include "test_bp_tree.h"
+#include <string.h>
 
-int main()
+/// "bench [results.json]" runs only the benchmark suite; anything else runs the tests
+int main( int argc, char* argv[])
 {
+	if ( argc > 1 && strcmp( argv[ 1], "bench") == 0)
+	{
+		bench_suite( argc > 2 ? argv[ 2] : "bench_results.json");
+		return 0;
+	}
 	simple_test();
+	bulk_load_test();
+	erase_test();
+	range_test();
+	batch_test();
+	multi_get_test();
+	verify_test();
+	mmap_test();
+	pio_test();
+	wal_test();
+	wal_reopen_test();
+	format_test();
+	stats_test();
+	cache_policy_test();
+	page_test();
+	flusher_test();
+	checkpoint_test();
+	snapshot_test();
+	compact_parallel_test();
+	node_pool_test();
+	bench_key_search();
+	bench_concurrent_find();
 	return 0;
 }
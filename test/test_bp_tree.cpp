@@ -1,12 +1,20 @@
 ﻿#pragma once
 #include "test_bp_tree.h"
+#include "bp_tree_mmap_stream.h"
+#include "bp_tree_pio_stream.h"
+#include <atomic>
 #include <fstream>
+#include <map>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
 #include <fstream>
 
 using namespace std;
 
-void fill( BpTree& bpt)
+void fill( BpTree& bpt, ItemMap& m)
 {
 	typedef std::set<size_t> Set;
 	Set s;
@@ -21,6 +29,63 @@ void fill( BpTree& bpt)
 	for( Set::const_iterator i = s.begin(); i != s.end(); ++i)
 	{
 		*bpt.insert( *i) = *i;
+		m[ *i] = *i;
+	}
+}
+
+void bulk_fill( BpTree& bpt, ItemMap& m, const float fill)
+{
+	const int n = 20000;
+	for( int i = 0; i < n; ++i)
+	{
+		const size_t key = rand();
+		m[ key] = key;
+	}
+
+	bpt.bulk_load( m.begin(), m.end(), fill);
+}
+
+void batch_fill( BpTree& bpt, ItemMap& m)
+{
+	typedef std::vector<std::pair<size_t, size_t> > Items;
+	Items items;
+
+	// in random order, without the keys already in the tree
+	const int n = 20000;
+	for( int i = 0; i < n; ++i)
+	{
+		const size_t key = rand();
+		if ( m.insert( std::make_pair( key, key)).second)
+		{
+			items.push_back( std::make_pair( key, key));
+		}
+	}
+
+	bpt.insert_batch( items.begin(), items.end());
+}
+
+void erase_some( BpTree& bpt, ItemMap& m)
+{
+	typedef std::vector<size_t> Keys;
+	Keys keys;
+
+	for( BpTree::const_iterator i = bpt.begin(); i != bpt.end(); ++i)
+	{
+		keys.push_back( i.key());
+	}
+
+	// every other key, then a whole range
+	for( Keys::size_type i = 0; i < keys.size(); i += 2)
+	{
+		assert( bpt.erase( keys[ i]) == m.erase( keys[ i]));
+	}
+
+	if ( keys.size() > 2)
+	{
+		const size_t a = keys[ keys.size() / 4], b = keys[ keys.size() / 2];
+		const size_t count = std::distance( m.lower_bound( a), m.lower_bound( b));
+		assert( bpt.erase( a, b) == count);
+		m.erase( m.lower_bound( a), m.lower_bound( b));
 	}
 }
 
@@ -40,6 +105,82 @@ void iterate_backward( BpTree& bpt)
 	}
 }
 
+typedef std::vector<std::pair<size_t, size_t> > Items;
+
+struct ItemCollector
+{
+	Items& items;
+
+	ItemCollector( Items& items): items( items) {}
+	void operator () ( const size_t& key, const size_t& value) { items.push_back( std::make_pair( key, value)); }
+};
+
+// it is at the item of i, or both are at the end
+static bool same_item( const BpTree& bpt, const BpTree::const_iterator& it, const ItemMap& m, const ItemMap::const_iterator& i)
+{
+	return i == m.end() ? it == bpt.end() : it && it.key() == i->first && *it == i->second;
+}
+
+/// lower_bound, upper_bound, equal_range and scan agree with a std::map of the same items
+void range_queries( const BpTree& bpt, const ItemMap& m)
+{
+	for( int n = 0; n < 1000; ++n)
+	{
+		// every other key is one of the tree
+		const ItemMap::const_iterator near = m.lower_bound( rand());
+		const size_t key = n % 2 && near != m.end() ? near->first : rand();
+
+		const BpTree::const_iterator lower = bpt.lower_bound( key), upper = bpt.upper_bound( key);
+		assert( same_item( bpt, lower, m, m.lower_bound( key)));
+		assert( same_item( bpt, upper, m, m.upper_bound( key)));
+		const std::pair<BpTree::const_iterator, BpTree::const_iterator> range = bpt.equal_range( key);
+		assert( range.first == lower && range.second == upper);
+	}
+
+	for( int n = 0; n < 100; ++n)
+	{
+		const size_t a = rand(), b = rand();
+		const size_t from = std::min( a, b), to = std::max( a, b);
+		Items items;
+		assert( bpt.scan( from, to, ItemCollector( items)) == items.size());
+		assert( items == Items( m.lower_bound( from), m.lower_bound( to)));
+	}
+
+	Items items;
+	assert( bpt.scan( 0, size_t( -1), ItemCollector( items)) == m.size());
+	assert( items == Items( m.begin(), m.end()));
+}
+
+/// find_many agrees with find and with a std::map of the same items, for unsorted keys
+/// with repeats, half of them in the tree
+void multi_get( const BpTree& bpt, const ItemMap& m)
+{
+	std::vector<size_t> keys;
+	for( int i = 0; i < 1000; ++i)
+	{
+		const ItemMap::const_iterator near = m.lower_bound( rand());
+		keys.push_back( i % 2 && near != m.end() ? near->first : rand());
+	}
+	keys.insert( keys.end(), keys.begin(), keys.begin() + 100);
+
+	std::vector<std::pair<bool, size_t> > results;
+	const size_t found = bpt.find_many( keys.begin(), keys.end(), results);
+	assert( results.size() == keys.size());
+	size_t expected = 0;
+	for( size_t i = 0; i < keys.size(); ++i)
+	{
+		const BpTree::const_iterator it = bpt.find( keys[ i]);
+		const ItemMap::const_iterator item = m.find( keys[ i]);
+		assert( results[ i].first == ( it != bpt.end()) && results[ i].first == ( item != m.end()));
+		if ( it)
+		{
+			assert( results[ i].second == *it && results[ i].second == item->second);
+			++expected;
+		}
+	}
+	assert( found == expected);
+}
+
 void create_bpt( const char* fileName, fstream& bptFile)
 {
 	bptFile.open( fileName, ios_base::in | ios_base::out | ios_base::binary | ios_base::trunc, 64);
@@ -50,7 +191,48 @@ void open_bpt( const char* fileName, fstream& bptFile)
 	bptFile.open( fileName, ios_base::in | ios_base::binary, 64);
 }
 
-void compact_bpt( BpTree& bpt, const char* fileName)
+void reopen_bpt( const char* fileName, fstream& bptFile)
+{
+	bptFile.open( fileName, ios_base::in | ios_base::out | ios_base::binary, 64);
+}
+
+/// The tree holds exactly the items of m, in key order, and finds each of them
+template <typename _Tree>
+static void check_items( const _Tree& bpt, const ItemMap& m)
+{
+	assert( bpt.size() == m.size());
+	typename _Tree::const_iterator it = bpt.begin();
+	for( ItemMap::const_iterator i = m.begin(); i != m.end(); ++i, ++it)
+	{
+		assert( it && it.key() == i->first && *it == i->second);
+		const typename _Tree::const_iterator found = bpt.find( i->first);
+		assert( found && *found == i->second);
+	}
+	assert( it == bpt.end());
+}
+
+/// n puts of random keys, every fourth operation erasing a key of the tree instead
+template <typename _Tree>
+static void put_erase( _Tree& bpt, ItemMap& m, const int n)
+{
+	for( int i = 0; i < n; ++i)
+	{
+		const size_t key = rand();
+		const ItemMap::iterator near = m.lower_bound( key);
+		if ( i % 4 == 3 && near != m.end())
+		{
+			assert( bpt.erase( near->first) == 1);
+			m.erase( near);
+		}
+		else
+		{
+			bpt.put( key, i);
+			m[ key] = i;
+		}
+	}
+}
+
+void compact_bpt( BpTree& bpt, const char* fileName, const bool bitPack)
 {
 	fstream out;
 	BpTree::stream_type stream( out);
@@ -59,19 +241,87 @@ void compact_bpt( BpTree& bpt, const char* fileName)
 
 	if ( out.is_open())
 	{
-		bpt.compact_to( stream);
+		bpt.compact_to( stream, bitPack);
+	}
+}
+
+/// The compact file holds the same items as the tree and finds them through its packed separators;
+/// its leaves end the file
+void check_compact( BpTree& bpt, const char* fileName)
+{
+	fstream file;
+	BpTree::stream_type stream( file);
+	open_bpt( fileName, file);
+	if ( !file.is_open())
+	{
+		return;
+	}
+
+	file.seekg( 0, ios::end);
+	const streamsize fileSize = file.tellg();
+	file.seekg( 0, ios::beg);
+	BpTree compact( 512);
+	if ( compact.open( stream, fileSize))
+	{
+		assert( compact.size() == bpt.size());
+		const pair<size_t, size_t> leaves = compact.leaf_extent();
+		assert( leaves.first < leaves.second && leaves.second == size_t( fileSize));
+		BpTree::const_iterator j = compact.begin();
+		for( BpTree::const_iterator i = bpt.begin(); i != bpt.end(); ++i, ++j)
+		{
+			assert( j && j.key() == i.key() && *j == *i);
+			const BpTree::const_iterator found = compact.find( i.key());
+			assert( found && *found == *i);
+		}
+		assert( j == compact.end());
+	}
+}
+
+struct VerifyStreams
+{
+	BpTree::stream_type** streams;
+
+	BpTree::stream_type& operator () ( const size_t i) const { return *streams[ i]; }
+};
+
+/// verify over a file just opened, each worker reading its own handle; true if corrupt is empty
+bool verify_bpt( const BpTree& bpt, const char* fileName, std::vector<size_t>& corrupt)
+{
+	const size_t threads = 4;
+	fstream files[ threads];
+	BpTree::stream_type* streams[ threads];
+	for( size_t i = 0; i < threads; ++i)
+	{
+		open_bpt( fileName, files[ i]);
+		streams[ i] = new BpTree::stream_type( files[ i]);
+	}
+
+	const VerifyStreams streamOf = { streams };
+	const bool ok = bpt.verify( streamOf, corrupt, threads);
+	assert( ok == corrupt.empty());
+
+	for( size_t i = 0; i < threads; ++i)
+	{
+		delete streams[ i];
 	}
+	return ok;
 }
 
 void simple_test()
 {
 	const char defaultFileName[] = "default.bpt";
 	const char compactFileName[] = "compact.bpt";
+	const char bitPackedFileName[] = "compact_bits.bpt";
 
 	fstream bptFile;
 	BpTree::stream_type stream( bptFile);
+	const char* fileName = defaultFileName;
+	ItemMap m;
 
 	bool newFile = false;
+	bool bulkLoad = false;
+	bool batchInsert = false;
+	bool eraseItems = false;
 	bool compactFile = false;
 
 	if ( newFile)
@@ -83,6 +333,7 @@ void simple_test()
 		open_bpt( defaultFileName, bptFile);
 		if ( !bptFile.is_open())
 		{
+			fileName = compactFileName;
 			open_bpt( compactFileName, bptFile);
 		}
 	}
@@ -96,17 +347,1310 @@ void simple_test()
 		bptFile.seekg( 0, ios::beg);
 		bpt.open( stream, fileSize);
 
+		if ( !newFile)
+		{
+			std::vector<size_t> corrupt;
+			assert( verify_bpt( bpt, fileName, corrupt) && bpt.corrupt_nodes().empty());
+			for( BpTree::const_iterator i = bpt.begin(); i != bpt.end(); ++i)
+			{
+				m[ i.key()] = *i;
+			}
+		}
+
 		if ( newFile)
 		{
-			fill( bpt);
+			if ( bulkLoad)
+			{
+				bulk_fill( bpt, m);
+			}
+			else if ( batchInsert)
+			{
+				batch_fill( bpt, m);
+			}
+			else
+			{
+				fill( bpt, m);
+			}
+		}
+
+		if ( eraseItems)
+		{
+			erase_some( bpt, m);
 		}
 
 		iterate_forward( bpt);
 		iterate_backward( bpt);
+		range_queries( bpt, m);
+		multi_get( bpt, m);
 
 		if ( compactFile)
 		{
-			compact_bpt( bpt, compactFileName);
+			compact_bpt( bpt, compactFileName, false);
+			check_compact( bpt, compactFileName);
+			compact_bpt( bpt, bitPackedFileName, true);
+			check_compact( bpt, bitPackedFileName);
+		}
+	}
+}
+
+/// Bulk loads a tree with room left in its nodes, inserts between the loaded keys, then
+/// reopens the file; the tree holds the items of a std::map filled alongside throughout
+void bulk_load_test()
+{
+	const char fileName[] = "bulk.bpt";
+
+	ItemMap m;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		bulk_fill( bpt, m, 0.75f);
+		check_items( bpt, m);
+
+		for( int i = 0; i < 5000; ++i)
+		{
+			const size_t key = rand();
+			// insert adds a second item for a key it already holds
+			if ( m.insert( std::make_pair( key, key + 1)).second)
+			{
+				*bpt.insert( key) = key + 1;
+			}
+		}
+		check_items( bpt, m);
+	}
+
+	fstream bptFile;
+	reopen_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 64);
+	assert( bpt.open( stream, fileSize));
+	check_items( bpt, m);
+}
+
+/// Erases keys one by one and by range, merging nodes, then reopens the file and inserts fewer
+/// keys than were erased: the nodes freed by the erases are reused and the file does not grow
+void erase_test()
+{
+	const char fileName[] = "erase.bpt";
+
+	ItemMap m;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		fill( bpt, m);
+		const size_t n = m.size();
+		erase_some( bpt, m);
+		assert( m.size() < n / 2);
+		check_items( bpt, m);
+		assert( bpt.erase( m.begin()->first) == 1 && !bpt.erase( m.begin()->first));
+		m.erase( m.begin());
+	}
+
+	fstream bptFile;
+	reopen_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize erasedSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+	{
+		BpTree::stream_type stream( bptFile);
+		BpTree bpt( 64);
+		assert( bpt.open( stream, erasedSize));
+		check_items( bpt, m);
+		const size_t count = m.size() / 2;
+		while( m.size() < count * 3)
+		{
+			const size_t key = rand();
+			if ( m.insert( std::make_pair( key, key + 1)).second)
+			{
+				*bpt.insert( key) = key + 1;
+			}
+		}
+		check_items( bpt, m);
+	}
+
+	bptFile.seekg( 0, ios::end);
+	assert( bptFile.tellg() == erasedSize);
+}
+
+/// Runs the range queries over a new file against a std::map, once filled and again once
+/// erases have merged its leaves
+void range_test()
+{
+	const char fileName[] = "range.bpt";
+
+	fstream bptFile;
+	BpTree::stream_type stream( bptFile);
+	create_bpt( fileName, bptFile);
+	BpTree bpt( 64);
+	if ( !bptFile.is_open() || !bpt.open( stream))
+	{
+		return;
+	}
+
+	ItemMap m;
+	fill( bpt, m);
+	range_queries( bpt, m);
+	erase_some( bpt, m);
+	range_queries( bpt, m);
+}
+
+/// Inserts an unsorted batch between the keys of a filled tree and a sorted one past them,
+/// then reopens the file; the tree holds the items of a std::map filled alongside
+void batch_test()
+{
+	const char fileName[] = "batch.bpt";
+
+	ItemMap m;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		fill( bpt, m);
+		batch_fill( bpt, m);
+		check_items( bpt, m);
+
+		Items items;
+		for( size_t i = 0; i < 5000; ++i)
+		{
+			items.push_back( std::make_pair( size_t( RAND_MAX) + 1 + i * 3, i));
+			m[ items.back().first] = i;
+		}
+		bpt.insert_batch( items.begin(), items.end());
+		check_items( bpt, m);
+	}
+
+	fstream bptFile;
+	reopen_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 64);
+	assert( bpt.open( stream, fileSize));
+	check_items( bpt, m);
+}
+
+/// Fills a file, reopens it through a cache too small for its inner nodes and runs batched
+/// lookups that load the nodes on their way
+void multi_get_test()
+{
+	const char fileName[] = "multi_get.bpt";
+
+	ItemMap m;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		fill( bpt, m);
+		multi_get( bpt, m);
+	}
+
+	fstream bptFile;
+	open_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 4);
+	assert( bpt.open( stream, fileSize));
+	multi_get( bpt, m);
+	multi_get( bpt, m);
+}
+
+/// Verifies a new file, then flips a bit of a value in one of its leaves: verify reports the
+/// leaf alone and finding the key through it records the leaf as corrupt
+void verify_test()
+{
+	const char fileName[] = "verify.bpt";
+	const size_t marker = size_t( 0x5eedf00d5eedf00dull);
+
+	ItemMap m;
+	size_t key = 0;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		fill( bpt, m);
+		// a key in the middle, away from the leaves kept in the header
+		ItemMap::iterator item = m.begin();
+		std::advance( item, m.size() / 2);
+		key = item->first;
+		item->second = marker;
+		bpt.put( key, marker);
+	}
+
+	fstream bptFile;
+	reopen_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+	{
+		BpTree::stream_type stream( bptFile);
+		BpTree bpt( 64);
+		assert( bpt.open( stream, fileSize));
+		std::vector<size_t> corrupt;
+		assert( verify_bpt( bpt, fileName, corrupt));
+		check_items( bpt, m);
+	}
+
+	std::vector<char> bytes( ( size_t( fileSize)));
+	bptFile.seekg( 0, ios::beg);
+	bptFile.read( &bytes[ 0], fileSize);
+	size_t pos = 0;
+	while( pos + sizeof( marker) <= bytes.size() && memcmp( &bytes[ pos], &marker, sizeof( marker)))
+	{
+		++pos;
+	}
+	assert( pos + sizeof( marker) <= bytes.size());
+	bytes[ pos] ^= 1;
+	bptFile.seekp( 0, ios::beg);
+	bptFile.write( &bytes[ 0], fileSize);
+	bptFile.flush();
+	bptFile.seekg( 0, ios::beg);
+
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 64);
+	assert( bpt.open( stream, fileSize));
+	std::vector<size_t> corrupt;
+	assert( !verify_bpt( bpt, fileName, corrupt));
+	assert( corrupt.size() == 1 && corrupt[ 0] < pos);
+	assert( bpt.corrupt_nodes().empty());
+	bpt.find( key);
+	assert( bpt.corrupt_nodes() == corrupt);
+}
+
+typedef stdext::bp_tree<size_t, size_t, stdext::bp_tree_default_traits,
+	stdext::bp_tree_mmap_stream<size_t, size_t, stdext::bp_tree_default_traits::bitmap_type> > MmapBpTree;
+
+/// Writes a new file through the memory mapped stream, reopens it to change it and again read
+/// only; the mapping grows past its initial size and the file is cut to its logical end on close
+void mmap_test()
+{
+	const char fileName[] = "mmap.bpt";
+
+	ItemMap m;
+	{
+		MmapBpTree::stream_type stream( fileName, true);
+		MmapBpTree bpt( 64);
+		if ( !stream.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		put_erase( bpt, m, 100000);
+		check_items( bpt, m);
+	}
+
+	{
+		MmapBpTree::stream_type stream( fileName);
+		MmapBpTree bpt( 64);
+		assert( stream.is_open() && bpt.open( stream, stream.size()));
+		check_items( bpt, m);
+		put_erase( bpt, m, 10000);
+		check_items( bpt, m);
+	}
+
+	MmapBpTree::stream_type stream( fileName, false, true);
+	MmapBpTree bpt( 64);
+	assert( stream.is_open() && bpt.open( stream, stream.size()));
+	check_items( bpt, m);
+}
+
+typedef stdext::bp_tree<size_t, size_t, stdext::bp_tree_default_traits,
+	stdext::bp_tree_pio_stream<size_t, size_t, stdext::bp_tree_default_traits::bitmap_type> > PioBpTree;
+
+struct PioVerifyStreams
+{
+	PioBpTree::stream_type** streams;
+
+	PioBpTree::stream_type& operator () ( const size_t i) const { return *streams[ i]; }
+};
+
+// Writes a new file through the pio stream and reopens it with a log: the stream syncs to the
+// disk, so a checkpoint empties the log. Opens it once more read only and verifies it through
+// views sharing the file.
+static void check_pio( const char* fileName, const char* walFileName, const bool direct)
+{
+	ItemMap m;
+	{
+		PioBpTree::stream_type stream( fileName, true, false, direct);
+		PioBpTree bpt( 64);
+		if ( !stream.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		put_erase( bpt, m, 40000);
+		check_items( bpt, m);
+	}
+
+	remove( walFileName);
+	{
+		PioBpTree::stream_type stream( fileName, false, false, direct);
+		PioBpTree::wal_type wal( walFileName);
+		PioBpTree bpt( 64);
+		assert( stream.is_open() && wal.is_open() && bpt.open( stream, stream.size(), &wal));
+		check_items( bpt, m);
+		put_erase( bpt, m, 10000);
+		assert( bpt.checkpoint());
+
+		fstream log;
+		log.open( walFileName, ios_base::in | ios_base::binary);
+		log.seekg( 0, ios::end);
+		assert( log.tellg() == 0);
+
+		put_erase( bpt, m, 1000);
+		check_items( bpt, m);
+	}
+
+	const size_t threads = 4;
+	PioBpTree::stream_type stream( fileName, false, true, direct);
+	PioBpTree bpt( 64);
+	assert( stream.is_open() && bpt.open( stream, stream.size()));
+	check_items( bpt, m);
+
+	PioBpTree::stream_type* streams[ threads];
+	for( size_t i = 0; i < threads; ++i)
+	{
+		streams[ i] = new PioBpTree::stream_type( stream, PioBpTree::stream_type::shared());
+	}
+	std::vector<size_t> corrupt;
+	const PioVerifyStreams streamOf = { streams };
+	assert( bpt.verify( streamOf, corrupt, threads) && corrupt.empty());
+	for( size_t i = 0; i < threads; ++i)
+	{
+		delete streams[ i];
+	}
+}
+
+/// A tree over the pio stream, with buffered and with direct I/O
+void pio_test()
+{
+	check_pio( "pio.bpt", "pio.log", false);
+	check_pio( "pio_direct.bpt", "pio_direct.log", true);
+}
+
+// recovers the tree in fileName from its log and checks it holds the items of m
+static void check_wal( const char* fileName, const char* walFileName, const ItemMap& m)
+{
+	PioBpTree::stream_type stream( fileName);
+	PioBpTree::wal_type wal( walFileName);
+	PioBpTree bpt( 512);
+	assert( stream.is_open() && wal.is_open() && bpt.open( stream, stream.size(), &wal));
+	check_items( bpt, m);
+}
+
+// size of the file, 0 if there is none
+static streamsize file_size( const char* fileName)
+{
+	fstream file;
+	file.open( fileName, ios_base::in | ios_base::binary);
+	file.seekg( 0, ios::end);
+	return file.is_open() ? streamsize( file.tellg()) : 0;
+}
+
+/// Fills a tree and closes it, then logs puts, erases and a batch around a checkpoint to it
+/// through a small cache, drops the tree as in a crash and recovers it from the log on the
+/// same file, twice
+void wal_test()
+{
+	const char walFileName[] = "wal.log";
+	const char fileName[] = "wal.bpt";
+	remove( walFileName);
+
+	ItemMap m;
+	{
+		PioBpTree::stream_type stream( fileName, true);
+		PioBpTree bpt( 512);
+		if ( !stream.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		for( int i = 0; i < 20000; ++i)
+		{
+			const size_t key = rand();
+			bpt.put( key, i);
+			m[ key] = i;
+		}
+	}
+
+	{
+		// the writes still buffered by the stream are lost as well
+		PioBpTree::stream_type* const stream = new PioBpTree::stream_type( fileName);
+		PioBpTree::wal_type* const wal = new PioBpTree::wal_type( walFileName);
+		PioBpTree* const bpt = new PioBpTree( 32);
+		assert( stream->is_open() && wal->is_open() && bpt->open( *stream, stream->size(), wal));
+
+		// the nodes of the file are overwritten in place, before and after the checkpoint
+		for( int i = 0; i < 20000; ++i)
+		{
+			const ItemMap::const_iterator near = m.lower_bound( rand());
+			const size_t key = i % 2 && near != m.end() ? near->first : rand();
+			if ( i % 4 == 3)
+			{
+				bpt->erase( key);
+				m.erase( key);
+			}
+			else
+			{
+				bpt->put( key, i);
+				m[ key] = i;
+			}
+			if ( i == 10000)
+			{
+				assert( bpt->checkpoint());
+			}
+		}
+		// keys past those of rand(), inserted by a batch
+		std::vector<std::pair<size_t, size_t> > batch;
+		for( size_t i = 0; i < 3000; ++i)
+		{
+			batch.push_back( std::make_pair( size_t( RAND_MAX) + 1 + i * 7, i));
+			m[ batch.back().first] = i;
+		}
+		bpt->insert_batch( batch.begin(), batch.end());
+		wal->commit();
+		// neither the tree, the stream nor the log are closed
+	}
+
+	// the recovered tree is closed cleanly and empties the log, the file holds the items then
+	check_wal( fileName, walFileName, m);
+	assert( file_size( walFileName) == 0);
+	check_wal( fileName, walFileName, m);
+}
+
+/// A bulk load logged before a crash is recovered. Once a clean close truncated the log, it
+/// holds nothing to roll back the items inserted without it, which the next open with the
+/// log keeps. A log is refused over a stream whose sync does not reach the disk.
+void wal_reopen_test()
+{
+	const char walFileName[] = "wal_reopen.log";
+	const char fileName[] = "wal_reopen.bpt";
+	remove( walFileName);
+
+	ItemMap m;
+	{
+		PioBpTree::stream_type* const stream = new PioBpTree::stream_type( fileName, true);
+		PioBpTree::wal_type* const wal = new PioBpTree::wal_type( walFileName);
+		PioBpTree* const bpt = new PioBpTree( 64);
+		if ( !stream->is_open() || !wal->is_open() || !bpt->open( *stream, 0, wal))
+		{
+			return;
+		}
+		for( int i = 0; i < 20000; ++i)
+		{
+			m[ rand()] = i;
+		}
+		bpt->bulk_load( m.begin(), m.end());
+		wal->commit();
+		// neither the tree, the stream nor the log are closed
+	}
+
+	check_wal( fileName, walFileName, m);
+	assert( file_size( walFileName) == 0);
+
+	{
+		PioBpTree::stream_type stream( fileName);
+		PioBpTree bpt( 64);
+		assert( stream.is_open() && bpt.open( stream, stream.size()));
+		for( int i = 0; i < 5000; ++i)
+		{
+			const size_t key = rand();
+			if ( m.insert( std::make_pair( key, key + 1)).second)
+			{
+				*bpt.insert( key) = key + 1;
+			}
+		}
+	}
+
+	{
+		PioBpTree::stream_type stream( fileName);
+		PioBpTree::wal_type wal( walFileName);
+		PioBpTree bpt( 64);
+		assert( stream.is_open() && wal.is_open() && bpt.open( stream, stream.size(), &wal));
+		check_items( bpt, m);
+		put_erase( bpt, m, 5000);
+	}
+	assert( file_size( walFileName) == 0);
+	check_wal( fileName, walFileName, m);
+
+	fstream bptFile;
+	BpTree::stream_type stream( bptFile);
+	create_bpt( "wal_refused.bpt", bptFile);
+	BpTree::wal_type wal( walFileName);
+	BpTree bpt( 64);
+	assert( !bpt.open( stream, 0, &wal) && bpt.open_error() == BpTree::bad_log);
+}
+
+// writes header over the start of fileName and opens the tree in it
+static BpTree::open_error_type open_with_header( const char* fileName, const char* header, const size_t size, const size_t count)
+{
+	fstream bptFile;
+	bptFile.open( fileName, ios_base::in | ios_base::out | ios_base::binary);
+	bptFile.write( header, size);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 64);
+	const bool ok = bpt.open( stream, fileSize);
+	assert( ok == ( bpt.open_error() == BpTree::no_error));
+	assert( !ok || bpt.size() == count);
+	return bpt.open_error();
+}
+
+/// Opens a tree whose header claims another format version, the signature of the files written
+/// before the version or no tree at all, then the header as it was
+void format_test()
+{
+	const char fileName[] = "format.bpt";
+	const size_t n = 1000;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		for( size_t i = 0; i < n; ++i)
+		{
+			*bpt.insert( i) = i;
+		}
+	}
+
+	const char version[] = { 'B', 'T', char( BpTree::format_version) };
+	const char older[] = { 'B', 'T', char( BpTree::format_version - 1) };
+	assert( open_with_header( fileName, older, sizeof( older), n) == BpTree::bad_version);
+	assert( open_with_header( fileName, "B+", 2, n) == BpTree::bad_version);
+	assert( open_with_header( fileName, "XY", 2, n) == BpTree::bad_signature);
+	assert( open_with_header( fileName, version, sizeof( version), n) == BpTree::no_error);
+}
+
+struct StatsTraits: stdext::bp_tree_default_traits
+{
+	typedef stdext::bp_tree_stats stats_type;
+};
+
+typedef stdext::bp_tree<size_t, size_t, StatsTraits> StatsBpTree;
+
+/// Fills a tree larger than its cache and checks the counters that must have moved
+void stats_test()
+{
+	const char fileName[] = "stats.bpt";
+	const size_t n = 50000;
+
+	fstream bptFile;
+	StatsBpTree::stream_type stream( bptFile);
+	create_bpt( fileName, bptFile);
+	StatsBpTree bpt( 64);
+	if ( !bptFile.is_open() || !bpt.open( stream))
+	{
+		return;
+	}
+
+	for( size_t i = 0; i < n; ++i)
+	{
+		*bpt.insert( i * 7919 % n) = i;
+	}
+	for( size_t i = 0; i < n; i += 97)
+	{
+		assert( bpt.find( i));
+	}
+
+	const stdext::bp_tree_stats_snapshot stats = bpt.statistics();
+	assert( stats.enabled);
+	assert( stats.splits[ 0] && stats.splits[ 0] >= stats.splits[ 1]);
+	assert( stats.misses[ 0] && stats.total_hits());
+	assert( stats.dirty_evictions && stats.bytes_written && stats.bytes_read);
+
+	size_t finds = 0, inserts = 0;
+	for( size_t i = 0; i < stats.latency_buckets; ++i)
+	{
+		finds += stats.find_latency[ i];
+		inserts += stats.insert_latency[ i];
+	}
+	assert( finds == ( n + 96) / 97 && inserts == n);
+
+	bpt.reset_statistics();
+	assert( bpt.statistics().total_misses() == 0);
+	assert( !BpTree( 1).statistics().enabled);
+
+	// a sorted batch splits its leaves and inner nodes along its path, not through insert()
+	std::vector<std::pair<size_t, size_t> > items;
+	for( size_t i = 0; i < n; ++i)
+	{
+		items.push_back( std::make_pair( n + i, i));
+	}
+	bpt.insert_batch( items.begin(), items.end());
+	const stdext::bp_tree_stats_snapshot batch = bpt.statistics();
+	assert( batch.splits[ 0] && batch.splits[ 1]);
+	for( size_t i = 0; i < batch.latency_buckets; ++i)
+	{
+		assert( !batch.insert_latency[ i]);
+	}
+	assert( bpt.size() == 2 * n);
+	for( size_t i = 0; i < 2 * n; i += 89)
+	{
+		const StatsBpTree::const_iterator it = bpt.find( i);
+		assert( it && ( i < n || *it == i - n));
+	}
+
+	// a range is erased a leaf at a time, not a key at a time
+	bpt.reset_statistics();
+	assert( bpt.erase( n + n / 4, n + n / 2) == n / 4);
+	const stdext::bp_tree_stats_snapshot range = bpt.statistics();
+	assert( range.total_hits() + range.total_misses() < n / 8);
+	assert( bpt.size() == 2 * n - n / 4);
+	assert( bpt.find( n + n / 4 - 1) && !bpt.find( n + n / 4) && !bpt.find( n + n / 2 - 1) && bpt.find( n + n / 2));
+	assert( bpt.erase( n, 3 * n) == n - n / 4 && bpt.size() == n);
+}
+
+typedef stdext::bp_tree<size_t, size_t, StatsTraits, StatsBpTree::stream_type, void, std::allocator<size_t>,
+	stdext::lru_cache_2q_policy> Stats2QBpTree;
+
+// leaf misses of a round of lookups of hot keys spread over the tree in fileName, after the
+// hot keys were looked up a few times and the whole tree was scanned
+template <typename _Tree>
+static size_t misses_after_scan( const char* fileName, const size_t n, const size_t hot)
+{
+	fstream bptFile;
+	open_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+	typename _Tree::stream_type stream( bptFile);
+	_Tree bpt( 64);
+	assert( bpt.open( stream, fileSize));
+
+	for( int round = 0; round < 4; ++round)
+	{
+		for( size_t i = 0; i < hot; ++i)
+		{
+			assert( bpt.find( i * n / hot));
+		}
+	}
+	// find_many pins the leaves it reads, which must not send them back to A1in
+	std::vector<size_t> keys;
+	for( size_t i = 0; i < hot; ++i)
+	{
+		keys.push_back( i * n / hot);
+	}
+	std::vector<std::pair<bool, size_t> > results;
+	assert( bpt.find_many( keys.begin(), keys.end(), results) == hot);
+	Items items;
+	assert( bpt.scan( 0, n, ItemCollector( items)) == n);
+
+	bpt.reset_statistics();
+	for( size_t i = 0; i < hot; ++i)
+	{
+		assert( bpt.find( i * n / hot));
+	}
+	return bpt.statistics().total_misses();
+}
+
+/// A scan of the whole tree evicts the hot nodes from an LRU cache but not from a 2Q one
+void cache_policy_test()
+{
+	const char fileName[] = "policy.bpt";
+	const size_t n = 50000;
+	const size_t hot = 20;
+	{
+		fstream bptFile;
+		BpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		BpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		for( size_t i = 0; i < n; ++i)
+		{
+			*bpt.insert( i * 7919 % n) = i;
+		}
+	}
+
+	const size_t lru = misses_after_scan<StatsBpTree>( fileName, n, hot);
+	const size_t q2 = misses_after_scan<Stats2QBpTree>( fileName, n, hot);
+	assert( lru > hot / 2 && !q2);
+}
+
+struct PageTraits: stdext::bp_tree_default_traits
+{
+	enum { page_size = 4096 };
+};
+
+typedef stdext::bp_tree<size_t, size_t, PageTraits> PageBpTree;
+
+/// Fills a tree of page aligned nodes, reopens it and checks every item; the file must not
+/// open with the default layout
+void page_test()
+{
+	const char fileName[] = "page.bpt";
+	const size_t n = 30000;
+
+	{
+		fstream bptFile;
+		PageBpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		PageBpTree bpt( 64);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		for( size_t i = 0; i < n; ++i)
+		{
+			*bpt.insert( i * 7919 % n) = i;
+		}
+	}
+
+	fstream bptFile;
+	open_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+
+	{
+		PageBpTree::stream_type stream( bptFile);
+		PageBpTree bpt( 64);
+		assert( bpt.open( stream, fileSize));
+		assert( bpt.size() == n);
+		for( size_t i = 0; i < n; ++i)
+		{
+			const PageBpTree::const_iterator it = bpt.find( i * 7919 % n);
+			assert( it && *it == i);
+		}
+	}
+
+	bptFile.clear();
+	bptFile.seekg( 0, ios::beg);
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 64);
+	assert( !bpt.open( stream, fileSize));
+	assert( bpt.open_error() == BpTree::bad_layout);
+}
+
+/// Fills a tree with the background flusher running, with lookups and erases in between,
+/// then reopens the file and checks every item
+template <typename _Tree>
+static void flusher_run( const char* fileName)
+{
+	const size_t n = 60000;
+
+	typedef std::map<size_t, size_t> Map;
+	Map m;
+	{
+		fstream bptFile;
+		typename _Tree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		_Tree bpt( 128);
+		if ( !bptFile.is_open() || !bpt.open( stream) || !bpt.start_flusher())
+		{
+			return;
+		}
+
+		for( size_t i = 0; i < n; ++i)
+		{
+			const size_t key = i * 7919 % n;
+			*bpt.insert( key) = i;
+			m[ key] = i;
+			if ( i % 7 == 0)
+			{
+				const size_t probe = i / 2 * 7919 % n;
+				const Map::const_iterator found = m.find( probe);
+				const typename _Tree::const_iterator it = bpt.find( probe);
+				assert( found == m.end() ? !it : it && *it == found->second);
+			}
+			if ( i % 11 == 0)
+			{
+				bpt.erase( key);
+				m.erase( key);
+			}
+		}
+
+		const stdext::bp_tree_stats_snapshot stats = bpt.statistics();
+		assert( stats.clean_evictions && stats.dirty_evictions * 4 < stats.clean_evictions);
+		bpt.stop_flusher();
+	}
+
+	fstream bptFile;
+	open_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+
+	typename _Tree::stream_type stream( bptFile);
+	_Tree bpt( 128);
+	assert( bpt.open( stream, fileSize));
+	assert( bpt.size() == m.size());
+	for( Map::const_iterator i = m.begin(); i != m.end(); ++i)
+	{
+		const typename _Tree::const_iterator it = bpt.find( i->first);
+		assert( it && *it == i->second);
+	}
+}
+
+void flusher_test()
+{
+	flusher_run<StatsBpTree>( "flusher.bpt");
+	flusher_run<Stats2QBpTree>( "flusher_2q.bpt");
+}
+
+// opens a second tree over the file the writer just checkpointed and checks its items
+static void check_checkpoint( const char* fileName, const size_t count)
+{
+	fstream bptFile;
+	open_bpt( fileName, bptFile);
+	bptFile.seekg( 0, ios::end);
+	const streamsize fileSize = bptFile.tellg();
+	bptFile.seekg( 0, ios::beg);
+
+	BpTree::stream_type stream( bptFile);
+	BpTree bpt( 64);
+	assert( bpt.open( stream, fileSize));
+	assert( bpt.size() == count);
+	for( size_t i = 0; i < count; ++i)
+	{
+		const BpTree::const_iterator it = bpt.find( i * 7919 % count);
+		assert( it && *it == i);
+	}
+}
+
+typedef stdext::bp_tree<size_t, size_t, stdext::bp_tree_default_traits, BpTree::stream_type, void, std::allocator<size_t>,
+	stdext::lru_cache_2q_policy> Q2BpTree;
+
+// checkpoints a tree that keeps being filled and checks the file from a second tree each time
+template <typename _Tree>
+static void checkpoint_fill( const char* fileName)
+{
+	const size_t n = 20000;
+
+	fstream bptFile;
+	typename _Tree::stream_type stream( bptFile);
+	create_bpt( fileName, bptFile);
+	_Tree bpt( 64);
+	if ( !bptFile.is_open() || !bpt.open( stream))
+	{
+		return;
+	}
+
+	for( size_t count = n; count <= 3 * n; count += n)
+	{
+		bpt.clear();
+		for( size_t i = 0; i < count; ++i)
+		{
+			*bpt.insert( i * 7919 % count) = i;
+		}
+		assert( bpt.checkpoint());
+		check_checkpoint( fileName, count);
+		assert( bpt.flush());
+		assert( bpt.find( 0));
+	}
+}
+
+/// Checkpoints with the LRU cache policy and with 2Q, whose new nodes are out of its main queue
+void checkpoint_test()
+{
+	checkpoint_fill<BpTree>( "checkpoint.bpt");
+	checkpoint_fill<Q2BpTree>( "checkpoint_2q.bpt");
+}
+
+// walks a snapshot of the keys [0, count) with value key * 3, a few times over
+void check_snapshot( const BpTree& view, const size_t count, bool& ok)
+{
+	for( int round = 0; round < 4; ++round)
+	{
+		size_t key = 0;
+		for( BpTree::const_iterator i = view.begin(); i != view.end(); ++i, ++key)
+		{
+			ok = ok && i.key() == key && *i == key * 3;
+		}
+		ok = ok && key == count;
+	}
+}
+
+/// Reads a snapshot from another thread while the tree it was taken of is rewritten through
+/// a small cache, reads it again after a checkpoint of the tree, then checks the tree; a
+/// snapshot allowed a few images expires as the tree is rewritten
+void snapshot_test()
+{
+	const char fileName[] = "snapshot.bpt";
+	const size_t n = 30000;
+
+	fstream bptFile;
+	BpTree::stream_type stream( bptFile);
+	create_bpt( fileName, bptFile);
+	BpTree bpt( 64);
+	if ( !bptFile.is_open() || !bpt.open( stream))
+	{
+		return;
+	}
+	for( size_t i = 0; i < n; ++i)
+	{
+		*bpt.insert( i) = i * 3;
+	}
+
+	{
+		fstream viewFile;
+		open_bpt( fileName, viewFile);
+		BpTree::stream_type viewStream( viewFile);
+		BpTree view( 32);
+		assert( bpt.snapshot( view, viewStream));
+		assert( view.size() == n);
+
+		// a leaf changed in the cache only, the checkpoint writes it
+		bool ok = true;
+		assert( bpt.erase( n / 2));
+		*bpt.insert( n / 2) = 1;
+		assert( bpt.checkpoint());
+		check_snapshot( view, n, ok);
+		assert( ok);
+
+		thread reader( check_snapshot, cref( view), n, ref( ok));
+		for( size_t i = 0; i < n; ++i)
+		{
+			const size_t key = i * 7919 % n;
+			bpt.erase( key);
+			if ( key % 3 == 0)
+			{
+				*bpt.insert( key) = key;
+			}
+			*bpt.insert( n + i) = i;
+		}
+		reader.join();
+		assert( ok);
+
+		// checkpoint writes the nodes still dirty in the cache, keeping their images as well
+		assert( bpt.checkpoint());
+		check_snapshot( view, n, ok);
+		assert( ok && !view.snapshot_expired());
+	}
+
+	for( size_t key = 0; key < n; ++key)
+	{
+		const BpTree::const_iterator it = bpt.find( key);
+		assert( key % 3 ? !it : it && *it == key);
+	}
+	assert( bpt.size() == n / 3 + n);
+
+	{
+		fstream viewFile;
+		open_bpt( fileName, viewFile);
+		BpTree::stream_type viewStream( viewFile);
+		BpTree view( 32);
+		assert( bpt.snapshot( view, viewStream, 16));
+		for( size_t key = 0; key < n && !view.snapshot_expired(); key += 3)
+		{
+			assert( bpt.erase( key));
+			*bpt.insert( key) = key + 1;
+			assert( bpt.checkpoint());
+		}
+		assert( view.snapshot_expired());
+	}
+	assert( !bpt.find( 1) && *bpt.find( 0) == 1);
+}
+
+template <typename _Stream>
+struct ViewStreams
+{
+	_Stream** streams;
+
+	_Stream& operator () ( const size_t i) const { return *streams[ i]; }
+};
+
+// Copies the items of bpt to a tree over the file stream of _Tree and compacts it in parallel,
+// the workers reading and writing through views of the tree's stream and of the output's,
+// which is closed last. The output holds bpt's items and ends where its leaves do.
+template <typename _Tree>
+static void compact_views( BpTree& bpt, const char* fileName, const char* compactFileName, const size_t threads)
+{
+	typedef typename _Tree::stream_type Stream;
+	{
+		Stream stream( fileName, true);
+		_Tree tree( 64);
+		if ( !stream.is_open() || !tree.open( stream))
+		{
+			return;
+		}
+		for( BpTree::const_iterator i = bpt.begin(); i != bpt.end(); ++i)
+		{
+			*tree.insert( i.key()) = *i;
+		}
+
+		Stream out( compactFileName, true);
+		std::vector<Stream*> inStreams, outStreams;
+		for( size_t i = 0; i < threads; ++i)
+		{
+			inStreams.push_back( new Stream( stream, typename Stream::shared()));
+			outStreams.push_back( new Stream( out, typename Stream::shared(), true));
+		}
+		const ViewStreams<Stream> inOf = { &inStreams[ 0] };
+		const ViewStreams<Stream> outOf = { &outStreams[ 0] };
+		assert( tree.compact_to( out, inOf, outOf, false, threads));
+		for( size_t i = 0; i < threads; ++i)
+		{
+			delete inStreams[ i];
+			delete outStreams[ i];
+		}
+	}
+	check_compact( bpt, compactFileName);
+}
+
+/// The parallel compact_to, four workers each with a stream over the tree's file and one over
+/// the compact file, writes the same items as the tree holds, as does the serial one; so it
+/// does over the pio and the mmap streams, whose views of the compact file do not cut it
+void compact_parallel_test()
+{
+	const char fileName[] = "parallel.bpt";
+	const char compactFileName[] = "parallel_compact.bpt";
+	const size_t n = 200000;
+	const size_t threads = 4;
+
+	fstream bptFile;
+	BpTree::stream_type stream( bptFile);
+	create_bpt( fileName, bptFile);
+	BpTree bpt( 64);
+	if ( !bptFile.is_open() || !bpt.open( stream))
+	{
+		return;
+	}
+	for( size_t i = 0; i < n; ++i)
+	{
+		*bpt.insert( i * 7919 % n) = i;
+	}
+
+	for( int bitPack = 0; bitPack < 2; ++bitPack)
+	{
+		fstream inFiles[ threads], outFiles[ threads + 1];
+		BpTree::stream_type* inStreams[ threads];
+		BpTree::stream_type* outStreams[ threads + 1];
+		for( size_t i = 0; i < threads + 1; ++i)
+		{
+			if ( i < threads)
+			{
+				open_bpt( fileName, inFiles[ i]);
+				inStreams[ i] = new BpTree::stream_type( inFiles[ i]);
+			}
+			if ( i)
+			{
+				outFiles[ i].open( compactFileName, ios_base::in | ios_base::out | ios_base::binary, 64);
+			}
+			else
+			{
+				create_bpt( compactFileName, outFiles[ i]);
+			}
+			outStreams[ i] = new BpTree::stream_type( outFiles[ i]);
+		}
+
+		const VerifyStreams inOf = { inStreams };
+		const VerifyStreams outOf = { outStreams + 1 };
+		assert( bpt.compact_to( *outStreams[ 0], inOf, outOf, bitPack != 0, threads));
+		for( size_t i = 0; i < threads + 1; ++i)
+		{
+			if ( i < threads)
+			{
+				delete inStreams[ i];
+			}
+			delete outStreams[ i];
+			outFiles[ i].close();
+		}
+		check_compact( bpt, compactFileName);
+	}
+
+	compact_bpt( bpt, compactFileName, false);
+	check_compact( bpt, compactFileName);
+
+	compact_views<PioBpTree>( bpt, "parallel_pio.bpt", "parallel_pio_compact.bpt", threads);
+	compact_views<MmapBpTree>( bpt, "parallel_mmap.bpt", "parallel_mmap_compact.bpt", threads);
+}
+
+// an object of the size of a small node, not a multiple of a cache line
+struct PoolItem
+{
+	size_t	owner;
+	char	bytes[ 100];
+};
+
+typedef stdext::bp_tree_node_pool<PoolItem> ItemPool;
+
+// takes slots from the pool and gives them back, checking no other thread got them meanwhile
+struct PoolWorker
+{
+	ItemPool*	pool;
+	size_t		id;
+
+	void operator () ()
+	{
+		std::vector<PoolItem*> items;
+		for( int round = 0; round < 5000; ++round)
+		{
+			for( int i = 0; i < 16; ++i)
+			{
+				PoolItem* const item = pool->allocate();
+				if ( item)
+				{
+					item->owner = id;
+					items.push_back( item);
+				}
+			}
+			for( size_t i = 0; i < items.size(); ++i)
+			{
+				assert( items[ i]->owner == id);
+				pool->deallocate( items[ i]);
+			}
+			items.clear();
+		}
+	}
+};
+
+// takes every slot of pool, each once and on a cache line, then finds it exhausted
+static void take_all( ItemPool& pool, std::vector<PoolItem*>& items)
+{
+	std::set<PoolItem*> distinct;
+	for( size_t i = 0; i < pool.capacity(); ++i)
+	{
+		PoolItem* const item = pool.allocate();
+		assert( item && pool.owns( item) && size_t( item) % ItemPool::line_size == 0);
+		distinct.insert( item);
+		items.push_back( item);
+	}
+	assert( distinct.size() == pool.capacity() && !pool.allocate());
+}
+
+static std::atomic<long> allocatorNodes( 0);	// nodes taken from CountingAllocator and not given back
+static std::atomic<long> allocatorCalls( 0);
+
+// the allocator a tree falls back to when its slabs are exhausted, counting the nodes
+template <typename T>
+struct CountingAllocator: std::allocator<T>
+{
+	template <typename U>
+	struct rebind
+	{
+		typedef CountingAllocator<U> other;
+	};
+
+	CountingAllocator() {}
+	template <typename U>
+	CountingAllocator( const CountingAllocator<U>&) {}
+
+	T* allocate( const size_t n)
+	{
+		++allocatorNodes;
+		++allocatorCalls;
+		return std::allocator<T>::allocate( n);
+	}
+
+	void deallocate( T* const p, const size_t n)
+	{
+		--allocatorNodes;
+		std::allocator<T>::deallocate( p, n);
+	}
+};
+
+// nodes of a few slots, so most of what the cache holds are inner nodes, more than their slab
+struct PoolTraits: stdext::bp_tree_default_traits
+{
+	enum { slot_count = 4 };
+};
+
+typedef stdext::bp_tree<size_t, size_t, PoolTraits, BpTree::stream_type, void, CountingAllocator<size_t> > PoolBpTree;
+
+/// The node slab hands out each slot once until it is exhausted, takes them back from
+/// concurrent threads and rounds up to whole huge pages; a tree whose cache outgrows its inner
+/// slab takes the other nodes from its allocator and gives each node back where it came from
+void node_pool_test()
+{
+	ItemPool pool;
+	assert( pool.reserve( 48) && pool.capacity() == 48 && ItemPool::slot_size == 128);
+	std::vector<PoolItem*> items;
+	take_all( pool, items);
+	PoolItem outside;
+	assert( !pool.owns( &outside));
+	for( size_t i = 0; i < items.size(); ++i)
+	{
+		pool.deallocate( items[ i]);
+	}
+	items.clear();
+
+	// four threads wanting 64 slots of the 48, so some of their allocations find none
+	const size_t threads = 4;
+	PoolWorker workers[ threads];
+	std::vector<std::thread> running;
+	for( size_t i = 0; i < threads; ++i)
+	{
+		workers[ i].pool = &pool;
+		workers[ i].id = i;
+		running.push_back( std::thread( std::ref( workers[ i])));
+	}
+	for( size_t i = 0; i < threads; ++i)
+	{
+		running[ i].join();
+	}
+	take_all( pool, items);
+	items.clear();
+
+	// a huge page slab, or a normal one hinted to use them, holds whole huge pages
+	ItemPool huge;
+	assert( huge.reserve( 10, true));
+	assert( huge.capacity() == ItemPool::huge_size / ItemPool::slot_size);
+	take_all( huge, items);
+	for( size_t i = 0; i < items.size(); ++i)
+	{
+		huge.deallocate( items[ i]);
+	}
+	items.clear();
+
+	const char fileName[] = "pool.bpt";
+	const size_t n = 20000;
+	{
+		fstream bptFile;
+		PoolBpTree::stream_type stream( bptFile);
+		create_bpt( fileName, bptFile);
+		PoolBpTree bpt( 256);
+		if ( !bptFile.is_open() || !bpt.open( stream))
+		{
+			return;
+		}
+		for( size_t i = 0; i < n; ++i)
+		{
+			*bpt.insert( i * 7919 % n) = i;
+		}
+		for( size_t i = 0; i < n; ++i)
+		{
+			const PoolBpTree::const_iterator it = bpt.find( i * 7919 % n);
+			assert( it && *it == i);
 		}
+		assert( allocatorCalls > 0);
 	}
+	assert( allocatorNodes == 0);
 }
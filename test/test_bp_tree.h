@@ -1,13 +1,46 @@
 ﻿#pragma once
 #include "bp_tree.h"
 #include <iosfwd>
+#include <map>
+#include <vector>
 
 typedef stdext::bp_tree<size_t, size_t> BpTree;
+typedef std::map<size_t, size_t> ItemMap;
 
-void fill( BpTree& bpt);
+void fill( BpTree& bpt, ItemMap& m);
+void bulk_fill( BpTree& bpt, ItemMap& m, const float fill = 1);
+void batch_fill( BpTree& bpt, ItemMap& m);
+void erase_some( BpTree& bpt, ItemMap& m);
 void iterate_forward( BpTree& bpt);
 void iterate_backward( BpTree& bpt);
+void range_queries( const BpTree& bpt, const ItemMap& m);
+void multi_get( const BpTree& bpt, const ItemMap& m);
 void create_bpt( const char* fileName, std::fstream& bptFile);
 void open_bpt( const char* fileName, std::fstream& bptFile);
-void compact_bpt( BpTree& bpt, const char* fileName);
+void reopen_bpt( const char* fileName, std::fstream& bptFile);
+void compact_bpt( BpTree& bpt, const char* fileName, const bool bitPack = false);
+void check_compact( BpTree& bpt, const char* fileName);
+bool verify_bpt( const BpTree& bpt, const char* fileName, std::vector<size_t>& corrupt);
 void simple_test();
+void bulk_load_test();
+void erase_test();
+void range_test();
+void batch_test();
+void multi_get_test();
+void verify_test();
+void mmap_test();
+void pio_test();
+void wal_test();
+void wal_reopen_test();
+void format_test();
+void stats_test();
+void cache_policy_test();
+void page_test();
+void flusher_test();
+void checkpoint_test();
+void snapshot_test();
+void compact_parallel_test();
+void node_pool_test();
+void bench_key_search();
+void bench_concurrent_find();
+void bench_suite( const char* outFileName);